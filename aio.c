@@ -0,0 +1,355 @@
+#include "aio.h"
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Returns the request that ELEM is embedded in. */
+static inline struct aio_request *request_of(struct list_elem *elem) {
+    return list_entry(elem, struct aio_request, elem);
+}
+
+/* Sets up the io_uring backend of CTX.  Returns false if
+   io_uring is not available, leaving nothing to undo. */
+static bool uring_init(struct aio_context *ctx) {
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    ctx->ring_fd = syscall(__NR_io_uring_setup, AIO_ENTRIES, &p);
+    if (ctx->ring_fd < 0)
+        return false;
+
+    ctx->sq_entries = p.sq_entries;
+    ctx->inflight = 0;
+    ctx->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ctx->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* With a single mmap the two rings share one mapping. */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ctx->cq_ring_size > ctx->sq_ring_size)
+            ctx->sq_ring_size = ctx->cq_ring_size;
+        ctx->cq_ring_size = ctx->sq_ring_size;
+    }
+    ctx->sq_ring = mmap(NULL, ctx->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+                        IORING_OFF_SQ_RING);
+    if (ctx->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ctx->cq_ring = ctx->sq_ring;
+    }
+    else {
+        ctx->cq_ring = mmap(NULL, ctx->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+                            IORING_OFF_CQ_RING);
+        if (ctx->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+    ctx->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ctx->ring_fd, IORING_OFF_SQES);
+    if (ctx->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    if (syscall(__NR_io_uring_register, ctx->ring_fd,
+                IORING_REGISTER_EVENTFD, &ctx->event_fd, 1) < 0) {
+        munmap(ctx->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        goto fail_cq;
+    }
+
+    sq = (uint8_t *)ctx->sq_ring;
+    cq = (uint8_t *)ctx->cq_ring;
+    ctx->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ctx->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ctx->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ctx->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ctx->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ctx->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ctx->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ctx->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+
+fail_cq:
+    if (ctx->cq_ring != ctx->sq_ring)
+        munmap(ctx->cq_ring, ctx->cq_ring_size);
+fail_sq:
+    munmap(ctx->sq_ring, ctx->sq_ring_size);
+fail:
+    close(ctx->ring_fd);
+    return false;
+}
+
+static void uring_destroy(struct aio_context *ctx) {
+    munmap(ctx->sqes, ctx->sq_entries * sizeof(struct io_uring_sqe));
+    if (ctx->cq_ring != ctx->sq_ring)
+        munmap(ctx->cq_ring, ctx->cq_ring_size);
+    munmap(ctx->sq_ring, ctx->sq_ring_size);
+    close(ctx->ring_fd);
+}
+
+/* Moves as many held requests into the submission queue as the
+   completion queue is sure to have room for, then submits the
+   whole queue with one system call. */
+static void uring_flush(struct aio_context *ctx) {
+    unsigned tail = *ctx->sq_tail;
+    unsigned mask = *ctx->sq_mask;
+    unsigned to_submit;
+
+    while (!list_empty(&ctx->held) && ctx->inflight < ctx->sq_entries) {
+        struct aio_request *req = request_of(list_pop_front(&ctx->held));
+        unsigned index = tail & mask;
+        struct io_uring_sqe *sqe = &ctx->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        switch (req->op) {
+        case AIO_READ:
+            sqe->opcode = IORING_OP_READ;
+            break;
+        case AIO_WRITE:
+            sqe->opcode = IORING_OP_WRITE;
+            break;
+        case AIO_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            break;
+        }
+        sqe->fd = req->fd;
+        if (req->op != AIO_FSYNC) {
+            sqe->addr = (uint64_t)(uintptr_t)req->buf;
+            sqe->len = req->len;
+            sqe->off = req->offset;
+        }
+        sqe->user_data = (uint64_t)(uintptr_t)req;
+        ctx->sq_array[index] = index;
+        tail++;
+        ctx->inflight++;
+    }
+    __atomic_store_n(ctx->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* Includes anything the kernel left behind last time. */
+    to_submit = tail - __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE);
+    while (to_submit > 0 && syscall(__NR_io_uring_enter, ctx->ring_fd,
+                                    to_submit, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            if (errno != EAGAIN && errno != EBUSY)
+                perror("io_uring_enter");
+            break;
+        }
+    }
+}
+
+static size_t uring_reap(struct aio_context *ctx, struct list *done) {
+    unsigned head = *ctx->cq_head;
+    unsigned tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned mask = *ctx->cq_mask;
+    size_t cnt = 0;
+
+    for (; head != tail; head++, cnt++) {
+        struct io_uring_cqe *cqe = &ctx->cqes[head & mask];
+        struct aio_request *req =
+            (struct aio_request *)(uintptr_t)cqe->user_data;
+
+        req->result = cqe->res;
+        list_push_back(done, &req->elem);
+    }
+    __atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+    ctx->inflight -= cnt;
+    return cnt;
+}
+
+/* Runs REQ as a blocking call.  Returns its result. */
+static int64_t run_request(struct aio_request *req) {
+    ssize_t n = 0;
+
+    switch (req->op) {
+    case AIO_READ:
+        if (req->offset == AIO_OFFSET_NONE)
+            n = read(req->fd, req->buf, req->len);
+        else
+            n = pread(req->fd, req->buf, req->len, req->offset);
+        break;
+    case AIO_WRITE:
+        if (req->offset == AIO_OFFSET_NONE)
+            n = write(req->fd, req->buf, req->len);
+        else
+            n = pwrite(req->fd, req->buf, req->len, req->offset);
+        break;
+    case AIO_FSYNC:
+        n = fsync(req->fd);
+        break;
+    }
+    return n < 0 ? -errno : n;
+}
+
+static void *worker_main(void *aux) {
+    struct aio_context *ctx = (struct aio_context *)aux;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (list_empty(&ctx->queue) && !ctx->stopping)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        if (list_empty(&ctx->queue))
+            break;
+
+        struct aio_request *req = request_of(list_pop_front(&ctx->queue));
+        pthread_mutex_unlock(&ctx->lock);
+
+        uint64_t one = 1;
+        req->result = run_request(req);
+        mpsc_push(&ctx->done, &req->elem);
+        if (write(ctx->event_fd, &one, sizeof(one)) < 0)
+            perror("write(aio event_fd)");
+
+        pthread_mutex_lock(&ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Starts the thread pool backend of CTX.  Returns false if no
+   thread could be started. */
+static bool pool_init(struct aio_context *ctx) {
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    list_init(&ctx->queue);
+    mpsc_init(&ctx->done);
+    ctx->stopping = false;
+    for (ctx->nthreads = 0; ctx->nthreads < AIO_THREADS; ctx->nthreads++) {
+        if (pthread_create(&ctx->threads[ctx->nthreads], NULL, worker_main,
+                           ctx)) {
+            perror("pthread_create(aio)");
+            break;
+        }
+    }
+    if (ctx->nthreads == 0) {
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+        return false;
+    }
+    return true;
+}
+
+static void pool_destroy(struct aio_context *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    for (unsigned i = 0; i < ctx->nthreads; i++)
+        pthread_join(ctx->threads[i], NULL);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+}
+
+/* Initializes CTX, preferring io_uring unless FLAGS has
+   AIO_NO_URING.  Returns false, after reporting why, if neither
+   backend can be set up. */
+bool aio_init(struct aio_context *ctx, unsigned flags) {
+    assert(ctx != NULL);
+
+    ctx->pending = 0;
+    list_init(&ctx->held);
+    ctx->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctx->event_fd < 0) {
+        perror("eventfd(aio)");
+        return false;
+    }
+
+    ctx->uring = !(flags & AIO_NO_URING) && uring_init(ctx);
+    if (!ctx->uring && !pool_init(ctx)) {
+        close(ctx->event_fd);
+        return false;
+    }
+    return true;
+}
+
+/* Waits for every request submitted to CTX to finish, discarding
+   the results, and frees CTX's resources. */
+void aio_destroy(struct aio_context *ctx) {
+    struct list done;
+
+    list_init(&done);
+    while (ctx->pending > 0) {
+        aio_wait(ctx);
+        aio_reap(ctx, &done);
+    }
+
+    if (ctx->uring)
+        uring_destroy(ctx);
+    else
+        pool_destroy(ctx);
+    close(ctx->event_fd);
+}
+
+/* Queues REQ on CTX.  Nothing is started until aio_flush(). */
+void aio_submit(struct aio_context *ctx, struct aio_request *req) {
+    list_push_back(&ctx->held, &req->elem);
+    ctx->pending++;
+}
+
+/* Starts every request submitted to CTX since the last flush.
+   With io_uring, requests that don't fit in the ring stay held
+   until a later flush finds room. */
+void aio_flush(struct aio_context *ctx) {
+    if (ctx->uring) {
+        uring_flush(ctx);
+    }
+    else if (!list_empty(&ctx->held)) {
+        pthread_mutex_lock(&ctx->lock);
+        list_splice(list_end(&ctx->queue), list_begin(&ctx->held),
+                    list_end(&ctx->held));
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+/* Appends every request of CTX that has finished to DONE, with
+   its result filled in.  Never blocks.  Returns the number of
+   requests moved. */
+size_t aio_reap(struct aio_context *ctx, struct list *done) {
+    size_t cnt;
+
+    if (ctx->pending == 0)
+        return 0;
+
+    aio_clear_event(ctx);
+    if (ctx->uring)
+        cnt = uring_reap(ctx, done);
+    else
+        cnt = mpsc_drain(&ctx->done, done);
+    ctx->pending -= cnt;
+    return cnt;
+}
+
+/* Clears CTX's event_fd.  Completions that arrive after this
+   make it readable again.  A completion may signal event_fd only
+   after aio_reap() has taken it, so a caller that polls event_fd
+   clears it whenever it fires, or event_fd stays readable with
+   nothing left to reap. */
+void aio_clear_event(struct aio_context *ctx) {
+    uint64_t count;
+
+    if (read(ctx->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read(aio event_fd)");
+}
+
+/* Flushes CTX and blocks until at least one request may have
+   finished.  Returns straight away if nothing is pending. */
+void aio_wait(struct aio_context *ctx) {
+    struct pollfd pfd;
+
+    if (ctx->pending == 0)
+        return;
+
+    aio_flush(ctx);
+    pfd.fd = ctx->event_fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+        continue;
+}
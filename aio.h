@@ -0,0 +1,104 @@
+#ifndef __AIO_H
+#define __AIO_H
+
+/* Asynchronous file I/O.
+
+   Requests are `struct aio_request's owned by the caller, who
+   must keep each one, and its buffer, alive until it has come
+   back from aio_reap().  A request carries a `struct list_elem',
+   so completed requests are handed back as an ordinary list.
+
+   The preferred backend is an io_uring instance driven through
+   the raw system calls.  aio_submit() only fills in submission
+   queue entries; aio_flush() hands everything queued since the
+   last flush to the kernel in one io_uring_enter(), and
+   aio_reap() collects every completion that has arrived without
+   entering the kernel at all.  If io_uring is not available, or
+   AIO_NO_URING is passed to aio_init(), a small pool of threads
+   runs the requests as ordinary blocking calls instead, behind
+   the same interface.
+
+   Either way event_fd becomes readable whenever completions are
+   waiting, so it can be added to a poll or epoll set.  It may
+   also be left readable after the last of them has been reaped,
+   so whoever polls it should call aio_clear_event() when it
+   fires.
+
+   Everything except the worker threads is single threaded: one
+   thread at a time may submit, flush and reap. */
+
+#include "list.h"
+#include "mpsc.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Flags for aio_init(). */
+#define AIO_NO_URING 0x1 /* Always use the thread pool. */
+
+#define AIO_ENTRIES 256 /* Size of the io_uring submission queue. */
+#define AIO_THREADS 4   /* Threads in the fallback pool. */
+
+/* Pass as offset to use, and advance, the file position. */
+#define AIO_OFFSET_NONE UINT64_MAX
+
+/* Operations. */
+enum aio_op {
+    AIO_READ,
+    AIO_WRITE,
+    AIO_FSYNC
+};
+
+/* One request. */
+struct aio_request {
+    struct list_elem elem;
+    enum aio_op op;
+    int fd;
+    void *buf;
+    size_t len;
+    uint64_t offset;
+    int64_t result; /* Bytes transferred, 0 for fsync, or -errno. */
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* I/O context. */
+struct aio_context {
+    int event_fd;     /* Readable while completions are waiting. */
+    size_t pending;   /* Submitted and not yet reaped. */
+    bool uring;       /* io_uring backend, else the thread pool. */
+    struct list held; /* Submitted but not yet flushed. */
+
+    /* io_uring backend. */
+    int ring_fd;
+    unsigned sq_entries;
+    size_t inflight; /* Handed to the kernel, not yet reaped. */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+
+    /* Thread pool backend. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list queue;      /* Waiting for a thread. */
+    struct mpsc_queue done; /* Finished, waiting for aio_reap(). */
+    bool stopping;
+    unsigned nthreads;
+    pthread_t threads[AIO_THREADS];
+};
+
+bool aio_init(struct aio_context *, unsigned flags);
+void aio_destroy(struct aio_context *);
+
+void aio_submit(struct aio_context *, struct aio_request *);
+void aio_flush(struct aio_context *);
+size_t aio_reap(struct aio_context *, struct list *done);
+void aio_clear_event(struct aio_context *);
+void aio_wait(struct aio_context *);
+
+#endif /* aio.h */
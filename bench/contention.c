@@ -0,0 +1,294 @@
+/* Scalability harness: one scheduler driven from many threads.
+
+   Starter threads start tasks on the scheduler while stopper
+   threads stop them again, and this thread runs the ticks, with
+   scheduler_run_parallel if given more than one worker.  Tasks
+   live in a fixed set of slots.  A starter claims a free slot and
+   starts a task_new_in task for it; the task's init marks the slot
+   live, a stopper claims a live slot and stops its task, and the
+   task's destroy frees the slot.  The ratio of starters to stoppers
+   sets which side is short of slots, so each side can be loaded
+   on its own.
+
+   The scheduler has no lock on the start and stop paths: both are
+   a push onto a lock-free queue, and a stop a compare-and-swap of
+   the task's state, drained once per tick.  So rather than hold
+   and wait times of a lock, the harness reports what the callers
+   feel, the latency of each scheduler_start and scheduler_stop
+   call, and what the tasks feel, the time from scheduler_start to
+   init.  The only lock, the worker pool's, shows up as lock_wait_ns
+   when scheduler.c is built with SCHEDULER_STATS=1.  Hardware and
+   software counters for the whole process come from
+   perf_event_open(), where the kernel allows it.
+
+   Output is a JSON object, as for bench/suite.
+
+   Usage: bench/contention [-s starters] [-k stoppers] [-w workers]
+                           [-n slots] [-c run ns] [-t seconds] */
+
+#include "../hist.h"
+#include "../scheduler.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Slot states. */
+enum {
+    FREE,     /* No task, for a starter to claim. */
+    STARTING, /* Started, not initialized yet. */
+    LIVE,     /* Running, for a stopper to claim. */
+    STOPPING, /* Stopped, not destroyed yet. */
+};
+
+struct slot {
+    int state;           /* Atomic. */
+    struct task *task;   /* While STARTING or LIVE. */
+    uint64_t started_at; /* When scheduler_start was called. */
+} __attribute__((aligned(64)));
+
+static struct scheduler *sched;
+static struct slot *slots;
+static unsigned nslots;
+static uint64_t run_ns;
+static bool done; /* Atomic, tells the clients to finish. */
+
+static struct hist start_hist; /* scheduler_start calls. */
+static struct hist stop_hist;  /* scheduler_stop calls. */
+static struct hist init_hist;  /* scheduler_start to init. */
+
+static void slot_init(void *aux) {
+    struct slot *slot = aux;
+    hist_record(&init_hist, now_ns() - slot->started_at);
+    __atomic_store_n(&slot->state, LIVE, __ATOMIC_RELEASE);
+}
+
+static void slot_run(void *aux) {
+    uint64_t until = run_ns ? now_ns() + run_ns : 0;
+    (void)aux;
+    while (until && now_ns() < until)
+        continue;
+}
+
+static void slot_destroy(void *aux) {
+    struct slot *slot = aux;
+    __atomic_store_n(&slot->state, FREE, __ATOMIC_RELEASE);
+}
+
+static void nop(void *aux) {
+    (void)aux;
+}
+
+static bool never_done(void *aux) {
+    (void)aux;
+    return false;
+}
+
+struct client {
+    pthread_t thread;
+    unsigned id;
+    bool stopper;
+    unsigned long calls;  /* scheduler_start or scheduler_stop calls. */
+    unsigned long misses; /* Slots looked at and passed over. */
+};
+
+/* Claims slot I from state FROM for state TO. */
+static bool claim(unsigned i, int from, int to) {
+    return __atomic_compare_exchange_n(&slots[i].state, &from, to, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static void *client_main(void *aux) {
+    struct client *c = aux;
+    unsigned i = c->id * 7919 % nslots;
+
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        struct slot *slot = &slots[i];
+        uint64_t start;
+
+        i = (i + 1) % nslots;
+        if (!c->stopper && claim(slot - slots, FREE, STARTING)) {
+            slot->task = task_new_in(sched, slot_init, slot_run,
+                                     slot_destroy, nop, never_done, slot);
+            start = now_ns();
+            slot->started_at = start;
+            scheduler_start(sched, slot->task);
+            hist_record(&start_hist, now_ns() - start);
+            c->calls++;
+        }
+        else if (c->stopper && claim(slot - slots, LIVE, STOPPING)) {
+            start = now_ns();
+            scheduler_stop(sched, slot->task);
+            hist_record(&stop_hist, now_ns() - start);
+            c->calls++;
+        }
+        else {
+            c->misses++;
+        }
+    }
+    return NULL;
+}
+
+/* Counters read with perf_event_open(), for every thread of the
+   process. */
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counters[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "context_switches", PERF_TYPE_SOFTWARE,
+      PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+/* Opens counter I, counting from now on for this thread and the
+   threads it creates.  Returns the fd, or -1 with errno set. */
+static int counter_open(size_t i) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    /* Context switches happen in the kernel, so only hardware
+       counters leave it out. */
+    attr.exclude_kernel = counters[i].type == PERF_TYPE_HARDWARE;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Prints the latency quantiles of H, under NAME. */
+static void emit_hist(const char *name, struct hist *h) {
+    struct hist snap;
+
+    hist_snapshot(h, &snap, false);
+    printf(",\n  \"%s\": {\"count\": %lu, \"p50\": %lu, \"p99\": %lu, "
+           "\"p999\": %lu, \"max\": %lu}",
+           name, (unsigned long)hist_count(&snap),
+           (unsigned long)hist_quantile(&snap, 0.5),
+           (unsigned long)hist_quantile(&snap, 0.99),
+           (unsigned long)hist_quantile(&snap, 0.999),
+           (unsigned long)hist_quantile(&snap, 1));
+}
+
+int main(int argc, char **argv) {
+    unsigned nstarters = 2, nstoppers = 2, nworkers = 1;
+    double seconds = 2;
+    struct client *clients;
+    unsigned nclients;
+    int fds[NCOUNTERS];
+    int opt;
+    unsigned long ticks = 0, starts = 0, stops = 0, misses = 0;
+    uint64_t start, elapsed;
+    struct scheduler_stats stats;
+
+    nslots = 1024;
+    while ((opt = getopt(argc, argv, "s:k:w:n:c:t:")) != -1) {
+        switch (opt) {
+        case 's': nstarters = atoi(optarg); break;
+        case 'k': nstoppers = atoi(optarg); break;
+        case 'w': nworkers = atoi(optarg); break;
+        case 'n': nslots = atoi(optarg); break;
+        case 'c': run_ns = atol(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s starters] [-k stoppers] "
+                            "[-w workers] [-n slots] [-c run ns] "
+                            "[-t seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nslots == 0)
+        nslots = 1;
+
+    sched = scheduler_new();
+    slots = aligned_alloc(64, nslots * sizeof(*slots));
+    memset(slots, 0, nslots * sizeof(*slots));
+    hist_init(&start_hist);
+    hist_init(&stop_hist);
+    hist_init(&init_hist);
+
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        fds[i] = counter_open(i);
+        if (fds[i] < 0)
+            fprintf(stderr, "perf_event_open %s: %s\n", counters[i].name,
+                    strerror(errno));
+    }
+
+    nclients = nstarters + nstoppers;
+    clients = calloc(nclients ? nclients : 1, sizeof(*clients));
+    start = now_ns();
+    for (unsigned i = 0; i < nclients; i++) {
+        clients[i].id = i;
+        clients[i].stopper = i >= nstarters;
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+    while (now_ns() - start < seconds * 1e9) {
+        scheduler_run_parallel(sched, nworkers);
+        ticks++;
+    }
+    __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < nclients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        if (clients[i].stopper)
+            stops += clients[i].calls;
+        else
+            starts += clients[i].calls;
+        misses += clients[i].misses;
+    }
+    elapsed = now_ns() - start;
+
+    printf("{\"bench\": \"contention\", \"starters\": %u, \"stoppers\": %u, "
+           "\"workers\": %u, \"slots\": %u, \"run_ns\": %lu",
+           nstarters, nstoppers, nworkers, nslots, (unsigned long)run_ns);
+    printf(",\n  \"seconds\": %.3f, \"ticks_per_s\": %.0f, "
+           "\"starts_per_s\": %.0f, \"stops_per_s\": %.0f, "
+           "\"misses_per_s\": %.0f",
+           elapsed / 1e9, ticks * 1e9 / elapsed, starts * 1e9 / elapsed,
+           stops * 1e9 / elapsed, misses * 1e9 / elapsed);
+    emit_hist("start_call_ns", &start_hist);
+    emit_hist("stop_call_ns", &stop_hist);
+    emit_hist("start_to_init_ns", &init_hist);
+    if (scheduler_get_stats(sched, &stats))
+        printf(",\n  \"lock_wait_ns\": %lu", (unsigned long)stats.lock_wait_ns);
+    else
+        printf(",\n  \"lock_wait_ns\": null");
+
+    printf(",\n  \"counters\": {");
+    for (size_t i = 0; i < NCOUNTERS; i++) {
+        uint64_t value;
+        printf("%s\"%s\": ", i ? ", " : "", counters[i].name);
+        if (fds[i] >= 0 && read(fds[i], &value, sizeof(value)) ==
+                               (ssize_t)sizeof(value))
+            printf("%lu", (unsigned long)value);
+        else
+            printf("null");
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    printf("}\n}\n");
+
+    scheduler_free(sched);
+    free(clients);
+    free(slots);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/* Compares the cost of a coroutine task's turn (resume, then
+   task_yield back) with a plain run and is_done call and with a
+   single step call, and measures a bare coro_resume/coro_yield
+   round trip.
+
+   Usage: bench/coro [tasks] [ticks] */
+
+#include "../coro.h"
+#include "../scheduler.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct counter {
+    unsigned long runs;
+    unsigned long limit;
+};
+
+static void plain_run(void *aux) {
+    struct counter *c = aux;
+    c->runs++;
+}
+
+static bool plain_done(void *aux) {
+    struct counter *c = aux;
+    return c->runs >= c->limit;
+}
+
+static void plain_interrupt(void *aux) {
+    struct counter *c = aux;
+    c->runs = c->limit;
+}
+
+static enum task_status step_fn(void *aux, uint64_t *wake_ns) {
+    struct counter *c = aux;
+    (void)wake_ns;
+    return ++c->runs >= c->limit ? TASK_DONE : TASK_CONTINUE;
+}
+
+static void coro_body(void *aux) {
+    struct counter *c = aux;
+    while (++c->runs < c->limit)
+        task_yield();
+}
+
+static void bare_body(void *aux) {
+    struct counter *c = aux;
+    while (++c->runs < c->limit)
+        coro_yield();
+}
+
+enum kind { PLAIN, STEP, CORO };
+
+/* Runs NTASKS tasks of the given kind for NTICKS ticks and
+   returns the mean ns per task per tick. */
+static double run_tasks(enum kind kind, unsigned ntasks,
+                        unsigned long nticks) {
+    struct scheduler *sched = scheduler_new();
+    struct counter *counters = calloc(ntasks, sizeof(*counters));
+    struct task **tasks = calloc(ntasks, sizeof(*tasks));
+    uint64_t start, end;
+
+    for (unsigned i = 0; i < ntasks; i++) {
+        counters[i].limit = nticks;
+        if (kind == CORO)
+            tasks[i] = task_new_coro(NULL, coro_body, NULL, NULL,
+                                     &counters[i]);
+        else if (kind == STEP)
+            tasks[i] = task_new_step(NULL, step_fn, NULL, NULL,
+                                     &counters[i]);
+        else
+            tasks[i] = task_new(NULL, plain_run, NULL, plain_interrupt,
+                                plain_done, &counters[i]);
+    }
+    scheduler_start_batch(sched, tasks, ntasks);
+    /* The first tick initializes the tasks and maps the stacks. */
+    scheduler_run(sched);
+
+    start = now_ns();
+    for (unsigned long t = 1; t < nticks; t++)
+        scheduler_run(sched);
+    end = now_ns();
+
+    scheduler_free(sched);
+    for (unsigned i = 0; i < ntasks; i++)
+        task_free(tasks[i]);
+    free(tasks);
+    free(counters);
+    return (double)(end - start) / ((double)ntasks * (nticks - 1));
+}
+
+/* Returns the mean ns for one resume and yield back. */
+static double bare_switch(unsigned long n) {
+    struct coro_stack_pool pool;
+    struct counter c = { 0, n };
+    struct coro *co;
+    uint64_t start, end;
+
+    coro_pool_init(&pool, CORO_STACK_SIZE);
+    co = coro_new(&pool, bare_body, &c);
+    start = now_ns();
+    while (!coro_resume(co))
+        continue;
+    end = now_ns();
+    coro_free(&pool, co);
+    coro_pool_destroy(&pool);
+    return (double)(end - start) / n;
+}
+
+int main(int argc, char **argv) {
+    unsigned ntasks = argc > 1 ? atoi(argv[1]) : 1000;
+    unsigned long nticks = argc > 2 ? atol(argv[2]) : 1000;
+
+    printf("%u tasks, %lu ticks\n", ntasks, nticks);
+    printf("plain run:         %8.1f ns per task per tick\n",
+           run_tasks(PLAIN, ntasks, nticks));
+    printf("step call:         %8.1f ns per task per tick\n",
+           run_tasks(STEP, ntasks, nticks));
+    printf("coroutine turn:    %8.1f ns per task per tick\n",
+           run_tasks(CORO, ntasks, nticks));
+    printf("resume/yield pair: %8.1f ns\n", bare_switch(10 * 1000 * 1000));
+    return 0;
+}
@@ -0,0 +1,143 @@
+/* Compares deadline misses under SCHEDULER_FIFO and SCHEDULER_EDF.
+
+   Each tick is released once per period.  Every task spins for a
+   fixed cost each tick and must be done within its own slack of the
+   release; the costs are scaled so that a tick takes `load' periods
+   of CPU.  FIFO runs the tasks in start order whatever their slack,
+   EDF runs the tightest first.  Near and past full load, which the
+   wake-up latency of the tick brings closer, EDF is expected to do
+   worse than FIFO: once late, every task is late (the domino
+   effect).
+
+   Usage: bench/edf [tasks] [ticks] */
+
+#include "../scheduler.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PERIOD_NS 1000000
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Release time of the next tick, for the tasks to set their next
+   deadline against. */
+static uint64_t next_release;
+
+struct job {
+    struct task *task;
+    uint64_t cost;
+    uint64_t slack;
+    unsigned long runs;
+    unsigned long limit;
+};
+
+static void job_run(void *aux) {
+    struct job *j = aux;
+    uint64_t end = now_ns() + j->cost;
+
+    while (now_ns() < end)
+        continue;
+    task_set_deadline(j->task, next_release + j->slack);
+    j->runs++;
+}
+
+static bool job_done(void *aux) {
+    struct job *j = aux;
+    return j->runs >= j->limit;
+}
+
+static void job_interrupt(void *aux) {
+    struct job *j = aux;
+    j->runs = j->limit;
+}
+
+/* Runs NJOBS jobs for NTICKS ticks under POLICY and returns the
+   fraction of runs that missed their deadline. */
+static double run_jobs(enum scheduler_policy policy,
+                       const struct job *proto,
+                       unsigned njobs,
+                       unsigned long nticks) {
+    struct scheduler *sched = scheduler_new_policy(policy);
+    struct job *jobs = malloc(njobs * sizeof(*jobs));
+    struct scheduler_deadline_stats stats;
+    uint64_t release = now_ns() + PERIOD_NS;
+
+    next_release = release;
+    for (unsigned i = 0; i < njobs; i++) {
+        jobs[i] = proto[i];
+        jobs[i].limit = nticks;
+        jobs[i].task = task_new(NULL, job_run, NULL, job_interrupt,
+                                job_done, &jobs[i]);
+        task_set_deadline(jobs[i].task, release + jobs[i].slack);
+        scheduler_start(sched, jobs[i].task);
+    }
+    for (unsigned long t = 0; t < nticks; t++) {
+        uint64_t now;
+
+        sleep_until(release);
+        /* An overrun tick pushes the schedule back rather than
+           leaving every later tick behind. */
+        now = now_ns();
+        if (now > release + PERIOD_NS)
+            release = now;
+        next_release = release + PERIOD_NS;
+        scheduler_run(sched);
+        release = next_release;
+    }
+    scheduler_deadline_stats(sched, &stats);
+
+    scheduler_free(sched);
+    for (unsigned i = 0; i < njobs; i++)
+        task_free(jobs[i].task);
+    free(jobs);
+    return stats.met + stats.missed
+               ? (double)stats.missed / (stats.met + stats.missed)
+               : 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned njobs = argc > 1 ? atoi(argv[1]) : 50;
+    unsigned long nticks = argc > 2 ? atol(argv[2]) : 2000;
+    static const double loads[] = { 0.5, 0.8, 0.95, 1.1 };
+    struct job *proto = calloc(njobs, sizeof(*proto));
+    uint64_t total = 0;
+
+    /* Costs of 10-40us before scaling to the load, and slack of
+       100us-1ms, unrelated to start order. */
+    srand(1);
+    for (unsigned i = 0; i < njobs; i++) {
+        proto[i].cost = 10000 + rand() % 30000;
+        proto[i].slack = 100000 + rand() % 900000;
+        total += proto[i].cost;
+    }
+
+    printf("%u tasks, %lu ticks, %d us period\n", njobs, nticks,
+           PERIOD_NS / 1000);
+    printf("load    FIFO missed  EDF missed\n");
+    for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+        struct job *scaled = calloc(njobs, sizeof(*scaled));
+        double fifo, edf;
+
+        for (unsigned i = 0; i < njobs; i++) {
+            scaled[i] = proto[i];
+            scaled[i].cost = proto[i].cost * loads[l] * PERIOD_NS / total;
+        }
+        fifo = run_jobs(SCHEDULER_FIFO, scaled, njobs, nticks);
+        edf = run_jobs(SCHEDULER_EDF, scaled, njobs, nticks);
+        printf("%4.2f  %10.1f%%  %9.1f%%\n", loads[l], 100 * fifo, 100 * edf);
+        free(scaled);
+    }
+    free(proto);
+    return 0;
+}
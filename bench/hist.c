@@ -0,0 +1,85 @@
+/* Measures what hist_record() costs, from one thread and from
+   several recording into the same histogram at once, as the
+   workers of scheduler_run_parallel do.  The values are spread
+   over a few hundred buckets, like real latencies.
+
+   Usage: bench/hist [records] [threads] */
+
+#include "../hist.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* CPU time of the calling thread, so that threads taking turns on
+   fewer cores than there are threads still measure each record. */
+static uint64_t thread_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct hist hist;
+static unsigned long nrecords;
+
+struct recorder {
+    pthread_t thread;
+    unsigned seed;
+    uint64_t ns;
+};
+
+static void *record(void *aux) {
+    struct recorder *r = aux;
+    uint64_t x = r->seed * 2654435761u + 1;
+    uint64_t start = thread_ns();
+
+    for (unsigned long i = 0; i < nrecords; i++) {
+        /* xorshift, shifted down to values up to about 1 ms. */
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        hist_record(&hist, x >> (44 + (x & 15)));
+    }
+    r->ns = thread_ns() - start;
+    return NULL;
+}
+
+/* Records nrecords values from each of NTHREADS threads and returns
+   the mean CPU ns per record. */
+static double run(unsigned nthreads) {
+    struct recorder r[64];
+    uint64_t ns = 0;
+
+    hist_init(&hist);
+    for (unsigned i = 0; i < nthreads; i++) {
+        r[i].seed = i;
+        pthread_create(&r[i].thread, NULL, record, &r[i]);
+    }
+    for (unsigned i = 0; i < nthreads; i++) {
+        pthread_join(r[i].thread, NULL);
+        ns += r[i].ns;
+    }
+    return (double)ns / ((double)nrecords * nthreads);
+}
+
+int main(int argc, char **argv) {
+    unsigned nthreads = argc > 2 ? atoi(argv[2]) : 4;
+    struct hist snapshot;
+
+    nrecords = argc > 1 ? atol(argv[1]) : 10 * 1000 * 1000;
+    if (nthreads < 1 || nthreads > 64)
+        nthreads = 4;
+
+    printf("%lu records per thread\n", nrecords);
+    printf("1 thread:   %6.1f ns per record\n", run(1));
+    printf("%u threads: %6.1f ns per record\n", nthreads, run(nthreads));
+
+    hist_snapshot(&hist, &snapshot, true);
+    printf("p50 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+           (unsigned long)hist_quantile(&snapshot, 0.5),
+           (unsigned long)hist_quantile(&snapshot, 0.99),
+           (unsigned long)hist_quantile(&snapshot, 0.999),
+           (unsigned long)hist_quantile(&snapshot, 1));
+    return 0;
+}
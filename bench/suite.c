@@ -0,0 +1,307 @@
+/* Benchmark suite, for tracking performance across versions.
+
+   Each case is run REPEATS times and the fastest run is kept, so
+   that one-off noise such as a page fault storm or a preemption
+   does not show up as a regression.  Results go to stdout as a
+   single JSON object, one case per line:
+
+     {"bench": "suite", "repeats": 3, "results": [
+       {"case": "tick", "tasks": 1000, "ops": ..., "ns_per_op": ...},
+       ...
+     ]}
+
+   so two runs can be compared with jq or a plain diff.  The cases:
+
+   tick: a tick over that many no-op tasks, per task.
+   task_new_free: a task_new and task_free pair.
+   start_stop: a scheduler_start and, later, a scheduler_stop from
+   each of that many producer threads at once, per call, including
+   the ticks that take the tasks in and out.
+   oneshot: a fire-and-forget task_new_in one-shot task, from start
+   to removal.
+   list_sort: list_sort of that many elements, per element.
+   list_insert_ordered: list_insert_ordered into a list growing to
+   that many elements, per insert.
+
+   Usage: bench/suite [max tasks] [max producers] > results.json
+
+   Build with the -O3 CFLAGS in the makefile for meaningful numbers;
+   the default debug flags measure the -O0 code. */
+
+#include "../list.h"
+#include "../scheduler.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define REPEATS 3
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Prints one result, with PARAM (say "tasks") set to VALUE unless
+   PARAM is NULL. */
+static void emit(const char *name,
+                 const char *param,
+                 unsigned long value,
+                 unsigned long ops,
+                 double ns) {
+    static bool first = true;
+
+    printf("%s\n  {\"case\": \"%s\"", first ? "" : ",", name);
+    if (param)
+        printf(", \"%s\": %lu", param, value);
+    printf(", \"ops\": %lu, \"ns_per_op\": %.2f}", ops, ns / ops);
+    fflush(stdout);
+    first = false;
+}
+
+static void nop(void *aux) {
+    (void)aux;
+}
+
+static bool never_done(void *aux) {
+    (void)aux;
+    return false;
+}
+
+/* Calls into the tasks of a case, from the scheduler's thread. */
+struct counts {
+    unsigned long inits;
+    unsigned long destroys;
+};
+
+static void count_init(void *aux) {
+    ((struct counts *)aux)->inits++;
+}
+
+static void count_destroy(void *aux) {
+    ((struct counts *)aux)->destroys++;
+}
+
+/* Returns the ns for NTICKS ticks over NTASKS no-op tasks, after a
+   first tick to initialize them. */
+static uint64_t tick(unsigned ntasks, unsigned long nticks) {
+    struct scheduler *sched = scheduler_new();
+    struct task **tasks = calloc(ntasks, sizeof(*tasks));
+    uint64_t start, end;
+
+    for (unsigned i = 0; i < ntasks; i++)
+        tasks[i] = task_new(NULL, nop, NULL, nop, never_done, NULL);
+    scheduler_start_batch(sched, tasks, ntasks);
+    scheduler_run(sched);
+
+    start = now_ns();
+    for (unsigned long t = 0; t < nticks; t++)
+        scheduler_run(sched);
+    end = now_ns();
+
+    scheduler_free(sched);
+    for (unsigned i = 0; i < ntasks; i++)
+        task_free(tasks[i]);
+    free(tasks);
+    return end - start;
+}
+
+/* Returns the ns for N task_new and task_free pairs, in batches so
+   that the allocator sees some tasks live at once. */
+static uint64_t task_new_free(unsigned long n) {
+    struct task *batch[256];
+    uint64_t start = now_ns();
+
+    for (unsigned long done = 0; done < n; done += 256) {
+        for (unsigned i = 0; i < 256; i++)
+            batch[i] = task_new(NULL, nop, NULL, NULL, NULL, NULL);
+        for (unsigned i = 0; i < 256; i++)
+            task_free(batch[i]);
+    }
+    return now_ns() - start;
+}
+
+struct producer {
+    pthread_t thread;
+    struct scheduler *sched;
+    struct task **tasks;
+    unsigned ntasks;
+    bool stop; /* Stop the tasks rather than start them. */
+};
+
+static void *produce(void *aux) {
+    struct producer *p = aux;
+
+    for (unsigned i = 0; i < p->ntasks; i++) {
+        if (p->stop)
+            scheduler_stop(p->sched, p->tasks[i]);
+        else
+            scheduler_start(p->sched, p->tasks[i]);
+    }
+    return NULL;
+}
+
+/* Runs NPRODUCERS threads that each call scheduler_start, or
+   scheduler_stop if STOP, on their share of the tasks, while this
+   thread ticks SCHED until *COUNTER reaches WANT. */
+static void produce_all(struct scheduler *sched,
+                        struct producer *producers,
+                        unsigned nproducers,
+                        bool stop,
+                        unsigned long *counter,
+                        unsigned long want) {
+    for (unsigned i = 0; i < nproducers; i++) {
+        producers[i].stop = stop;
+        pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+    }
+    while (*counter < want)
+        scheduler_run(sched);
+    for (unsigned i = 0; i < nproducers; i++)
+        pthread_join(producers[i].thread, NULL);
+}
+
+/* Returns the ns for NPRODUCERS threads to start NTASKS tasks
+   between them, until every task has been initialized, and then to
+   stop them all, until every task has been destroyed. */
+static uint64_t start_stop(unsigned nproducers, unsigned ntasks) {
+    struct scheduler *sched = scheduler_new();
+    struct task **tasks = calloc(ntasks, sizeof(*tasks));
+    struct producer *producers = calloc(nproducers, sizeof(*producers));
+    struct counts counts = { 0, 0 };
+    uint64_t start, end;
+
+    for (unsigned i = 0; i < ntasks; i++)
+        tasks[i] = task_new(count_init, nop, count_destroy, nop, never_done,
+                            &counts);
+    for (unsigned i = 0; i < nproducers; i++) {
+        unsigned from = (uint64_t)ntasks * i / nproducers;
+        unsigned to = (uint64_t)ntasks * (i + 1) / nproducers;
+        producers[i].sched = sched;
+        producers[i].tasks = tasks + from;
+        producers[i].ntasks = to - from;
+    }
+
+    start = now_ns();
+    produce_all(sched, producers, nproducers, false, &counts.inits, ntasks);
+    produce_all(sched, producers, nproducers, true, &counts.destroys,
+                ntasks);
+    end = now_ns();
+
+    scheduler_free(sched);
+    for (unsigned i = 0; i < ntasks; i++)
+        task_free(tasks[i]);
+    free(producers);
+    free(tasks);
+    return end - start;
+}
+
+/* Returns the ns to run NTASKS one-shot tasks from task_new_in,
+   started BATCH at a time with a tick after each batch, until the
+   last of them has been destroyed. */
+static uint64_t oneshot(unsigned long ntasks, unsigned batch) {
+    struct scheduler *sched = scheduler_new();
+    struct counts counts = { 0, 0 };
+    uint64_t start = now_ns(), end;
+
+    for (unsigned long started = 0; started < ntasks; started += batch) {
+        for (unsigned i = 0; i < batch; i++)
+            scheduler_start(sched, task_new_in(sched, NULL, nop,
+                                               count_destroy, NULL, NULL,
+                                               &counts));
+        scheduler_run(sched);
+    }
+    while (counts.destroys < ntasks)
+        scheduler_run(sched);
+    end = now_ns();
+
+    scheduler_free(sched);
+    return end - start;
+}
+
+struct item {
+    struct list_elem elem;
+    unsigned key;
+};
+
+static bool item_less(const struct list_elem *a,
+                      const struct list_elem *b,
+                      void *aux) {
+    (void)aux;
+    return list_entry(a, struct item, elem)->key <
+           list_entry(b, struct item, elem)->key;
+}
+
+/* Returns the ns for list_sort of N elements with random keys, or
+   for inserting them one by one with list_insert_ordered if
+   INSERT. */
+static uint64_t list_case(unsigned n, bool insert) {
+    struct item *items = calloc(n, sizeof(*items));
+    struct list list;
+    uint64_t start, end;
+
+    srand(1);
+    for (unsigned i = 0; i < n; i++)
+        items[i].key = rand();
+    list_init(&list);
+
+    start = now_ns();
+    if (insert) {
+        for (unsigned i = 0; i < n; i++)
+            list_insert_ordered(&list, &items[i].elem, item_less, NULL);
+    }
+    else {
+        for (unsigned i = 0; i < n; i++)
+            list_push_back(&list, &items[i].elem);
+        list_sort(&list, item_less, NULL);
+    }
+    end = now_ns();
+
+    free(items);
+    return end - start;
+}
+
+/* Runs CALL REPEATS times and returns the fastest. */
+#define BEST(CALL)                                                         \
+    ({                                                                     \
+        uint64_t best_ = UINT64_MAX;                                       \
+        for (int r_ = 0; r_ < REPEATS; r_++) {                             \
+            uint64_t ns_ = (CALL);                                         \
+            if (ns_ < best_)                                               \
+                best_ = ns_;                                               \
+        }                                                                  \
+        best_;                                                             \
+    })
+
+int main(int argc, char **argv) {
+    unsigned max_tasks = argc > 1 ? atoi(argv[1]) : 1000 * 1000;
+    unsigned max_producers = argc > 2 ? atoi(argv[2]) : 8;
+
+    printf("{\"bench\": \"suite\", \"repeats\": %d, \"results\": [", REPEATS);
+
+    /* About 10M task runs per size, and at least 3 ticks. */
+    for (unsigned n = 1; n <= max_tasks; n *= 10) {
+        unsigned long nticks = 10 * 1000 * 1000 / n;
+        if (nticks < 3)
+            nticks = 3;
+        emit("tick", "tasks", n, nticks * n, BEST(tick(n, nticks)));
+    }
+
+    emit("task_new_free", NULL, 0, 1000 * 1000,
+         BEST(task_new_free(1000 * 1000)));
+
+    for (unsigned p = 1; p <= max_producers; p *= 2)
+        emit("start_stop", "producers", p, 2 * 200 * 1000,
+             BEST(start_stop(p, 200 * 1000)));
+
+    emit("oneshot", NULL, 0, 1000 * 1000, BEST(oneshot(1000 * 1000, 1000)));
+
+    for (unsigned n = 1000; n <= 100 * 1000; n *= 10)
+        emit("list_sort", "elems", n, n, BEST(list_case(n, false)));
+    for (unsigned n = 100; n <= 10 * 1000; n *= 10)
+        emit("list_insert_ordered", "elems", n, n, BEST(list_case(n, true)));
+
+    printf("\n]}\n");
+    return 0;
+}
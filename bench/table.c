@@ -0,0 +1,152 @@
+/* Compares a tick over linked tasks with one over the dense task
+   table from scheduler_add, for many tiny tasks.  Linked tasks are
+   run both in allocation order and in a shuffled order, as a long
+   lived scheduler with tasks coming and going ends up with.
+
+   A second comparison has only 1% of the tasks with anything to do
+   on each tick: polled table tasks that check a flag of their own,
+   against waiting ones from scheduler_add_waiting that are readied
+   instead.
+
+   Usage: bench/table [tasks] [ticks] */
+
+#include "../scheduler.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void count_run(void *aux) {
+    (*(unsigned long *)aux)++;
+}
+
+static bool never_done(void *aux) {
+    (void)aux;
+    return false;
+}
+
+static void nop(void *aux) {
+    (void)aux;
+}
+
+/* Counts the runs in which its flag was set, and clears it. */
+static void flag_run(void *aux) {
+    unsigned long *counter = aux;
+    if (*counter & 1)
+        *counter += 1;
+}
+
+enum layout { LINKED, SHUFFLED, TABLE };
+
+/* Runs NTASKS tasks in the given layout for NTICKS ticks and
+   returns the mean ns per task per tick. */
+static double run_tasks(enum layout layout, unsigned ntasks,
+                        unsigned long nticks) {
+    struct scheduler *sched = scheduler_new();
+    unsigned long *counters = calloc(ntasks, sizeof(*counters));
+    struct task **tasks = NULL;
+    uint64_t start, end;
+
+    if (layout == TABLE) {
+        for (unsigned i = 0; i < ntasks; i++)
+            scheduler_add(sched, NULL, count_run, NULL, nop, never_done,
+                          &counters[i]);
+    }
+    else {
+        tasks = calloc(ntasks, sizeof(*tasks));
+        for (unsigned i = 0; i < ntasks; i++)
+            tasks[i] = task_new(NULL, count_run, NULL, nop, never_done,
+                                &counters[i]);
+        if (layout == SHUFFLED) {
+            srand(1);
+            for (unsigned i = ntasks - 1; i > 0; i--) {
+                unsigned j = rand() % (i + 1);
+                struct task *t = tasks[i];
+                tasks[i] = tasks[j];
+                tasks[j] = t;
+            }
+        }
+        scheduler_start_batch(sched, tasks, ntasks);
+    }
+    /* The first tick initializes the tasks. */
+    scheduler_run(sched);
+
+    start = now_ns();
+    for (unsigned long t = 1; t < nticks; t++)
+        scheduler_run(sched);
+    end = now_ns();
+
+    scheduler_free(sched);
+    if (tasks) {
+        for (unsigned i = 0; i < ntasks; i++)
+            task_free(tasks[i]);
+        free(tasks);
+    }
+    free(counters);
+    return (double)(end - start) / ((double)ntasks * (nticks - 1));
+}
+
+/* Runs NTASKS table tasks, polled or WAITING, for NTICKS ticks,
+   with a different 1% of them given work before each tick, and
+   returns the mean ns per tick. */
+static double run_sparse(bool waiting, unsigned ntasks,
+                         unsigned long nticks) {
+    struct scheduler *sched = scheduler_new();
+    unsigned long *counters = calloc(ntasks, sizeof(*counters));
+    task_id_t *ids = calloc(ntasks, sizeof(*ids));
+    unsigned stride = 100;
+    uint64_t start, end;
+
+    for (unsigned i = 0; i < ntasks; i++) {
+        if (waiting)
+            ids[i] = scheduler_add_waiting(sched, NULL, count_run, NULL,
+                                           nop, never_done, &counters[i]);
+        else
+            ids[i] = scheduler_add(sched, NULL, flag_run, NULL, nop,
+                                   never_done, &counters[i]);
+    }
+    scheduler_run(sched);
+
+    start = now_ns();
+    for (unsigned long t = 1; t < nticks; t++) {
+        for (unsigned i = t % stride; i < ntasks; i += stride) {
+            if (waiting)
+                scheduler_ready(sched, ids[i]);
+            else
+                counters[i] |= 1;
+        }
+        scheduler_run(sched);
+    }
+    end = now_ns();
+
+    scheduler_free(sched);
+    free(ids);
+    free(counters);
+    return (double)(end - start) / (nticks - 1);
+}
+
+int main(int argc, char **argv) {
+    unsigned ntasks = argc > 1 ? atoi(argv[1]) : 1000 * 1000;
+    unsigned long nticks = argc > 2 ? atol(argv[2]) : 20;
+
+    printf("%u tasks, %lu ticks\n", ntasks, nticks);
+    printf("linked, in order:  %8.1f ns per task per tick\n",
+           run_tasks(LINKED, ntasks, nticks));
+    printf("linked, shuffled:  %8.1f ns per task per tick\n",
+           run_tasks(SHUFFLED, ntasks, nticks));
+    printf("task table:        %8.1f ns per task per tick\n",
+           run_tasks(TABLE, ntasks, nticks));
+
+    printf("\n1%% of tasks with work per tick\n");
+    printf("polled, flag check:  %8.1f us per tick\n",
+           run_sparse(false, ntasks, nticks) / 1000);
+    printf("waiting, ready bits: %8.1f us per tick\n",
+           run_sparse(true, ntasks, nticks) / 1000);
+    return 0;
+}
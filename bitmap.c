@@ -0,0 +1,83 @@
+#include "bitmap.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* Sets BIT in WORDS.  Safe against other bitmap_set() and
+   bitmap_take_word() calls on the same word. */
+void bitmap_set(uint64_t *words, size_t bit) {
+    __atomic_fetch_or(&words[bit / BITMAP_WORD_BITS],
+                      (uint64_t)1 << (bit % BITMAP_WORD_BITS),
+                      __ATOMIC_RELEASE);
+}
+
+/* Returns true if BIT is set in WORDS. */
+bool bitmap_test(const uint64_t *words, size_t bit) {
+    uint64_t word =
+        __atomic_load_n(&words[bit / BITMAP_WORD_BITS], __ATOMIC_ACQUIRE);
+    return (word >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+/* Clears word WORD of WORDS and returns the bits that were set. */
+uint64_t bitmap_take_word(uint64_t *words, size_t word) {
+    return __atomic_exchange_n(&words[word], 0, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the first of words FROM to N - 1 that is not zero,
+   or N if there is none, one word at a time. */
+static size_t next_word_scalar(const uint64_t *words, size_t n,
+                               size_t from) {
+    for (size_t i = from; i < n; i++)
+        if (__atomic_load_n(&words[i], __ATOMIC_RELAXED))
+            return i;
+    return n;
+}
+
+#if defined(__x86_64__)
+/* As next_word_scalar(), two words per compare.  A word found
+   empty here may be set by the time the caller looks again, which
+   is no different from it being set just after the scan. */
+static size_t next_word_sse2(const uint64_t *words, size_t n, size_t from) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = from;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&words[i]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            return words[i] ? i : i + 1;
+    }
+    return next_word_scalar(words, n, i);
+}
+
+/* As next_word_scalar(), four words per compare. */
+__attribute__((target("avx2"))) static size_t
+next_word_avx2(const uint64_t *words, size_t n, size_t from) {
+    size_t i = from;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&words[i]);
+        if (!_mm256_testz_si256(v, v))
+            return next_word_scalar(words, i + 4, i);
+    }
+    return next_word_scalar(words, n, i);
+}
+#endif
+
+/* Returns the index of the first word of WORDS from FROM on that
+   has any bit set, or N, the number of words, if there is none. */
+size_t bitmap_next_word(const uint64_t *words, size_t n, size_t from) {
+#if defined(__x86_64__)
+    static int have_avx2 = -1;
+    int avx2 = __atomic_load_n(&have_avx2, __ATOMIC_RELAXED);
+
+    if (avx2 < 0) {
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&have_avx2, avx2, __ATOMIC_RELAXED);
+    }
+    return avx2 ? next_word_avx2(words, n, from)
+                : next_word_sse2(words, n, from);
+#else
+    return next_word_scalar(words, n, from);
+#endif
+}
@@ -0,0 +1,30 @@
+#ifndef __BITMAP_H
+#define __BITMAP_H
+
+/* Bitmaps of 64-bit words.
+
+   Bits are set from any thread with bitmap_set(), and a single
+   consumer finds the words that have any bit set with
+   bitmap_next_word() and takes them with bitmap_take_word(),
+   which clears the whole word at once.
+
+   bitmap_next_word() is meant for sparse bitmaps, and skips
+   empty words several at a time: 4 per compare with AVX2, when
+   the CPU has it, or 2 with SSE2.  Other architectures test one
+   word at a time. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BITMAP_WORD_BITS 64
+
+/* Number of words needed for N bits. */
+#define BITMAP_WORDS(N) (((N) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+void bitmap_set(uint64_t *words, size_t bit);
+bool bitmap_test(const uint64_t *words, size_t bit);
+uint64_t bitmap_take_word(uint64_t *words, size_t word);
+size_t bitmap_next_word(const uint64_t *words, size_t n, size_t from);
+
+#endif /* bitmap.h */
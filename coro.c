@@ -0,0 +1,213 @@
+#include "coro.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The coroutine running on this thread, if any. */
+static __thread struct coro *current;
+
+/* Runs the coroutine's function, then switches back for good.
+   Only ever entered through the first switch to a new coroutine. */
+static void coro_entry(void);
+
+#if defined(__x86_64__)
+/* Saves the callee-saved registers on the current stack, stores
+   the stack pointer in *SAVE, then loads LOAD as the stack
+   pointer and restores the registers saved there.  The control
+   bits of MXCSR and the x87 control word are callee-saved too,
+   so a coroutine that changes the rounding or exception mode
+   keeps it to itself; they share an 8-byte slot below the
+   registers, MXCSR in the low half. */
+void coro_switch(void **save, void *load);
+
+__asm__(".text\n"
+        ".globl coro_switch\n"
+        ".hidden coro_switch\n"
+        ".type coro_switch, @function\n"
+        "coro_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    leaq -8(%rsp), %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    leaq 8(%rsp), %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coro_switch, .-coro_switch\n");
+
+/* Lays out a new stack below TOP so that the first coro_switch()
+   to it "returns" into coro_entry() with the stack aligned as if
+   coro_entry() had been called. */
+static void prepare(struct coro *c, uintptr_t top) {
+    uintptr_t *sp = (uintptr_t *)(top & ~(uintptr_t)15);
+
+    *--sp = 0;                     /* coro_entry's return address. */
+    *--sp = (uintptr_t)coro_entry; /* Where coro_switch returns to. */
+    for (int i = 0; i < 6; i++)
+        *--sp = 0;                 /* rbp, rbx, r12-r15. */
+    *--sp = (uintptr_t)0x037f << 32 | 0x1f80; /* x87 CW, MXCSR. */
+    c->sp = sp;
+}
+
+static inline void switch_in(struct coro *c) {
+    coro_switch(&c->caller, c->sp);
+}
+
+static inline void switch_out(struct coro *c) {
+    coro_switch(&c->sp, c->caller);
+}
+#else
+static void prepare(struct coro *c, uintptr_t top) {
+    getcontext(&c->context);
+    c->context.uc_stack.ss_sp = (char *)c->base + getpagesize();
+    c->context.uc_stack.ss_size = top - (uintptr_t)c->context.uc_stack.ss_sp;
+    c->context.uc_link = NULL;
+    makecontext(&c->context, coro_entry, 0);
+}
+
+static inline void switch_in(struct coro *c) {
+    swapcontext(&c->caller, &c->context);
+}
+
+static inline void switch_out(struct coro *c) {
+    swapcontext(&c->context, &c->caller);
+}
+#endif
+
+static void coro_entry(void) {
+    /* Read once: after switch_out() this frame is never resumed,
+       and before it the thread-local may not be re-read safely on
+       another thread. */
+    struct coro *c = current;
+
+    c->func(c->aux);
+    c->done = true;
+    switch_out(c);
+    assert(false);
+}
+
+/* Initializes POOL to hand out stacks of STACK_SIZE usable bytes,
+   rounded up to whole pages.  No memory is mapped until the first
+   coro_new(). */
+void coro_pool_init(struct coro_stack_pool *pool, size_t stack_size) {
+    size_t page = getpagesize();
+
+    assert(pool != NULL);
+    pool->stack_size = (stack_size + page - 1) & ~(page - 1);
+    pool->map_size = pool->stack_size + page;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free = NULL;
+    pool->nstacks = 0;
+}
+
+/* Unmaps every stack of POOL.  Every coroutine from POOL must have
+   been freed. */
+void coro_pool_destroy(struct coro_stack_pool *pool) {
+    while (pool->free) {
+        struct coro *c = pool->free;
+        pool->free = c->next_free;
+        munmap(c->base, pool->map_size);
+        pool->nstacks--;
+    }
+    assert(pool->nstacks == 0);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* Returns a new coroutine on a stack from POOL that will run
+   FUNC(AUX) when first resumed, or NULL if no stack could be
+   mapped.  Safe to call from any thread. */
+struct coro *coro_new(struct coro_stack_pool *pool, coro_func *func,
+                      void *aux) {
+    struct coro *c;
+
+    pthread_mutex_lock(&pool->lock);
+    c = pool->free;
+    if (c)
+        pool->free = c->next_free;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!c) {
+        size_t page = getpagesize();
+        void *base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("mmap(coro stack)");
+            return NULL;
+        }
+        if (mprotect(base, page, PROT_NONE) < 0) {
+            perror("mprotect(coro guard page)");
+            munmap(base, pool->map_size);
+            return NULL;
+        }
+
+        uintptr_t top = (uintptr_t)base + pool->map_size - sizeof(*c);
+        c = (struct coro *)(top & ~(uintptr_t)63);
+        c->base = base;
+        pthread_mutex_lock(&pool->lock);
+        pool->nstacks++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    c->next_free = NULL;
+    c->func = func;
+    c->aux = aux;
+    c->done = false;
+    prepare(c, (uintptr_t)c);
+    return c;
+}
+
+/* Returns C's stack to POOL.  C need not have finished; whatever
+   it was in the middle of is abandoned without unwinding.  Safe
+   to call from any thread, but not on a running coroutine. */
+void coro_free(struct coro_stack_pool *pool, struct coro *c) {
+    if (c == NULL)
+        return;
+    assert(c != current);
+    pthread_mutex_lock(&pool->lock);
+    c->next_free = pool->free;
+    pool->free = c;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Runs C until it yields or its function returns.  Returns true
+   once the function has returned, after which C must not be
+   resumed again. */
+bool coro_resume(struct coro *c) {
+    assert(current == NULL);
+    assert(!c->done);
+
+    current = c;
+    switch_in(c);
+    current = NULL;
+    return c->done;
+}
+
+/* Suspends the running coroutine, returning from the coro_resume()
+   that resumed it. */
+void coro_yield(void) {
+    struct coro *c = current;
+
+    assert(c != NULL);
+    switch_out(c);
+}
+
+/* Returns the coroutine running on this thread, or NULL when
+   called from outside any coroutine. */
+struct coro *coro_self(void) {
+    return current;
+}
@@ -0,0 +1,75 @@
+#ifndef __CORO_H
+#define __CORO_H
+
+/* Stackful coroutines.
+
+   A coroutine runs a function on a stack of its own.  The
+   function may call coro_yield() at any depth to hand control
+   back to whoever called coro_resume(), and the next
+   coro_resume() continues from there.  A coroutine may be resumed
+   from a different thread than the one it last yielded on, but
+   only by one thread at a time, and coroutines do not nest.
+
+   Stacks come from a coro_stack_pool.  Each is mapped with an
+   inaccessible guard page below it, so an overflow faults instead
+   of silently corrupting the neighbouring stack, and is kept in
+   the pool when its coroutine is freed so starting a coroutine
+   normally costs no system call.  The `struct coro' itself lives
+   at the top of its stack.
+
+   On x86-64 switching is a handful of instructions that save and
+   restore the callee-saved registers, along with the floating
+   point control words.  A new coroutine starts with the ABI's
+   default rounding and exception modes.  Elsewhere it falls back to
+   ucontext, which also saves the signal mask and so costs a
+   system call per switch. */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+/* Default usable stack size, not counting the guard page. */
+#define CORO_STACK_SIZE (64 * 1024)
+
+typedef void coro_func(void *aux);
+
+/* Coroutine. */
+struct coro {
+    void *base;   /* Start of the mapping, guard page included. */
+    struct coro *next_free; /* In the pool's free list. */
+    coro_func *func;
+    void *aux;
+    bool done;    /* FUNC has returned. */
+#if defined(__x86_64__)
+    void *sp;     /* Saved stack pointer of the coroutine... */
+    void *caller; /* ...and of the thread that resumed it. */
+#else
+    ucontext_t context;
+    ucontext_t caller;
+#endif
+};
+
+/* Pool of coroutine stacks. */
+struct coro_stack_pool {
+    size_t stack_size; /* Usable bytes per stack. */
+    size_t map_size;   /* Bytes per mapping, guard page included. */
+    pthread_mutex_t lock;
+    struct coro *free; /* Stacks not in use. */
+    size_t nstacks;    /* Stacks mapped so far. */
+};
+
+void coro_pool_init(struct coro_stack_pool *, size_t stack_size);
+void coro_pool_destroy(struct coro_stack_pool *);
+
+struct coro *coro_new(struct coro_stack_pool *, coro_func *, void *aux);
+void coro_free(struct coro_stack_pool *, struct coro *);
+
+bool coro_resume(struct coro *);
+void coro_yield(void);
+struct coro *coro_self(void);
+
+#endif /* coro.h */
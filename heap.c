@@ -0,0 +1,124 @@
+#include "heap.h"
+#include <assert.h>
+
+/* Makes the greater of the roots A and B the first child of the
+   other.  Returns the new root.  Leaves the root's own sibling
+   links for the caller. */
+static struct heap_elem *meld(struct heap *heap, struct heap_elem *a,
+                              struct heap_elem *b) {
+    if (heap->less(b, a, heap->aux)) {
+        struct heap_elem *t = a;
+        a = b;
+        b = t;
+    }
+    b->prev = a;
+    b->next = a->child;
+    if (a->child)
+        a->child->prev = b;
+    a->child = b;
+    return a;
+}
+
+/* Melds the sibling list starting at FIRST into a single heap,
+   in two passes: pairs from left to right, then the results
+   from right to left.  Returns its root, or NULL if FIRST is
+   NULL. */
+static struct heap_elem *merge_pairs(struct heap *heap,
+                                     struct heap_elem *first) {
+    struct heap_elem *pairs = NULL; /* Stack, through `next'. */
+    struct heap_elem *root = NULL;
+
+    while (first) {
+        struct heap_elem *a = first;
+        struct heap_elem *b = first->next;
+
+        first = b ? b->next : NULL;
+        if (b)
+            a = meld(heap, a, b);
+        a->next = pairs;
+        pairs = a;
+    }
+    while (pairs) {
+        struct heap_elem *a = pairs;
+        pairs = a->next;
+        root = root ? meld(heap, root, a) : a;
+    }
+    if (root)
+        root->next = root->prev = NULL;
+    return root;
+}
+
+/* Initializes HEAP as an empty heap ordered by LESS. */
+void heap_init(struct heap *heap, heap_less_func *less, void *aux) {
+    assert(heap != NULL);
+    assert(less != NULL);
+
+    heap->root = NULL;
+    heap->size = 0;
+    heap->less = less;
+    heap->aux = aux;
+}
+
+/* Inserts ELEM into HEAP. */
+void heap_push(struct heap *heap, struct heap_elem *elem) {
+    elem->child = elem->next = elem->prev = NULL;
+    if (heap->root) {
+        heap->root = meld(heap, heap->root, elem);
+        heap->root->next = heap->root->prev = NULL;
+    }
+    else {
+        heap->root = elem;
+    }
+    heap->size++;
+}
+
+/* Returns the least element of HEAP, or NULL if HEAP is empty. */
+struct heap_elem *heap_min(struct heap *heap) {
+    return heap->root;
+}
+
+/* Removes and returns the least element of HEAP, or NULL if HEAP
+   is empty. */
+struct heap_elem *heap_pop(struct heap *heap) {
+    struct heap_elem *min = heap->root;
+
+    if (min) {
+        heap->root = merge_pairs(heap, min->child);
+        heap->size--;
+    }
+    return min;
+}
+
+/* Removes ELEM, which must be in HEAP, from HEAP. */
+void heap_remove(struct heap *heap, struct heap_elem *elem) {
+    struct heap_elem *sub;
+
+    if (elem == heap->root) {
+        heap_pop(heap);
+        return;
+    }
+
+    if (elem->prev->child == elem)
+        elem->prev->child = elem->next;
+    else
+        elem->prev->next = elem->next;
+    if (elem->next)
+        elem->next->prev = elem->prev;
+
+    sub = merge_pairs(heap, elem->child);
+    if (sub) {
+        heap->root = meld(heap, heap->root, sub);
+        heap->root->next = heap->root->prev = NULL;
+    }
+    heap->size--;
+}
+
+/* Returns true if HEAP is empty. */
+bool heap_empty(struct heap *heap) {
+    return heap->root == NULL;
+}
+
+/* Returns the number of elements in HEAP. */
+size_t heap_size(struct heap *heap) {
+    return heap->size;
+}
@@ -0,0 +1,62 @@
+#ifndef __HEAP_H
+#define __HEAP_H
+
+/* Intrusive min-heap.
+
+   Like the list in list.h, the heap does not allocate memory.
+   Each structure that can be in a heap embeds a `struct
+   heap_elem', and heap_entry() converts an element back to the
+   structure around it.  Elements are ordered by a
+   heap_less_func supplied at heap_init(), which must not change
+   its mind about an element while the element is in the heap.
+
+   The heap is a pairing heap: heap_push() and heap_min() take
+   constant time, and heap_pop() and heap_remove() take
+   amortized logarithmic time.  Elements that compare equal come
+   out in no particular order, so a caller that needs ties
+   broken, say by arrival, must say so in its less function. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Heap element. */
+struct heap_elem {
+    struct heap_elem *child; /* First child. */
+    struct heap_elem *next;  /* Next sibling. */
+    struct heap_elem *prev;  /* Previous sibling, or parent of a
+                                first child. */
+};
+
+/* Compares the value of two heap elements A and B, given
+   auxiliary data AUX.  Returns true if A is less than B, or
+   false if A is greater than or equal to B. */
+typedef bool heap_less_func(const struct heap_elem *a,
+                            const struct heap_elem *b,
+                            void *aux);
+
+/* Heap. */
+struct heap {
+    struct heap_elem *root; /* Least element. */
+    size_t size;
+    heap_less_func *less;
+    void *aux;
+};
+
+/* Converts pointer to heap element HEAP_ELEM into a pointer to
+   the structure that HEAP_ELEM is embedded inside. */
+#define heap_entry(HEAP_ELEM, STRUCT, MEMBER) \
+    ((STRUCT *)((uint8_t *)&(HEAP_ELEM)->child - \
+                offsetof(STRUCT, MEMBER.child)))
+
+void heap_init(struct heap *, heap_less_func *, void *aux);
+
+void heap_push(struct heap *, struct heap_elem *);
+struct heap_elem *heap_min(struct heap *);
+struct heap_elem *heap_pop(struct heap *);
+void heap_remove(struct heap *, struct heap_elem *);
+
+bool heap_empty(struct heap *);
+size_t heap_size(struct heap *);
+
+#endif /* heap.h */
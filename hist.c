@@ -0,0 +1,98 @@
+#include "hist.h"
+#include <string.h>
+
+/* Initializes H as an empty histogram. */
+void hist_init(struct hist *h) {
+    memset(h->counts, 0, sizeof(h->counts));
+}
+
+/* Returns the bucket VALUE is counted in. */
+size_t hist_bucket(uint64_t value) {
+    unsigned msb;
+
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+    /* The top HIST_SUB_BITS + 1 bits pick the bucket, the leading one
+       standing for the power of two. */
+    msb = 63 - __builtin_clzll(value);
+    return (size_t)(msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+           ((value >> (msb - HIST_SUB_BITS)) - HIST_SUB_BUCKETS);
+}
+
+/* Returns the least value counted in BUCKET. */
+uint64_t hist_bucket_min(size_t bucket) {
+    size_t group = bucket / HIST_SUB_BUCKETS;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
+
+    if (group == 0)
+        return sub;
+    return (HIST_SUB_BUCKETS + sub) << (group - 1);
+}
+
+/* Returns the greatest value counted in BUCKET. */
+uint64_t hist_bucket_max(size_t bucket) {
+    size_t group = bucket / HIST_SUB_BUCKETS;
+
+    if (group == 0)
+        return bucket;
+    return hist_bucket_min(bucket) + (((uint64_t)1 << (group - 1)) - 1);
+}
+
+/* Counts VALUE in H.  Safe to call from any thread. */
+void hist_record(struct hist *h, uint64_t value) {
+    __atomic_fetch_add(&h->counts[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+}
+
+/* Copies H into SNAPSHOT, and clears H if RESET is true.  Safe to
+   call from any thread, alongside hist_record(). */
+void hist_snapshot(struct hist *h, struct hist *snapshot, bool reset) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        if (reset)
+            snapshot->counts[i] =
+                __atomic_exchange_n(&h->counts[i], 0, __ATOMIC_RELAXED);
+        else
+            snapshot->counts[i] =
+                __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Returns the number of values counted in H, which should not be
+   recorded into meanwhile; see hist_snapshot(). */
+uint64_t hist_count(const struct hist *h) {
+    uint64_t n = 0;
+
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+        n += h->counts[i];
+    return n;
+}
+
+/* Returns the value that a fraction Q, from 0 to 1, of the values
+   in H are at or below, as the greatest value of its bucket.  So
+   0.5 gives the median, 0.999 the 99.9th percentile and 1 the
+   maximum, give or take the bucket width.  Returns 0 if H is
+   empty.  H should not be recorded into meanwhile. */
+uint64_t hist_quantile(const struct hist *h, double q) {
+    uint64_t n = hist_count(h), rank, seen = 0;
+
+    if (n == 0)
+        return 0;
+    if (q <= 0)
+        rank = 1;
+    else if (q >= 1)
+        rank = n;
+    else {
+        /* The rank of the first value at or above the quantile. */
+        rank = (uint64_t)(q * n);
+        if ((double)rank < q * n)
+            rank++;
+        if (rank == 0)
+            rank = 1;
+    }
+
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return hist_bucket_max(i);
+    }
+    return hist_bucket_max(HIST_BUCKETS - 1);
+}
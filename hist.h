@@ -0,0 +1,46 @@
+#ifndef __HIST_H
+#define __HIST_H
+
+/* Log-bucketed latency histogram.
+
+   Values, typically durations in ns, are counted in buckets whose
+   width grows with the value, as in an HDR histogram: values below
+   2 * HIST_SUB_BUCKETS get a bucket each, and above that every
+   power of two is split into HIST_SUB_BUCKETS equal buckets.  A
+   bucket is thus never wider than 1/HIST_SUB_BUCKETS of its
+   values, so quantiles come out within about 3%, over the whole
+   range of a uint64_t, in a fixed HIST_BUCKETS counters.
+
+   hist_record() is a single relaxed atomic add, so any number of
+   threads may record into a histogram at once, and take snapshots
+   of it, without a lock.  A snapshot is not a single point in
+   time: a value recorded while it is taken may or may not be in
+   it, but it is never lost, even when the snapshot also resets the
+   histogram. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/* Histogram. */
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *);
+
+void hist_record(struct hist *, uint64_t value);
+void hist_snapshot(struct hist *, struct hist *snapshot, bool reset);
+
+uint64_t hist_count(const struct hist *);
+uint64_t hist_quantile(const struct hist *, double q);
+
+size_t hist_bucket(uint64_t value);
+uint64_t hist_bucket_min(size_t bucket);
+uint64_t hist_bucket_max(size_t bucket);
+
+#endif /* hist.h */
@@ -0,0 +1,89 @@
+#include "mpsc.h"
+#include <assert.h>
+
+/* Initializes QUEUE as an empty queue. */
+void mpsc_init(struct mpsc_queue *queue) {
+    assert(queue != NULL);
+    queue->stub.prev = NULL;
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/* Appends ELEM to QUEUE.  Safe to call from any thread. */
+void mpsc_push(struct mpsc_queue *queue, struct list_elem *elem) {
+    mpsc_push_chain(queue, elem, elem);
+}
+
+/* Appends FIRST through LAST (inclusive) to QUEUE in one step.
+   The caller must already have linked each element of the chain
+   to the one after it through its `next' pointer.  Safe to call
+   from any thread. */
+void mpsc_push_chain(struct mpsc_queue *queue, struct list_elem *first,
+                     struct list_elem *last) {
+    struct list_elem *prev;
+
+    assert(first != NULL);
+    assert(last != NULL);
+    __atomic_store_n(&last->next, NULL, __ATOMIC_RELAXED);
+    /* Sequentially consistent so that a producer checking whether
+       the consumer is asleep after pushing, and a consumer checking
+       mpsc_empty() after announcing it is going to sleep, cannot
+       both miss each other. */
+    prev = __atomic_exchange_n(&queue->tail, last, __ATOMIC_SEQ_CST);
+    /* Between the exchange and this store the queue is briefly
+       split in two; mpsc_pop() treats that as empty. */
+    __atomic_store_n(&prev->next, first, __ATOMIC_RELEASE);
+}
+
+/* Removes and returns the front of QUEUE, or NULL if QUEUE is
+   empty or its front is still being pushed. */
+struct list_elem *mpsc_pop(struct mpsc_queue *queue) {
+    struct list_elem *head = queue->head;
+    struct list_elem *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+        queue->head = next;
+        head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        queue->head = next;
+        return head;
+    }
+
+    /* HEAD is the last element.  Unless a push is in flight, put
+       the stub back behind it so HEAD can be unlinked. */
+    if (head != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    mpsc_push(queue, &queue->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+/* Returns true if QUEUE holds nothing, not even an element that
+   is still being pushed.  Only the consumer may call this. */
+bool mpsc_empty(struct mpsc_queue *queue) {
+    return queue->head == &queue->stub &&
+           __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == &queue->stub;
+}
+
+/* Pops everything currently available from QUEUE onto the back
+   of LIST, in the order it was pushed.  Returns the number of
+   elements moved. */
+size_t mpsc_drain(struct mpsc_queue *queue, struct list *list) {
+    struct list_elem *e;
+    size_t cnt = 0;
+
+    while ((e = mpsc_pop(queue)) != NULL) {
+        list_push_back(list, e);
+        cnt++;
+    }
+    return cnt;
+}
@@ -0,0 +1,40 @@
+#ifndef __MPSC_H
+#define __MPSC_H
+
+/* Intrusive multi-producer, single-consumer queue.
+
+   Elements are the same `struct list_elem' used by list.h, so an
+   element can be handed to another thread through the queue and
+   then linked into an ordinary list by the consumer.  Only the
+   `next' link is used while the element is queued.
+
+   mpsc_push() may be called from any number of threads at once
+   and is wait-free: one atomic exchange and one store.
+   mpsc_push_chain() appends a whole chain of elements, already
+   linked through their `next' pointers, at the same cost.
+   mpsc_pop() must only be called by one thread at a time.  If a
+   push is half way done when the consumer reaches it, mpsc_pop()
+   returns NULL even though the queue is not empty; the element
+   will be returned by a later call.
+
+   The algorithm is Dmitry Vyukov's intrusive MPSC queue. */
+
+#include "list.h"
+#include <stdbool.h>
+
+/* MPSC queue. */
+struct mpsc_queue {
+    struct list_elem *head; /* Consumer end. */
+    struct list_elem *tail; /* Producer end. */
+    struct list_elem stub;  /* Keeps the queue non-empty. */
+};
+
+void mpsc_init(struct mpsc_queue *);
+void mpsc_push(struct mpsc_queue *, struct list_elem *);
+void mpsc_push_chain(struct mpsc_queue *, struct list_elem *first,
+                     struct list_elem *last);
+struct list_elem *mpsc_pop(struct mpsc_queue *);
+bool mpsc_empty(struct mpsc_queue *);
+size_t mpsc_drain(struct mpsc_queue *, struct list *);
+
+#endif /* mpsc.h */
@@ -1,14 +1,123 @@
+#include "aio.h"
+#include "coro.h"
+#include "heap.h"
+#include "hist.h"
 #include "list.h"
+#include "mpsc.h"
 #include "scheduler.h"
+#include "slab.h"
+#include "table.h"
+#include "trace.h"
+#include "wheel.h"
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
+/* Usable stack per task_new_coro task. */
+#ifndef TASK_CORO_STACK_SIZE
+#define TASK_CORO_STACK_SIZE CORO_STACK_SIZE
+#endif
+
+/* Granularity of periodic and delayed tasks. */
+#ifndef SCHEDULER_TIMER_RESOLUTION_NS
+#define SCHEDULER_TIMER_RESOLUTION_NS 1000000
+#endif
+
+/* Build with -DSCHEDULER_STATS=1 for scheduler_get_stats, task_get_stats and
+   scheduler_get_hist. Without it the counters and histograms, and the clock
+   reads behind them, are left out. */
+#ifndef SCHEDULER_STATS
+#define SCHEDULER_STATS 0
+#endif
+
+struct worker_pool;
+struct reaper;
+
+/* Only the thread calling scheduler_run touches tasks and timers. Other
+   threads hand tasks over through the incoming, stopped and woken queues,
+   which are drained once at the start of each tick. */
 struct scheduler {
-    struct list /* <task> */ tasks;
-    pthread_mutex_t tasks_lock;
-    pthread_mutex_t state_lock;
+    /* Run lists, one per priority level. Bit N of runq_mask is set whenever
+       runq[N] may be non-empty; scheduler_run clears the bits of the levels it
+       leaves empty, so the mask is exact between ticks. */
+    struct list /* <task> */ runq[TASK_PRIORITY_MAX + 1];
+    uint32_t runq_mask;
+
+    /* SCHEDULER_EDF keeps runnable tasks in edf instead of runq, earliest
+       deadline first, and moves them to a list of their own for each tick. */
+    enum scheduler_policy policy;
+    struct heap /* <task> */ edf;
+    uint64_t edf_seq; /* Breaks ties between equal deadlines, FIFO */
+
+    /* Invocations with a deadline, counted by task_step. */
+    uint64_t deadlines_met;
+    uint64_t deadlines_missed;
+
+    /* Tasks from scheduler_start and scheduler_start_after. */
+    struct mpsc_queue /* <task> */ incoming;
+
+    /* Tasks interrupted by scheduler_stop, linked through stop_elem. */
+    struct mpsc_queue /* <task> */ stopped;
+
+    /* Tasks given to task_unpark, linked through wake_elem. */
+    struct mpsc_queue /* <task> */ woken;
+
+    /* Tasks that called task_park, until task_unpark. */
+    struct list /* <task> */ parked;
+
+    /* Started tasks waiting for their task_depends_on parents to stop. */
+    struct list /* <task> */ blocked;
+
+    /* Tasks waiting for their wake_at. */
+    struct timer_wheel /* <task> */ timers;
+
+    /* task_new_fd tasks waiting for their fd, in epoll_fd. */
+    struct list /* <task> */ fd_waiting;
+    int epoll_fd;
+
+    /* Requests from task_read, task_write and task_fsync. Tasks are out of
+       every list while theirs is in flight. Set up by the first request. */
+    struct aio_context aio;
+    bool aio_ready;
+
+    /* Backs task_new_in. */
+    struct slab_pool task_pool;
+
+    /* Stacks for task_new_coro tasks. */
+    struct coro_stack_pool stacks;
+
+    /* Tasks from scheduler_add, run after the linked ones. */
+    struct task_table table;
+
+    /* scheduler_loop sleeps on epoll_fd, which includes wake_fd, while idle is
+       set. */
+    int wake_fd;
+    bool idle;
+    bool wake_requested;
+    bool loop_break;
+
+    struct worker_pool *pool; /* Created by the first scheduler_run_parallel */
+    struct reaper *reaper;    /* While scheduler_reaper is on */
+
+    /* Off until scheduler_trace. */
+    struct trace trace;
+
+#if SCHEDULER_STATS
+    struct scheduler_stats stats;
+    uint64_t tick_tasks; /* Tasks run so far in the current tick */
+
+    /* Indexed by enum scheduler_hist. The run and start histograms are
+       recorded into by every worker of scheduler_run_parallel. */
+    struct hist hists[SCHEDULER_HIST_START + 1];
+#endif
 };
 
 enum task_state {
@@ -20,50 +129,499 @@ enum task_state {
 
 struct task {
     struct list_elem elem;
+    struct list_elem stop_elem;
+    struct list_elem wake_elem;
 
     task_fn_t init;
     task_fn_t run;
     task_fn_t destroy;
     task_fn_t interrupt;
     task_cond_t is_done;
+    task_step_fn_t step; /* From task_new_step, in place of run and is_done */
     void *data;
 
-    enum task_state state;
+    enum task_state state; /* Use the task_state helpers, stop is lock free */
+
+    uint64_t period;  /* ns between runs, 0 to run every tick */
+    uint64_t wake_at; /* Timer tick the task is due at */
+    bool timed;       /* elem is in sched->timers instead of a run list */
+    unsigned stop_pending; /* scheduler_stop calls in flight, atomic */
+    bool wake_pending; /* wake_elem is in sched->woken */
+    bool unparked;     /* task_unpark since the last park, lock free */
+    bool parked;       /* elem is in sched->parked */
+
+    uint32_t deps;            /* Parents that have not stopped, atomic */
+    bool blocked;             /* elem is in sched->blocked */
+    struct task **dependents; /* Tasks that depend on this one */
+    size_t ndependents;
+    size_t dependents_cap;
+
+    struct slab_pool *pool; /* Pool the task was allocated from, if any */
+    bool owned;             /* From task_new_in, freed on removal */
+
+    int fd;             /* From task_new_fd, -1 otherwise */
+    uint32_t fd_events; /* EPOLLIN and/or EPOLLOUT */
+    bool fd_waiting;    /* elem is in sched->fd_waiting */
+    bool fd_registered; /* fd is in sched->epoll_fd */
+
+    struct aio_request io; /* Last request from task_read and friends */
+    bool io_queued;        /* io is to be submitted once run returns */
+    bool io_busy;          /* io is in sched->aio */
+
+    unsigned priority;       /* Index of its run list in sched->runq */
+    uint64_t deadline;       /* Of the next run, CLOCK_MONOTONIC ns */
+    uint64_t edf_seq;        /* Order it joined sched->edf in */
+    struct heap_elem edf_elem;
+    struct scheduler *sched; /* Set by scheduler_start and friends */
+    bool is_coro;            /* From task_new_coro, run is the body */
+    struct coro *coro;       /* While a task_new_coro task is in sched */
+    enum task_status status; /* Last returned by step, for scheduler_park */
+    uint64_t sleep_until;    /* Set by step along with TASK_SLEEP_UNTIL */
+
+#if SCHEDULER_STATS
+    struct task_stats stats;
+    uint64_t started_at; /* When it was due to start, CLOCK_MONOTONIC ns */
+#endif
 };
 
-struct task *task_new(task_fn_t init,
+/* Returns true if SCHED is recording trace events. */
+static inline bool scheduler_tracing(struct scheduler *sched) {
+    return __atomic_load_n(&sched->trace.enabled, __ATOMIC_RELAXED);
+}
+
+/* Returns the time to trace a call from, or 0 if SCHED is not tracing. */
+static inline uint64_t trace_start(struct scheduler *sched) {
+    return scheduler_tracing(sched) ? trace_clock() : 0;
+}
+
+/* Traces call NAME of FN (either may be NULL) for TASK, which started at
+   START from trace_start. */
+static inline void trace_call(struct scheduler *sched,
+                              const char *name,
+                              uint64_t start,
+                              struct task *task,
+                              const void *fn) {
+    if (start)
+        trace_complete(&sched->trace, name, start, task, fn);
+}
+
+static const char *const task_state_names[] = {
+    "STARTING",
+    "RUNNING",
+    "INTERRUPTED",
+    "STOPPED",
+};
+
+/* Traces TASK's move to STATE. */
+static inline void task_trace_state(struct task *task, enum task_state state) {
+    if (task->sched && scheduler_tracing(task->sched))
+        trace_instant(&task->sched->trace, "state", task_state_names[state],
+                      task);
+}
+
+static inline enum task_state task_state(struct task *task) {
+    return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+}
+
+static inline void task_set_state(struct task *task, enum task_state state) {
+    __atomic_store_n(&task->state, state, __ATOMIC_RELEASE);
+    task_trace_state(task, state);
+}
+
+/* Moves TASK from state FROM to TO. Returns false, leaving the state alone,
+   if TASK was not in FROM. */
+static inline bool task_transition(struct task *task,
+                                   enum task_state from,
+                                   enum task_state to) {
+    if (!__atomic_compare_exchange_n(&task->state, &from, to, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return false;
+    task_trace_state(task, to);
+    return true;
+}
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the current time in timer ticks. */
+static uint64_t clock_ticks(void) {
+    return clock_ns() / SCHEDULER_TIMER_RESOLUTION_NS;
+}
+
+/* Converts NS to timer ticks, rounding up. */
+static uint64_t ns_to_ticks(uint64_t ns) {
+    return (ns + SCHEDULER_TIMER_RESOLUTION_NS - 1) /
+           SCHEDULER_TIMER_RESOLUTION_NS;
+}
+
+#if SCHEDULER_STATS
+/* Returns the time to measure from. */
+static inline uint64_t stats_clock(void) {
+    return clock_ns();
+}
+
+/* Counts a run of TASK that started at START. */
+static void stats_task_run(struct task *task, uint64_t start) {
+    struct hist *hists = task->sched->hists;
+    uint64_t ns = clock_ns() - start;
+
+    if (task->stats.runs == 0)
+        hist_record(&hists[SCHEDULER_HIST_START],
+                    start > task->started_at ? start - task->started_at : 0);
+    hist_record(&hists[SCHEDULER_HIST_RUN], ns);
+    task->stats.runs++;
+    task->stats.run_ns += ns;
+    if (ns > task->stats.max_run_ns)
+        task->stats.max_run_ns = ns;
+}
+
+/* Counts the wait of TASK, which is being initialized at NOW, since it was
+   due to start. */
+static void stats_task_init(struct task *task, uint64_t now) {
+    if (now > task->started_at)
+        task->stats.start_wait_ns = now - task->started_at;
+}
+
+/* Notes that TASK is due to start at AT. */
+static inline void stats_task_start(struct task *task, uint64_t at) {
+    task->started_at = at;
+}
+
+/* Counts a task run in the current tick. */
+static inline void stats_tick_task(struct scheduler *sched) {
+    sched->tick_tasks++;
+}
+
+/* Counts a tick that started at START. */
+static void stats_tick(struct scheduler *sched, uint64_t start) {
+    uint64_t ns = clock_ns() - start;
+
+    hist_record(&sched->hists[SCHEDULER_HIST_TICK], ns);
+    sched->stats.ticks++;
+    sched->stats.tick_ns += ns;
+    if (ns > sched->stats.max_tick_ns)
+        sched->stats.max_tick_ns = ns;
+    sched->stats.tasks_run += sched->tick_tasks;
+    if (sched->tick_tasks > sched->stats.max_tasks_per_tick)
+        sched->stats.max_tasks_per_tick = sched->tick_tasks;
+    sched->tick_tasks = 0;
+}
+
+/* Counts time spent blocked on a lock since START. */
+static inline void stats_lock_wait(struct scheduler *sched, uint64_t start) {
+    sched->stats.lock_wait_ns += clock_ns() - start;
+}
+#else
+/* Without SCHEDULER_STATS, these all compile to nothing. */
+static inline uint64_t stats_clock(void) {
+    return 0;
+}
+static inline void stats_task_run(struct task *task, uint64_t start) {
+    (void)task, (void)start;
+}
+static inline void stats_task_init(struct task *task, uint64_t now) {
+    (void)task, (void)now;
+}
+static inline void stats_task_start(struct task *task, uint64_t at) {
+    (void)task, (void)at;
+}
+static inline void stats_tick_task(struct scheduler *sched) {
+    (void)sched;
+}
+static inline void stats_tick(struct scheduler *sched, uint64_t start) {
+    (void)sched, (void)start;
+}
+static inline void stats_lock_wait(struct scheduler *sched, uint64_t start) {
+    (void)sched, (void)start;
+}
+#endif
+
+static uint64_t task_wake_at(const struct list_elem *e, void *aux) {
+    (void)aux;
+    return list_entry(e, struct task, elem)->wake_at;
+}
+
+static void task_init(struct task *task,
+                      task_fn_t init,
                       task_fn_t run,
                       task_fn_t destroy,
                       task_fn_t interrupt,
                       task_cond_t is_done,
                       void *data) {
-    assert(run != NULL);
     if (is_done || interrupt) {
         assert(is_done && interrupt);
     }
 
-    struct task *task = (struct task *)malloc(sizeof(struct task));
-    if (!task) {
-        perror("malloc(struct task)");
-        return NULL;
-    }
-
     task->init = init;
     task->run = run;
     task->destroy = destroy;
     task->interrupt = interrupt;
     task->is_done = is_done;
+    task->step = NULL;
     task->data = data;
     task->state = STARTING;
+    task->period = 0;
+    task->wake_at = 0;
+    task->timed = false;
+    task->stop_pending = 0;
+    task->wake_pending = false;
+    task->unparked = false;
+    task->parked = false;
+    task->deps = 0;
+    task->blocked = false;
+    task->dependents = NULL;
+    task->ndependents = 0;
+    task->dependents_cap = 0;
+    task->pool = NULL;
+    task->owned = false;
+    task->fd = -1;
+    task->fd_events = 0;
+    task->fd_waiting = false;
+    task->fd_registered = false;
+    task->io.result = 0;
+    task->io_queued = false;
+    task->io_busy = false;
+    task->priority = TASK_PRIORITY_DEFAULT;
+    task->deadline = TASK_NO_DEADLINE;
+    task->sched = NULL;
+    task->is_coro = false;
+    task->coro = NULL;
+    task->status = TASK_CONTINUE;
+    task->sleep_until = 0;
+#if SCHEDULER_STATS
+    task->stats.runs = 0;
+    task->stats.run_ns = 0;
+    task->stats.max_run_ns = 0;
+    task->stats.start_wait_ns = 0;
+    task->started_at = 0;
+#endif
+}
+
+struct task *task_new(task_fn_t init,
+                      task_fn_t run,
+                      task_fn_t destroy,
+                      task_fn_t interrupt,
+                      task_cond_t is_done,
+                      void *data) {
+    assert(run != NULL);
+
+    struct task *task = (struct task *)malloc(sizeof(struct task));
+    if (!task) {
+        perror("malloc(struct task)");
+        return NULL;
+    }
+
+    task_init(task, init, run, destroy, interrupt, is_done, data);
+    return task;
+}
+
+struct task *task_new_in(struct scheduler *sched,
+                         task_fn_t init,
+                         task_fn_t run,
+                         task_fn_t destroy,
+                         task_fn_t interrupt,
+                         task_cond_t is_done,
+                         void *data) {
+    struct task *task = (struct task *)slab_alloc(&sched->task_pool);
+    if (task) {
+        task_init(task, init, run, destroy, interrupt, is_done, data);
+        task->pool = &sched->task_pool;
+    }
+    else {
+        /* Pool is full, fall back to the heap. */
+        task = task_new(init, run, destroy, interrupt, is_done, data);
+        if (!task)
+            return NULL;
+    }
+    task->owned = true;
+    return task;
+}
+
+struct task *task_new_fd(int fd,
+                         unsigned events,
+                         task_fn_t init,
+                         task_fn_t run,
+                         task_fn_t destroy,
+                         task_fn_t interrupt,
+                         task_cond_t is_done,
+                         void *data) {
+    assert(fd >= 0);
+    assert(events & (TASK_FD_READ | TASK_FD_WRITE));
+
+    struct task *task = task_new(init, run, destroy, interrupt, is_done, data);
+    if (!task)
+        return NULL;
+
+    task->fd = fd;
+    if (events & TASK_FD_READ)
+        task->fd_events |= EPOLLIN;
+    if (events & TASK_FD_WRITE)
+        task->fd_events |= EPOLLOUT;
+    return task;
+}
+
+struct task *task_new_coro(task_fn_t init,
+                           task_fn_t body,
+                           task_fn_t destroy,
+                           task_fn_t interrupt,
+                           void *data) {
+    struct task *task = task_new(init, body, destroy, NULL, NULL, data);
+    if (!task)
+        return NULL;
+
+    task->interrupt = interrupt;
+    task->is_coro = true;
+    return task;
+}
+
+void task_yield(void) {
+    coro_yield();
+}
+
+struct task *task_new_step(task_fn_t init,
+                           task_step_fn_t step,
+                           task_fn_t destroy,
+                           task_fn_t interrupt,
+                           void *data) {
+    assert(step != NULL);
+
+    struct task *task = (struct task *)malloc(sizeof(struct task));
+    if (!task) {
+        perror("malloc(struct task)");
+        return NULL;
+    }
 
+    task_init(task, init, NULL, destroy, NULL, NULL, data);
+    task->interrupt = interrupt;
+    task->step = step;
     return task;
 }
 
+/* Fills in TASK's request, to be submitted once its run fn returns. */
+static void task_queue_io(struct task *task,
+                          enum aio_op op,
+                          int fd,
+                          void *buf,
+                          size_t len,
+                          uint64_t offset) {
+    assert(!task->io_queued);
+    task->io.op = op;
+    task->io.fd = fd;
+    task->io.buf = buf;
+    task->io.len = len;
+    task->io.offset = offset;
+    task->io_queued = true;
+}
+
+void task_read(struct task *task,
+               int fd,
+               void *buf,
+               size_t len,
+               uint64_t offset) {
+    task_queue_io(task, AIO_READ, fd, buf, len, offset);
+}
+
+void task_write(struct task *task,
+                int fd,
+                const void *buf,
+                size_t len,
+                uint64_t offset) {
+    task_queue_io(task, AIO_WRITE, fd, (void *)buf, len, offset);
+}
+
+void task_fsync(struct task *task, int fd) {
+    task_queue_io(task, AIO_FSYNC, fd, NULL, 0, 0);
+}
+
+int64_t task_io_result(struct task *task) {
+    return task->io.result;
+}
+
 void task_free(struct task *task) {
-    free(task);
+    if (task)
+        free(task->dependents);
+    if (task && task->pool)
+        slab_free(task->pool, task);
+    else
+        free(task);
+}
+
+/* Gives back the coroutine stack of a task leaving the scheduler. */
+static inline void task_release_coro(struct task *task) {
+    if (task->coro) {
+        coro_free(&task->sched->stacks, task->coro);
+        task->coro = NULL;
+    }
+}
+
+/* Frees a task_new_in task once the scheduler is done with it. Other tasks
+   belong to the caller, and only give back their coroutine stack. */
+static inline void task_release(struct task *task) {
+    task_release_coro(task);
+    if (task->owned)
+        task_free(task);
+}
+
+bool task_depends_on(struct task *task, struct task *parent) {
+    assert(task != parent);
+    if (parent->ndependents == parent->dependents_cap) {
+        size_t cap = parent->dependents_cap ? parent->dependents_cap * 2 : 4;
+        struct task **dependents = (struct task **)realloc(
+            parent->dependents, cap * sizeof(*dependents));
+        if (!dependents) {
+            perror("realloc(task dependents)");
+            return false;
+        }
+        parent->dependents = dependents;
+        parent->dependents_cap = cap;
+    }
+    parent->dependents[parent->ndependents++] = task;
+    __atomic_fetch_add(&task->deps, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void task_set_period(struct task *task, uint64_t period_ns) {
+    task->period = period_ns;
+}
+
+void task_set_priority(struct task *task, unsigned priority) {
+    assert(priority <= TASK_PRIORITY_MAX);
+    task->priority = priority;
+}
+
+void task_sleep_until(struct task *task, uint64_t wake_ns) {
+    task->sleep_until = wake_ns;
+    task->status = TASK_SLEEP_UNTIL;
+}
+
+void task_park(struct task *task) {
+    task->status = TASK_WAIT;
+}
+
+void task_set_deadline(struct task *task, uint64_t deadline_ns) {
+    task->deadline = deadline_ns;
+}
+
+static bool task_deadline_less(const struct heap_elem *a_,
+                               const struct heap_elem *b_,
+                               void *aux) {
+    const struct task *a = heap_entry(a_, struct task, edf_elem);
+    const struct task *b = heap_entry(b_, struct task, edf_elem);
+    (void)aux;
+
+    if (a->deadline != b->deadline)
+        return a->deadline < b->deadline;
+    return a->edf_seq < b->edf_seq;
 }
 
 struct scheduler *scheduler_new() {
+    return scheduler_new_policy(SCHEDULER_FIFO);
+}
+
+struct scheduler *scheduler_new_policy(enum scheduler_policy policy) {
     struct scheduler *sched =
         (struct scheduler *)malloc(sizeof(struct scheduler));
     if (!sched) {
@@ -71,98 +629,1439 @@ struct scheduler *scheduler_new() {
         return NULL;
     }
 
-    list_init(&sched->tasks);
-    pthread_mutex_init(&sched->tasks_lock, NULL);
-    pthread_mutex_init(&sched->state_lock, NULL);
+    sched->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sched->wake_fd < 0) {
+        perror("eventfd(scheduler)");
+        free(sched);
+        return NULL;
+    }
+
+    /* wake_fd is the only entry without a task behind it, and aio's eventfd,
+       added by scheduler_aio_init, the only one that isn't a pointer to a
+       task. */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epoll_fd < 0 ||
+        epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->wake_fd, &ev) < 0) {
+        perror("epoll(scheduler)");
+        if (sched->epoll_fd >= 0)
+            close(sched->epoll_fd);
+        close(sched->wake_fd);
+        free(sched);
+        return NULL;
+    }
+    sched->aio_ready = false;
+    sched->idle = false;
+    sched->wake_requested = false;
+    sched->loop_break = false;
+
+    for (unsigned prio = 0; prio <= TASK_PRIORITY_MAX; prio++)
+        list_init(&sched->runq[prio]);
+    sched->runq_mask = 0;
+    sched->policy = policy;
+    heap_init(&sched->edf, task_deadline_less, NULL);
+    sched->edf_seq = 0;
+    sched->deadlines_met = 0;
+    sched->deadlines_missed = 0;
+    list_init(&sched->fd_waiting);
+    list_init(&sched->parked);
+    list_init(&sched->blocked);
+    mpsc_init(&sched->incoming);
+    mpsc_init(&sched->stopped);
+    mpsc_init(&sched->woken);
+    slab_init(&sched->task_pool, sizeof(struct task));
+    coro_pool_init(&sched->stacks, TASK_CORO_STACK_SIZE);
+    task_table_init(&sched->table);
+    wheel_init(&sched->timers, clock_ticks(), task_wake_at, NULL);
+    sched->pool = NULL;
+    sched->reaper = NULL;
+    trace_init(&sched->trace);
+#if SCHEDULER_STATS
+    sched->stats.ticks = 0;
+    sched->stats.tasks_run = 0;
+    sched->stats.max_tasks_per_tick = 0;
+    sched->stats.tick_ns = 0;
+    sched->stats.max_tick_ns = 0;
+    sched->stats.lock_wait_ns = 0;
+    sched->tick_tasks = 0;
+    for (unsigned i = 0; i <= SCHEDULER_HIST_START; i++)
+        hist_init(&sched->hists[i]);
+#endif
 
     return sched;
 }
 
-static struct list_elem *scheduler_remove(struct task *task) {
+/* Appends TASK to the run list of its priority, or files it by deadline. */
+static inline void scheduler_enqueue(struct scheduler *sched,
+                                     struct task *task) {
+    if (sched->policy == SCHEDULER_EDF) {
+        task->edf_seq = sched->edf_seq++;
+        heap_push(&sched->edf, &task->edf_elem);
+        return;
+    }
+    list_push_back(&sched->runq[task->priority], &task->elem);
+    sched->runq_mask |= (uint32_t)1 << task->priority;
+}
+
+/* Moves every task in the EDF heap to the back of LIST, earliest deadline
+   first. */
+static void scheduler_edf_take(struct scheduler *sched, struct list *list) {
+    struct heap_elem *e;
+
+    while ((e = heap_pop(&sched->edf)) != NULL)
+        list_push_back(list, &heap_entry(e, struct task, edf_elem)->elem);
+}
+
+/* Files every task left in LIST back in the EDF heap, under the deadlines
+   they set while running. */
+static void scheduler_edf_put(struct scheduler *sched, struct list *list) {
+    while (!list_empty(list))
+        scheduler_enqueue(sched,
+                          list_entry(list_pop_front(list), struct task, elem));
+}
+
+/* Returns true if any task is waiting in a run list, the EDF heap or the
+   task table. Only exact between ticks. */
+static bool scheduler_runnable(struct scheduler *sched) {
+    return sched->runq_mask != 0 || !heap_empty(&sched->edf) ||
+           task_table_busy(&sched->table);
+}
+
+/* Files TASK in the timer wheel until its wake_at. TASK must not be in a run
+   list. */
+static void scheduler_sleep(struct scheduler *sched, struct task *task) {
+    task->timed = true;
+    wheel_insert(&sched->timers, &task->elem);
+}
+
+/* Moves TASK from the timer wheel back to its run list. */
+static void scheduler_unsleep(struct scheduler *sched, struct task *task) {
+    wheel_remove(&sched->timers, &task->elem);
+    task->timed = false;
+    scheduler_enqueue(sched, task);
+}
+
+/* Moves every timed task that is due onto its run list. */
+static void scheduler_wake_timers(struct scheduler *sched) {
+    struct list due;
+
+    list_init(&due);
+    wheel_advance(&sched->timers, clock_ticks(), &due);
+    while (!list_empty(&due)) {
+        struct task *task =
+            list_entry(list_pop_front(&due), struct task, elem);
+        task->timed = false;
+        scheduler_enqueue(sched, task);
+    }
+}
+
+/* Takes TASK's fd out of the epoll set for good. */
+static void scheduler_forget_fd(struct scheduler *sched, struct task *task) {
+    if (!task->fd_registered)
+        return;
+    if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_DEL, task->fd, NULL) < 0)
+        perror("epoll_ctl(EPOLL_CTL_DEL)");
+    task->fd_registered = false;
+}
+
+/* Moves TASK from its run list to fd_waiting until its fd is ready. If the
+   fd can't be watched, TASK stays in the run list and from then on is run
+   every tick like any other task. */
+static void scheduler_wait_fd(struct scheduler *sched, struct task *task) {
+    struct epoll_event ev;
+
+    /* One-shot, so a task is never reported ready while it is already on a
+       run list. */
+    ev.events = task->fd_events | EPOLLONESHOT;
+    ev.data.ptr = task;
+    if (epoll_ctl(sched->epoll_fd,
+                  task->fd_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  task->fd, &ev) < 0) {
+        perror("epoll_ctl(task fd)");
+        scheduler_forget_fd(sched, task);
+        task->fd = -1;
+        return;
+    }
+    task->fd_registered = true;
+    task->fd_waiting = true;
+    list_remove(&task->elem);
+    list_push_back(&sched->fd_waiting, &task->elem);
+}
+
+/* Moves a waiting fd TASK back to its run list. */
+static void scheduler_unwait_fd(struct scheduler *sched, struct task *task) {
+    list_remove(&task->elem);
+    task->fd_waiting = false;
+    scheduler_enqueue(sched, task);
+}
+
+/* Waits up to TIMEOUT_MS (-1 for ever, 0 to just check) for fd tasks to
+   become ready or for wake_fd, and moves the ready tasks onto their run lists.
+   Returns the number of tasks moved. */
+static int scheduler_poll_fds(struct scheduler *sched, int timeout_ms) {
+    struct epoll_event events[64];
+    int n, ready = 0;
+
+    n = epoll_wait(sched->epoll_fd, events, 64, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        struct task *task = (struct task *)events[i].data.ptr;
+        if (events[i].data.ptr == &sched->aio) {
+            /* Completions are left for scheduler_collect_io, but the
+               eventfd is cleared here, as it can be signalled after the
+               reap that took the last one. */
+            aio_clear_event(&sched->aio);
+        }
+        else if (task) {
+            scheduler_unwait_fd(sched, task);
+            ready++;
+        }
+        else {
+            uint64_t count;
+            if (read(sched->wake_fd, &count, sizeof(count)) < 0)
+                perror("read(wake_fd)");
+        }
+    }
+    return ready;
+}
+
+/* Takes the tasks started since the last tick off the incoming queue and
+   links them into their run lists. The whole queue is drained into a list
+   of its own, and the tasks of the first one's priority, the common case
+   being all of them, are spliced onto that run list in one go. Delayed
+   starts go to the timer wheel instead, tasks with parents still to stop
+   to the blocked list, and the rest are filed one by one. */
+static void scheduler_collect_starts(struct scheduler *sched) {
+    struct list started;
+    struct list_elem *e;
+    unsigned prio;
+
+    list_init(&started);
+    if (mpsc_drain(&sched->incoming, &started) == 0)
+        return;
+
+    prio = list_entry(list_begin(&started), struct task, elem)->priority;
+    for (e = list_begin(&started); e != list_end(&started);) {
+        struct task *task = list_entry(e, struct task, elem);
+        if (__atomic_load_n(&task->deps, __ATOMIC_ACQUIRE) > 0) {
+            e = list_remove(e);
+            task->blocked = true;
+            list_push_back(&sched->blocked, &task->elem);
+        }
+        else if (task->timed) {
+            e = list_remove(e);
+            scheduler_sleep(sched, task);
+        }
+        else if (sched->policy == SCHEDULER_EDF || task->priority != prio) {
+            e = list_remove(e);
+            scheduler_enqueue(sched, task);
+        }
+        else {
+            e = list_next(e);
+        }
+    }
+    if (!list_empty(&started)) {
+        list_splice(list_end(&sched->runq[prio]), list_begin(&started),
+                    list_end(&started));
+        sched->runq_mask |= (uint32_t)1 << prio;
+    }
+}
+
+/* Counts TASK, which has just stopped, off the parents of each of its
+   dependents, and unblocks those with none left: to the back of TAIL if
+   given, else to their run lists, so a tick still walking either reaches
+   them. Dependents not started yet are left to scheduler_collect_starts.
+   Releasing TASK again does nothing. */
+static void scheduler_release(struct scheduler *sched,
+                              struct task *task,
+                              struct list *tail) {
+    for (size_t i = 0; i < task->ndependents; i++) {
+        struct task *child = task->dependents[i];
+        if (__atomic_sub_fetch(&child->deps, 1, __ATOMIC_ACQ_REL) > 0 ||
+            !child->blocked)
+            continue;
+
+        assert(child->sched == sched);
+        list_remove(&child->elem);
+        child->blocked = false;
+        if (child->timed)
+            scheduler_sleep(sched, child);
+        else if (tail)
+            list_push_back(tail, &child->elem);
+        else
+            scheduler_enqueue(sched, child);
+    }
+    free(task->dependents);
+    task->dependents = NULL;
+    task->ndependents = 0;
+    task->dependents_cap = 0;
+}
+
+/* Sends a periodic TASK that just ran back to the timer wheel until its next
+   period. Periods are counted from the previous due time so they don't drift,
+   unless the task has fallen a whole period behind. */
+static void scheduler_rearm(struct scheduler *sched, struct task *task) {
+    uint64_t period = ns_to_ticks(task->period);
+
+    task->wake_at += period;
+    if (task->wake_at <= sched->timers.now)
+        task->wake_at = sched->timers.now + period;
+
+    list_remove(&task->elem);
+    scheduler_sleep(sched, task);
+}
+
+/* Sets up sched->aio for the first I/O request, so that a scheduler that
+   never does any has no io_uring instance or threads. Returns false, after
+   printing why, if it can't be. */
+static bool scheduler_aio_init(struct scheduler *sched) {
+    struct epoll_event ev;
+
+    if (sched->aio_ready)
+        return true;
+    if (!aio_init(&sched->aio, 0))
+        return false;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &sched->aio;
+    if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->aio.event_fd,
+                  &ev) < 0) {
+        perror("epoll_ctl(aio)");
+        aio_destroy(&sched->aio);
+        return false;
+    }
+    sched->aio_ready = true;
+    return true;
+}
+
+/* Takes a task that just ran off its run list if it has nothing to do until
+   its I/O completes, the time it asked to sleep until, task_unpark, its next
+   period or its fd is ready. I/O is submitted whatever the state, so the
+   buffer stays in use until the request has completed even if the task has
+   stopped. */
+static void scheduler_park(struct scheduler *sched, struct task *task) {
+    enum task_status status = task->status;
+    task->status = TASK_CONTINUE;
+
+    if (task->io_queued) {
+        task->io_queued = false;
+        if (!scheduler_aio_init(sched)) {
+            /* Fails as the request would have, without leaving. A task
+               that stopped with it queued is done now. */
+            task->io.result = -ENOMEM;
+            if (task_state(task) == STOPPED)
+                scheduler_release(sched, task, NULL);
+            return;
+        }
+        list_remove(&task->elem);
+        task->io_busy = true;
+        aio_submit(&sched->aio, &task->io);
+        return;
+    }
+    if (task_state(task) != RUNNING)
+        return;
+    if (status == TASK_SLEEP_UNTIL) {
+        /* Rounded up, so it never wakes early. A time that is already due
+           leaves it to run again next tick. */
+        uint64_t wake_at = ns_to_ticks(task->sleep_until);
+        if (wake_at > sched->timers.now) {
+            task->wake_at = wake_at;
+            list_remove(&task->elem);
+            scheduler_sleep(sched, task);
+        }
+    }
+    else if (status == TASK_WAIT) {
+        /* An unpark that came in since the task last woke cancels the park,
+           as it may have come before the task asked for it. */
+        if (!__atomic_exchange_n(&task->unparked, false, __ATOMIC_ACQ_REL)) {
+            list_remove(&task->elem);
+            task->parked = true;
+            list_push_back(&sched->parked, &task->elem);
+        }
+    }
+    else if (task->period) {
+        scheduler_rearm(sched, task);
+    }
+    else if (task->fd >= 0) {
+        scheduler_wait_fd(sched, task);
+    }
+}
+
+/* Moves the tasks whose I/O has completed back to their run lists, so they
+   run this tick. */
+static void scheduler_collect_io(struct scheduler *sched) {
+    struct list done;
+    struct list_elem *e;
+
+    list_init(&done);
+    if (!sched->aio_ready || aio_reap(&sched->aio, &done) == 0)
+        return;
+
+    for (e = list_begin(&done); e != list_end(&done);) {
+        struct task *task = list_entry(e, struct task, io.elem);
+        e = list_remove(e);
+        task->io_busy = false;
+        scheduler_enqueue(sched, task);
+        /* A task that stopped with its request queued is only done now. */
+        if (task_state(task) == STOPPED)
+            scheduler_release(sched, task, NULL);
+    }
+}
+
+/* Moves TASK from the parked list back to its run list. */
+static void scheduler_unpark(struct scheduler *sched, struct task *task) {
+    list_remove(&task->elem);
+    task->parked = false;
+    scheduler_enqueue(sched, task);
+}
+
+/* Handles the task_unpark calls since the last tick. A task that is not
+   parked yet keeps its unparked flag for when it next tries to park. */
+static void scheduler_collect_unparks(struct scheduler *sched) {
+    struct list_elem *e;
+
+    while ((e = mpsc_pop(&sched->woken)) != NULL) {
+        struct task *task = list_entry(e, struct task, wake_elem);
+        __atomic_store_n(&task->wake_pending, false, __ATOMIC_RELEASE);
+        if (task->parked &&
+            __atomic_exchange_n(&task->unparked, false, __ATOMIC_ACQ_REL))
+            scheduler_unpark(sched, task);
+    }
+}
+
+/* Handles the scheduler_stop calls since the last tick. Interrupted tasks
+   that are asleep in the timer wheel are woken so the interrupt isn't held
+   back until their period is up. Tasks waiting for I/O get their interrupt
+   once it has completed. */
+static void scheduler_collect_stops(struct scheduler *sched) {
+    struct list_elem *e;
+
+    while ((e = mpsc_pop(&sched->stopped)) != NULL) {
+        struct task *task = list_entry(e, struct task, stop_elem);
+        __atomic_fetch_sub(&task->stop_pending, 1, __ATOMIC_RELEASE);
+        if (task->timed)
+            scheduler_unsleep(sched, task);
+        else if (task->fd_waiting)
+            scheduler_unwait_fd(sched, task);
+        else if (task->parked)
+            scheduler_unpark(sched, task);
+    }
+}
+
+/* Returns true if TASK can leave the scheduler. A STOPPED task may still have
+   a scheduler_stop in flight, anywhere from just before its transition to
+   INTERRUPTED until its stop_elem is popped off the stop queue, or its
+   wake_elem in the woken queue, in which case it stays for another tick. */
+static bool task_removable(struct task *task) {
+    return task_state(task) == STOPPED &&
+           !__atomic_load_n(&task->stop_pending, __ATOMIC_ACQUIRE) &&
+           !__atomic_load_n(&task->wake_pending, __ATOMIC_ACQUIRE);
+}
+
+/* Runs destroy fns off the scheduler thread, for scheduler_reaper. Removed
+   tasks are pushed onto queue, linked through elem, and the reaper is woken
+   once at the end of each tick that pushed any, so it destroys a tick's worth
+   at a time and a tick costs at most one signal. */
+struct reaper {
+    struct scheduler *sched;
+    pthread_t thread;
+    struct mpsc_queue /* <task> */ queue;
+    size_t queued; /* Pushed since the last wakeup, scheduler thread only */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long posted; /* Bumped by each wakeup */
+    bool shutdown;
+};
+
+/* Destroys every task on the reaper's queue, and frees those the scheduler
+   owns. A task that belongs to the caller is not touched after its destroy,
+   which may well free it. */
+static void reaper_drain(struct reaper *reaper) {
+    struct list_elem *e;
+
+    while ((e = mpsc_pop(&reaper->queue)) != NULL) {
+        struct task *task = list_entry(e, struct task, elem);
+        task_fn_t destroy = task->destroy;
+        bool owned = task->owned;
+        uint64_t start = trace_start(reaper->sched);
+
+        destroy(task->data);
+        trace_call(reaper->sched, "destroy", start, task,
+                   (const void *)destroy);
+        if (owned)
+            task_free(task);
+    }
+}
+
+static void *reaper_main(void *arg) {
+    struct reaper *reaper = (struct reaper *)arg;
+    unsigned long seen = 0;
+    bool shutdown;
+
+    for (;;) {
+        pthread_mutex_lock(&reaper->lock);
+        while (!reaper->shutdown && reaper->posted == seen)
+            pthread_cond_wait(&reaper->cond, &reaper->lock);
+        seen = reaper->posted;
+        shutdown = reaper->shutdown;
+        pthread_mutex_unlock(&reaper->lock);
+
+        /* Every push came before the wakeup, so a shutdown drain is the
+           last one needed. */
+        reaper_drain(reaper);
+        if (shutdown)
+            return NULL;
+    }
+}
+
+/* Hands TASK, out of every list, to the reaper for its destroy. Its stack is
+   no longer used once it has stopped, so it goes back to the pool now for the
+   next coroutine rather than after the destroy. */
+static void reaper_push(struct reaper *reaper, struct task *task) {
+    task_release_coro(task);
+    mpsc_push(&reaper->queue, &task->elem);
+    reaper->queued++;
+}
+
+/* Wakes the reaper if the tick gave it any tasks. */
+static void reaper_wake(struct reaper *reaper) {
+    if (!reaper || reaper->queued == 0)
+        return;
+    reaper->queued = 0;
+    pthread_mutex_lock(&reaper->lock);
+    reaper->posted++;
+    pthread_cond_signal(&reaper->cond);
+    pthread_mutex_unlock(&reaper->lock);
+}
+
+/* Stops the reaper once it has destroyed every task it was given. */
+static void reaper_free(struct reaper *reaper) {
+    pthread_mutex_lock(&reaper->lock);
+    reaper->shutdown = true;
+    pthread_cond_signal(&reaper->cond);
+    pthread_mutex_unlock(&reaper->lock);
+
+    pthread_join(reaper->thread, NULL);
+    pthread_mutex_destroy(&reaper->lock);
+    pthread_cond_destroy(&reaper->cond);
+    free(reaper);
+}
+
+static struct reaper *reaper_new(struct scheduler *sched) {
+    struct reaper *reaper = (struct reaper *)calloc(1, sizeof(struct reaper));
+    if (!reaper) {
+        perror("calloc(struct reaper)");
+        return NULL;
+    }
+
+    reaper->sched = sched;
+    mpsc_init(&reaper->queue);
+    pthread_mutex_init(&reaper->lock, NULL);
+    pthread_cond_init(&reaper->cond, NULL);
+    if (pthread_create(&reaper->thread, NULL, reaper_main, reaper)) {
+        perror("pthread_create(reaper)");
+        pthread_mutex_destroy(&reaper->lock);
+        pthread_cond_destroy(&reaper->cond);
+        free(reaper);
+        return NULL;
+    }
+    return reaper;
+}
+
+/* Unlinks TASK and destroys and releases it, or leaves that to the reaper if
+   there is one. Returns the element that followed it. */
+static struct list_elem *scheduler_remove(struct scheduler *sched,
+                                          struct task *task) {
     struct list_elem *next = list_remove(&task->elem);
-    if (task->state != STARTING && task->destroy)
+    scheduler_forget_fd(sched, task);
+    if (sched->reaper && task_state(task) != STARTING && task->destroy) {
+        reaper_push(sched->reaper, task);
+        return next;
+    }
+    if (task_state(task) != STARTING && task->destroy) {
+        uint64_t start = trace_start(sched);
         task->destroy(task->data);
+        trace_call(sched, "destroy", start, task, (const void *)task->destroy);
+    }
+    task_release(task);
     return next;
 }
 
+/* Advances TASK by one tick. TASK must not be STOPPED. */
+static void task_step(struct task *task) {
+    struct scheduler *sched = task->sched;
+    uint64_t traced;
+
+    switch (task_state(task)) {
+    case STARTING:
+        stats_task_init(task, stats_clock());
+        if (task->init) {
+            traced = trace_start(sched);
+            task->init(task->data);
+            trace_call(sched, "init", traced, task, (const void *)task->init);
+        }
+        if (task->is_coro) {
+            task->coro = coro_new(&sched->stacks, task->run, task->data);
+            if (!task->coro) {
+                task_set_state(task, STOPPED);
+                break;
+            }
+        }
+        task_set_state(task, RUNNING);
+        /* An fd task only runs once its fd is ready, and a task that
+           queued I/O in init once the request has completed. */
+        if (task->fd >= 0 || task->io_queued)
+            break;
+        // fall through
+    case RUNNING: {
+        /* A deadline covers one run. run may set the next one. */
+        uint64_t deadline = task->deadline;
+        uint64_t start = stats_clock();
+        task->deadline = TASK_NO_DEADLINE;
+        traced = trace_start(sched);
+
+        if (task->step) {
+            /* One call instead of run and is_done. TASK_WAIT needs nothing
+               more: a task with I/O queued is parked whatever it returns. */
+            enum task_status status =
+                task->step(task->data, &task->sleep_until);
+            /* CONTINUE leaves any task_sleep_until or task_park in place. */
+            if (status != TASK_CONTINUE)
+                task->status = status;
+            if (status == TASK_DONE)
+                task_transition(task, RUNNING, STOPPED);
+        }
+        else if (task->coro) {
+            /* A stop that came in while the body was running is left for
+               the interrupt fn, as below. */
+            if (coro_resume(task->coro))
+                task_transition(task, RUNNING, STOPPED);
+        }
+        else {
+            task->run(task->data);
+            /* If a stop came in while running, leave it INTERRUPTED so the
+               interrupt fn still gets its call next tick. */
+            if (!task->is_done || task->is_done(task->data))
+                task_transition(task, RUNNING, STOPPED);
+        }
+        stats_task_run(task, start);
+        trace_call(sched, "run", traced, task,
+                   task->step ? (const void *)task->step
+                              : (const void *)task->run);
+        if (deadline != TASK_NO_DEADLINE)
+            __atomic_fetch_add(clock_ns() <= deadline
+                                   ? &sched->deadlines_met
+                                   : &sched->deadlines_missed,
+                               1, __ATOMIC_RELAXED);
+        break;
+    }
+    case INTERRUPTED:
+        if (task->interrupt) {
+            traced = trace_start(sched);
+            task->interrupt(task->data);
+            trace_call(sched, "interrupt", traced, task,
+                       (const void *)task->interrupt);
+        }
+        task_set_state(task, STOPPED);
+        break;
+    case STOPPED:
+        assert(false);
+        break;
+    }
+}
+
+/* A range of the pool's tick items owned by one worker. The owner pops from
+   the bottom and idle workers steal from the top. Both ends are packed into a
+   single word so either side claims an item with one compare-and-swap. */
+struct worker_deque {
+    uint64_t bounds; /* top << 32 | bottom */
+} __attribute__((aligned(64)));
+
+struct worker {
+    struct worker_pool *pool;
+    unsigned id;
+};
+
+struct worker_pool {
+    unsigned nthreads; /* Including the thread calling scheduler_run_parallel */
+    pthread_t *threads;
+    struct worker *workers;
+    struct worker_deque *deques;
+
+    /* Tasks for the current tick, split in contiguous ranges over deques. */
+    struct task **items;
+    size_t items_cap;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    unsigned long generation; /* Bumped once per tick to release workers */
+    unsigned active;          /* Workers that have not finished this tick */
+    bool shutdown;
+};
+
+static inline uint64_t deque_bounds(uint32_t top, uint32_t bottom) {
+    return ((uint64_t)top << 32) | bottom;
+}
+
+/* Takes the item at the bottom of DQ. Returns NULL when DQ is empty. */
+static struct task *deque_pop(struct worker_pool *pool,
+                              struct worker_deque *dq) {
+    uint64_t b = __atomic_load_n(&dq->bounds, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t top = b >> 32, bottom = (uint32_t)b;
+        if (top == bottom)
+            return NULL;
+        if (__atomic_compare_exchange_n(&dq->bounds, &b,
+                                        deque_bounds(top, bottom - 1), true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return pool->items[bottom - 1];
+    }
+}
+
+/* Takes the item at the top of DQ. Returns NULL when DQ is empty. */
+static struct task *deque_steal(struct worker_pool *pool,
+                                struct worker_deque *dq) {
+    uint64_t b = __atomic_load_n(&dq->bounds, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t top = b >> 32, bottom = (uint32_t)b;
+        if (top == bottom)
+            return NULL;
+        if (__atomic_compare_exchange_n(&dq->bounds, &b,
+                                        deque_bounds(top + 1, bottom), true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return pool->items[top];
+    }
+}
+
+/* Runs the tick's items for worker ID until every deque is empty. STOPPED
+   items have already been unlinked from the run lists and only need their
+   destroy fn, scheduler_run_parallel releases them afterwards. */
+static void worker_drain(struct worker_pool *pool, unsigned id) {
+    unsigned victim = id;
+    for (;;) {
+        struct task *task = deque_pop(pool, &pool->deques[id]);
+        while (!task && (victim = (victim + 1) % pool->nthreads) != id)
+            task = deque_steal(pool, &pool->deques[victim]);
+        if (!task)
+            return;
+
+        if (task_state(task) == STOPPED) {
+            if (task->destroy) {
+                uint64_t start = trace_start(task->sched);
+                task->destroy(task->data);
+                trace_call(task->sched, "destroy", start, task,
+                           (const void *)task->destroy);
+            }
+        }
+        else {
+            task_step(task);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *worker = (struct worker *)arg;
+    struct worker_pool *pool = worker->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        if (pool->shutdown)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        worker_drain(pool, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void worker_pool_free(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->items);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+/* Creates a pool of NTHREADS workers. Worker 0 is the calling thread, so only
+   NTHREADS - 1 threads are spawned. */
+static struct worker_pool *worker_pool_new(unsigned nthreads) {
+    struct worker_pool *pool =
+        (struct worker_pool *)calloc(1, sizeof(struct worker_pool));
+    if (!pool) {
+        perror("calloc(struct worker_pool)");
+        return NULL;
+    }
+
+    pool->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+    pool->workers = (struct worker *)calloc(nthreads, sizeof(struct worker));
+    if (posix_memalign((void **)&pool->deques, 64,
+                       nthreads * sizeof(struct worker_deque)))
+        pool->deques = NULL;
+    if (!pool->threads || !pool->workers || !pool->deques) {
+        perror("calloc(struct worker_pool)");
+        free(pool->deques);
+        free(pool->workers);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->nthreads = 1;
+    for (unsigned i = 0; i < nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pool->deques[i].bounds = 0;
+        if (i == 0)
+            continue;
+        if (pthread_create(&pool->threads[i], NULL, worker_main,
+                           &pool->workers[i])) {
+            perror("pthread_create(worker)");
+            worker_pool_free(pool);
+            return NULL;
+        }
+        pool->nthreads++;
+    }
+
+    return pool;
+}
+
 void scheduler_free(struct scheduler *sched) {
-    pthread_mutex_lock(&sched->tasks_lock);
-    pthread_mutex_lock(&sched->state_lock);
     struct list_elem *e;
-    for (e = list_begin(&sched->tasks); e != list_end(&sched->tasks);) {
+
+    /* Tasks with I/O in flight can only be destroyed once it completes. */
+    while (sched->aio_ready && sched->aio.pending > 0) {
+        aio_wait(&sched->aio);
+        scheduler_collect_io(sched);
+    }
+    while (mpsc_pop(&sched->stopped) != NULL)
+        continue;
+    while (mpsc_pop(&sched->woken) != NULL)
+        continue;
+
+    /* Gather every task, wherever it is waiting. */
+    struct list all;
+    list_init(&all);
+    for (unsigned prio = 0; prio <= TASK_PRIORITY_MAX; prio++)
+        list_splice(list_end(&all), list_begin(&sched->runq[prio]),
+                    list_end(&sched->runq[prio]));
+    scheduler_edf_take(sched, &all);
+    mpsc_drain(&sched->incoming, &all);
+    wheel_flush(&sched->timers, &all);
+    list_splice(list_end(&all), list_begin(&sched->fd_waiting),
+                list_end(&sched->fd_waiting));
+    list_splice(list_end(&all), list_begin(&sched->parked),
+                list_end(&sched->parked));
+    list_splice(list_end(&all), list_begin(&sched->blocked),
+                list_end(&sched->blocked));
+    for (e = list_begin(&all); e != list_end(&all);) {
         struct task *task = list_entry(e, struct task, elem);
-        switch (task->state) {
+        switch (task_state(task)) {
         case RUNNING:
-            if (!task->is_done || task->is_done(task->data)) {
-                task->state = STOPPED;
+            /* A coroutine or step task that is still running is not done,
+               or it would have stopped. */
+            if (!task->coro && !task->step &&
+                (!task->is_done || task->is_done(task->data))) {
+                task_set_state(task, STOPPED);
                 break;
             }
             // fall through
         case INTERRUPTED:
             if (task->interrupt)
                 task->interrupt(task->data);
-            task->state = STOPPED;
+            task_set_state(task, STOPPED);
             break;
         case STARTING:
         case STOPPED:
             break;
         }
-        e = scheduler_remove(task);
+        e = scheduler_remove(sched, task);
     }
 
-    pthread_mutex_destroy(&sched->tasks_lock);
-    pthread_mutex_destroy(&sched->state_lock);
+    task_table_clear(&sched->table);
+    task_table_destroy(&sched->table);
+
+    if (sched->reaper)
+        reaper_free(sched->reaper);
+    if (sched->pool)
+        worker_pool_free(sched->pool);
+
+    slab_destroy(&sched->task_pool);
+    coro_pool_destroy(&sched->stacks);
+    close(sched->epoll_fd);
+    if (sched->aio_ready)
+        aio_destroy(&sched->aio);
+    close(sched->wake_fd);
+    trace_destroy(&sched->trace);
     free(sched);
 }
 
-void scheduler_run(struct scheduler *sched) {
-    pthread_mutex_lock(&sched->state_lock);
+/* Brings in everything other threads handed over since the last tick. */
+static void scheduler_collect(struct scheduler *sched) {
+    scheduler_collect_starts(sched);
+    scheduler_collect_io(sched);
+    scheduler_collect_unparks(sched);
+    scheduler_collect_stops(sched);
+    scheduler_wake_timers(sched);
+    if (!list_empty(&sched->fd_waiting))
+        scheduler_poll_fds(sched, 0);
+}
+
+/* Returns the highest priority level set in LEVELS, which must not be 0. */
+static inline unsigned highest_level(uint32_t levels) {
+    return 31 - __builtin_clz(levels);
+}
+
+/* Clears the bits of runq_mask whose run list is empty. */
+static void scheduler_trim_mask(struct scheduler *sched) {
+    uint32_t levels = sched->runq_mask;
 
-    pthread_mutex_lock(&sched->tasks_lock);
+    while (levels) {
+        unsigned prio = highest_level(levels);
+        levels &= ~((uint32_t)1 << prio);
+        if (list_empty(&sched->runq[prio]))
+            sched->runq_mask &= ~((uint32_t)1 << prio);
+    }
+}
+
+/* Runs one tick of every task in RUNQ, in order, or stops once the clock
+   passes UNTIL (UINT64_MAX for never) after a task. On stopping early, the
+   tasks already visited are moved behind the rest, so the next tick starts
+   with those that were skipped. Returns true if it reached the end of RUNQ. */
+static bool scheduler_run_list(struct scheduler *sched,
+                               struct list *runq,
+                               uint64_t until) {
     struct list_elem *e;
-    for (e = list_begin(&sched->tasks); e != list_end(&sched->tasks);) {
+
+    for (e = list_begin(runq); e != list_end(runq);) {
         struct task *task = list_entry(e, struct task, elem);
         e = list_next(e);
-        pthread_mutex_unlock(&sched->tasks_lock);
 
-        switch (task->state) {
-        case STARTING:
-            if (task->init)
-                task->init(task->data);
-            task->state = RUNNING;
-            // fall through
-        case RUNNING:
-            task->run(task->data);
-            if (!task->is_done || task->is_done(task->data))
-                task->state = STOPPED;
-            break;
-        case INTERRUPTED:
-            if (task->interrupt)
-                task->interrupt(task->data);
-            task->state = STOPPED;
-            break;
-        case STOPPED:
-            e = scheduler_remove(task);
+        if (task_removable(task)) {
+            e = scheduler_remove(sched, task);
+        }
+        else {
+            if (task_state(task) != STOPPED) {
+                task_step(task);
+                stats_tick_task(sched);
+                /* Dependents go to the back, so the next task is looked up
+                   again in case TASK was the last. The EDF tick walks a list
+                   of its own. A task that queued I/O in its last run has not
+                   finished until the request completes. */
+                if (task_state(task) == STOPPED && !task->io_queued) {
+                    scheduler_release(
+                        sched, task,
+                        sched->policy == SCHEDULER_EDF ? runq : NULL);
+                    e = list_next(&task->elem);
+                }
+            }
+            scheduler_park(sched, task);
+        }
+
+        if (until != UINT64_MAX && e != list_end(runq) &&
+            clock_ns() >= until) {
+            list_splice(list_end(runq), list_begin(runq), e);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Runs a tick, in policy order, up to UNTIL as in scheduler_run_list.
+   Returns true if every task got its turn. */
+static bool scheduler_tick(struct scheduler *sched, uint64_t until) {
+    uint64_t start = stats_clock(), traced = trace_start(sched);
+    bool whole = true;
+
+    scheduler_collect(sched);
+
+    if (sched->policy == SCHEDULER_EDF) {
+        /* Deadlines set during the tick only count from the next one. */
+        struct list ready;
+        list_init(&ready);
+        scheduler_edf_take(sched, &ready);
+        whole = scheduler_run_list(sched, &ready, until);
+        scheduler_edf_put(sched, &ready);
+    }
+    else {
+        /* Highest priority first. Running a task never moves it to another
+           level, so the levels can be taken from the mask up front. */
+        uint32_t levels = sched->runq_mask;
+        while (levels && whole) {
+            unsigned prio = highest_level(levels);
+            levels &= ~((uint32_t)1 << prio);
+            whole = scheduler_run_list(sched, &sched->runq[prio], until);
+            /* Dependents released to lower levels still make this tick. */
+            levels |= sched->runq_mask & (((uint32_t)1 << prio) - 1);
+            if (levels && until != UINT64_MAX && clock_ns() >= until)
+                whole = false;
+        }
+        scheduler_trim_mask(sched);
+    }
+
+    /* The task table comes last, and is run whole or not at all. */
+    if (task_table_busy(&sched->table)) {
+        if (whole && (until == UINT64_MAX || clock_ns() < until)) {
+            uint64_t table = trace_start(sched);
+            task_table_run(&sched->table);
+            trace_call(sched, "table", table, NULL, NULL);
+        }
+        else {
+            whole = false;
+        }
+    }
+    if (sched->aio_ready)
+        aio_flush(&sched->aio);
+    reaper_wake(sched->reaper);
+    stats_tick(sched, start);
+    trace_call(sched, "tick", traced, NULL, NULL);
+    return whole;
+}
+
+void scheduler_run(struct scheduler *sched) {
+    scheduler_tick(sched, UINT64_MAX);
+}
+
+bool scheduler_run_for(struct scheduler *sched, uint64_t budget_ns) {
+    return scheduler_tick(sched, clock_ns() + budget_ns);
+}
+
+/* Appends the tasks of RUNQ to the tick's items, from item *N on. STOPPED
+   tasks are unlinked here, and kept on REAPED until the workers have
+   destroyed them, so the workers never touch the lists; with a reaper they
+   go straight to it instead. Returns false if the
+   items could not grow to hold them all. */
+static bool worker_pool_snapshot(struct scheduler *sched,
+                                 struct list *runq,
+                                 size_t *n,
+                                 struct list *reaped) {
+    struct worker_pool *pool = sched->pool;
+    struct list_elem *e;
+
+    for (e = list_begin(runq); e != list_end(runq);) {
+        struct task *task = list_entry(e, struct task, elem);
+        if (task_state(task) == STOPPED && !task_removable(task)) {
+            e = list_next(e);
+            continue;
+        }
+        if (task_state(task) == STOPPED && sched->reaper) {
+            e = scheduler_remove(sched, task);
+            continue;
+        }
+        if (*n == pool->items_cap) {
+            size_t cap = pool->items_cap ? pool->items_cap * 2 : 64;
+            struct task **items =
+                (struct task **)realloc(pool->items, cap * sizeof(*items));
+            if (!items) {
+                perror("realloc(worker_pool items)");
+                return false;
+            }
+            pool->items = items;
+            pool->items_cap = cap;
+        }
+        pool->items[(*n)++] = task;
+        if (task_state(task) == STOPPED) {
+            e = list_remove(e);
+            scheduler_forget_fd(sched, task);
+            list_push_back(reaped, &task->elem);
+        }
+        else {
+            stats_tick_task(sched);
+            e = list_next(e);
+        }
+    }
+    return true;
+}
+
+void scheduler_run_parallel(struct scheduler *sched, unsigned nthreads) {
+    if (nthreads <= 1) {
+        scheduler_run(sched);
+        return;
+    }
+
+    if (sched->pool && sched->pool->nthreads != nthreads) {
+        worker_pool_free(sched->pool);
+        sched->pool = NULL;
+    }
+    if (!sched->pool)
+        sched->pool = worker_pool_new(nthreads);
+    if (!sched->pool) {
+        scheduler_run(sched);
+        return;
+    }
+    struct worker_pool *pool = sched->pool;
+    uint64_t start = stats_clock(), traced = trace_start(sched), wait, locked;
+
+    scheduler_collect(sched);
+
+    /* Snapshot the tick, highest priority (or earliest deadline) first, so
+       the start of each worker's share goes to the more important tasks. */
+    struct list reaped, ready;
+    size_t n = 0;
+    list_init(&reaped);
+    list_init(&ready);
+    if (sched->policy == SCHEDULER_EDF) {
+        scheduler_edf_take(sched, &ready);
+        worker_pool_snapshot(sched, &ready, &n, &reaped);
+    }
+    for (uint32_t levels = sched->runq_mask; levels;) {
+        unsigned prio = highest_level(levels);
+        levels &= ~((uint32_t)1 << prio);
+        if (!worker_pool_snapshot(sched, &sched->runq[prio], &n, &reaped))
             break;
+    }
+
+    if (n > 0) {
+        for (unsigned i = 0; i < nthreads; i++)
+            pool->deques[i].bounds =
+                deque_bounds(n * i / nthreads, n * (i + 1) / nthreads);
+
+        wait = stats_clock();
+        locked = trace_start(sched);
+        pthread_mutex_lock(&pool->lock);
+        stats_lock_wait(sched, wait);
+        trace_call(sched, "lock wait", locked, NULL, NULL);
+        pool->active = nthreads - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        worker_drain(pool, 0);
+
+        /* Waiting for the other workers to finish counts as lock wait. */
+        wait = stats_clock();
+        locked = trace_start(sched);
+        pthread_mutex_lock(&pool->lock);
+        while (pool->active > 0)
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        stats_lock_wait(sched, wait);
+        trace_call(sched, "lock wait", locked, NULL, NULL);
+
+        /* Dependents of tasks that stopped, with no I/O left to do, run
+           from the next tick. */
+        for (size_t i = 0; i < n; i++) {
+            if (task_state(pool->items[i]) == STOPPED &&
+                !pool->items[i]->io_queued)
+                scheduler_release(sched, pool->items[i], NULL);
+            scheduler_park(sched, pool->items[i]);
         }
+        if (sched->aio_ready)
+            aio_flush(&sched->aio);
+    }
+    scheduler_edf_put(sched, &ready);
+    scheduler_trim_mask(sched);
+
+    while (!list_empty(&reaped))
+        task_release(list_entry(list_pop_front(&reaped), struct task, elem));
+
+    /* The task table is a scan on its own, left to this thread. */
+    if (task_table_busy(&sched->table)) {
+        uint64_t table = trace_start(sched);
+        task_table_run(&sched->table);
+        trace_call(sched, "table", table, NULL, NULL);
+    }
+    reaper_wake(sched->reaper);
+    stats_tick(sched, start);
+    trace_call(sched, "tick", traced, NULL, NULL);
+}
+
+/* Wakes scheduler_loop if it is asleep, after handing it something through
+   one of the queues. While the loop is busy this is a single load. */
+static void scheduler_notify(struct scheduler *sched) {
+    if (__atomic_load_n(&sched->idle, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&sched->idle, false, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        if (write(sched->wake_fd, &one, sizeof(one)) < 0)
+            perror("write(wake_fd)");
+    }
+}
+
+/* Blocks until another thread hands over work, an fd task is ready,
+   scheduler_wakeup is called or the next timer is due. Returns straight away
+   if any of that has already happened. */
+static void scheduler_idle(struct scheduler *sched) {
+    /* Announce the sleep before looking at the queues. A producer pushes
+       before looking at idle, so one of the two sides sees the other. */
+    __atomic_store_n(&sched->idle, true, __ATOMIC_SEQ_CST);
+    if (!mpsc_empty(&sched->incoming) || !mpsc_empty(&sched->stopped) ||
+        !mpsc_empty(&sched->woken) ||
+        task_table_busy(&sched->table) ||
+        __atomic_load_n(&sched->wake_requested, __ATOMIC_SEQ_CST) ||
+        __atomic_load_n(&sched->loop_break, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&sched->idle, false, __ATOMIC_RELAXED);
+        return;
+    }
+
+    int timeout_ms = -1;
+    uint64_t next = wheel_next_expiry(&sched->timers);
+    if (next != UINT64_MAX) {
+        uint64_t now = clock_ns();
+        uint64_t due = next * SCHEDULER_TIMER_RESOLUTION_NS;
+        timeout_ms = due > now ? (due - now + 999999) / 1000000 : 0;
+    }
+
+    scheduler_poll_fds(sched, timeout_ms);
+    __atomic_store_n(&sched->idle, false, __ATOMIC_RELAXED);
+}
 
-        pthread_mutex_lock(&sched->tasks_lock);
+void scheduler_loop(struct scheduler *sched) {
+    while (!__atomic_exchange_n(&sched->loop_break, false, __ATOMIC_ACQ_REL)) {
+        __atomic_store_n(&sched->wake_requested, false, __ATOMIC_RELAXED);
+        scheduler_run(sched);
+        if (!scheduler_runnable(sched))
+            scheduler_idle(sched);
     }
+}
+
+void scheduler_wakeup(struct scheduler *sched) {
+    __atomic_store_n(&sched->wake_requested, true, __ATOMIC_SEQ_CST);
+    scheduler_notify(sched);
+}
+
+void scheduler_break(struct scheduler *sched) {
+    __atomic_store_n(&sched->loop_break, true, __ATOMIC_SEQ_CST);
+    scheduler_notify(sched);
+}
+
+void scheduler_deadline_stats(struct scheduler *sched,
+                              struct scheduler_deadline_stats *stats) {
+    stats->met = __atomic_load_n(&sched->deadlines_met, __ATOMIC_RELAXED);
+    stats->missed = __atomic_load_n(&sched->deadlines_missed, __ATOMIC_RELAXED);
+}
 
-    pthread_mutex_unlock(&sched->tasks_lock);
-    pthread_mutex_unlock(&sched->state_lock);
+bool scheduler_get_stats(struct scheduler *sched,
+                         struct scheduler_stats *stats) {
+#if SCHEDULER_STATS
+    *stats = sched->stats;
+    return true;
+#else
+    (void)sched;
+    memset(stats, 0, sizeof(*stats));
+    return false;
+#endif
+}
+
+bool scheduler_reaper(struct scheduler *sched, bool enable) {
+    if (enable && !sched->reaper) {
+        sched->reaper = reaper_new(sched);
+        return sched->reaper != NULL;
+    }
+    if (!enable && sched->reaper) {
+        reaper_free(sched->reaper);
+        sched->reaper = NULL;
+    }
+    return true;
+}
+
+void scheduler_trace(struct scheduler *sched, bool enable) {
+    trace_enable(&sched->trace, enable);
+}
+
+bool scheduler_trace_dump(struct scheduler *sched, const char *path) {
+    FILE *f = fopen(path, "w");
+    bool ok;
+
+    if (!f) {
+        perror("fopen(scheduler_trace_dump)");
+        return false;
+    }
+    ok = trace_dump(&sched->trace, f);
+    if (fclose(f) != 0 || !ok) {
+        perror("write(scheduler_trace_dump)");
+        return false;
+    }
+    return true;
+}
+
+bool scheduler_get_hist(struct scheduler *sched,
+                        enum scheduler_hist which,
+                        struct hist *snapshot,
+                        bool reset) {
+    assert(which <= SCHEDULER_HIST_START);
+#if SCHEDULER_STATS
+    hist_snapshot(&sched->hists[which], snapshot, reset);
+    return true;
+#else
+    (void)sched;
+    hist_init(snapshot);
+    (void)reset;
+    return false;
+#endif
+}
+
+bool task_get_stats(struct task *task, struct task_stats *stats) {
+#if SCHEDULER_STATS
+    *stats = task->stats;
+    return true;
+#else
+    (void)task;
+    memset(stats, 0, sizeof(*stats));
+    return false;
+#endif
+}
+
+void scheduler_pool_stats(struct scheduler *sched,
+                          struct scheduler_pool_stats *stats) {
+    struct slab_stats slab;
+
+    slab_stats(&sched->task_pool, &slab);
+    stats->slabs = slab.slabs;
+    stats->free = slab.free;
+    stats->in_use = slab.in_use;
 }
 
 void scheduler_start(struct scheduler *sched, struct task *task) {
-    pthread_mutex_lock(&sched->tasks_lock);
+    task->sched = sched;
+    task->state = STARTING;
+    task->wake_at = 0;
+    task->timed = false;
+    stats_task_start(task, stats_clock());
+    mpsc_push(&sched->incoming, &task->elem);
+    scheduler_notify(sched);
+}
+
+void scheduler_start_after(struct scheduler *sched,
+                           struct task *task,
+                           uint64_t delay_ns) {
+    task->sched = sched;
     task->state = STARTING;
-    list_push_back(&sched->tasks, &task->elem);
-    pthread_mutex_unlock(&sched->tasks_lock);
+    task->wake_at = clock_ticks() + ns_to_ticks(delay_ns);
+    task->timed = true; /* Tells scheduler_collect_starts to use the wheel */
+    stats_task_start(task, stats_clock() + delay_ns);
+    mpsc_push(&sched->incoming, &task->elem);
+    scheduler_notify(sched);
+}
+
+void scheduler_start_batch(struct scheduler *sched,
+                           struct task **tasks,
+                           size_t n) {
+    uint64_t now = stats_clock();
+
+    if (n == 0)
+        return;
+
+    for (size_t i = 0; i < n; i++) {
+        tasks[i]->sched = sched;
+        tasks[i]->state = STARTING;
+        tasks[i]->wake_at = 0;
+        tasks[i]->timed = false;
+        stats_task_start(tasks[i], now);
+        if (i + 1 < n)
+            tasks[i]->elem.next = &tasks[i + 1]->elem;
+    }
+    mpsc_push_chain(&sched->incoming, &tasks[0]->elem, &tasks[n - 1]->elem);
+    scheduler_notify(sched);
+}
+
+void task_unpark(struct task *task) {
+    struct scheduler *sched = task->sched;
+
+    assert(sched != NULL);
+    __atomic_store_n(&task->unparked, true, __ATOMIC_RELEASE);
+    if (!__atomic_exchange_n(&task->wake_pending, true, __ATOMIC_ACQ_REL)) {
+        mpsc_push(&sched->woken, &task->wake_elem);
+        scheduler_notify(sched);
+    }
+}
+
+task_id_t scheduler_add(struct scheduler *sched,
+                        task_fn_t init,
+                        task_fn_t run,
+                        task_fn_t destroy,
+                        task_fn_t interrupt,
+                        task_cond_t is_done,
+                        void *data) {
+    return task_table_add(&sched->table, init, run, destroy, interrupt,
+                          is_done, data);
+}
+
+task_id_t scheduler_add_waiting(struct scheduler *sched,
+                                task_fn_t init,
+                                task_fn_t run,
+                                task_fn_t destroy,
+                                task_fn_t interrupt,
+                                task_cond_t is_done,
+                                void *data) {
+    return task_table_add_waiting(&sched->table, init, run, destroy,
+                                  interrupt, is_done, data);
+}
+
+bool scheduler_ready(struct scheduler *sched, task_id_t id) {
+    if (!task_table_ready(&sched->table, id))
+        return false;
+    scheduler_notify(sched);
+    return true;
+}
+
+bool scheduler_stop_id(struct scheduler *sched, task_id_t id) {
+    if (!task_table_stop(&sched->table, id))
+        return false;
+    scheduler_notify(sched);
+    return true;
+}
+
+/* Counts a stop in flight on TASK and tries to interrupt it. The count goes
+   up before the transition, so that once the task is INTERRUPTED it can't be
+   removed, and freed, before its stop_elem has been pushed and popped again.
+   Returns false, with the count undone, if TASK was not RUNNING. */
+static bool task_stop_begin(struct task *task) {
+    __atomic_fetch_add(&task->stop_pending, 1, __ATOMIC_SEQ_CST);
+    if (task_transition(task, RUNNING, INTERRUPTED))
+        return true;
+    __atomic_fetch_sub(&task->stop_pending, 1, __ATOMIC_RELEASE);
+    return false;
 }
 
 void scheduler_stop(struct scheduler *sched, struct task *task) {
-    pthread_mutex_lock(&sched->state_lock);
-    if (task->state != STARTING)
-        task->state = INTERRUPTED;
-    pthread_mutex_unlock(&sched->state_lock);
+    if (task_stop_begin(task)) {
+        mpsc_push(&sched->stopped, &task->stop_elem);
+        scheduler_notify(sched);
+    }
+}
+
+void scheduler_stop_batch(struct scheduler *sched,
+                          struct task **tasks,
+                          size_t n) {
+    struct list_elem *first = NULL, *last = NULL;
+
+    for (size_t i = 0; i < n; i++) {
+        struct task *task = tasks[i];
+        if (!task_stop_begin(task))
+            continue;
+        if (last)
+            last->next = &task->stop_elem;
+        else
+            first = &task->stop_elem;
+        last = &task->stop_elem;
+    }
+    if (first) {
+        mpsc_push_chain(&sched->stopped, first, last);
+        scheduler_notify(sched);
+    }
 }
@@ -5,6 +5,8 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * The scheduler system.
@@ -33,21 +35,516 @@ struct task *task_new(task_fn_t init,
                       task_cond_t is_done,
                       void *data);
 
+/**
+ * Like task_new, but the task comes from a per-scheduler pool of cache line
+ * aligned slots, and the scheduler frees it itself once the task has left
+ * (after destroy). This is meant for fire-and-forget tasks: once started on
+ * sched, the caller must not task_free it or touch it after it stops. A task
+ * that is never started can be freed with task_free. Safe to call from any
+ * thread, and every task_new_in task must be started on, or freed before,
+ * scheduler_free of its scheduler.
+ */
+struct task *task_new_in(struct scheduler *sched,
+                         task_fn_t init,
+                         task_fn_t run,
+                         task_fn_t destroy,
+                         task_fn_t interrupt,
+                         task_cond_t is_done,
+                         void *data);
+
+/**
+ * Events for task_new_fd.
+ */
+#define TASK_FD_READ 0x1
+#define TASK_FD_WRITE 0x2
+
+/**
+ * Like task_new, but for a task driven by a file descriptor. The task is
+ * initialized on its first tick and then parked in the scheduler's epoll set.
+ * run is only called once fd is ready for any of events (TASK_FD_READ and/or
+ * TASK_FD_WRITE), once per readiness; in between the task costs nothing per
+ * tick. Readiness is level triggered, so run should consume what is available
+ * or the task is simply run again on the next tick. The task does not own fd,
+ * which must stay open until the task has been destroyed.
+ */
+struct task *task_new_fd(int fd,
+                         unsigned events,
+                         task_fn_t init,
+                         task_fn_t run,
+                         task_fn_t destroy,
+                         task_fn_t interrupt,
+                         task_cond_t is_done,
+                         void *data);
+
+/**
+ * Generate a coroutine task. body runs on a stack of its own (taken from a
+ * per-scheduler pool of guard-paged stacks when the task is initialized) and
+ * can call task_yield at any depth to end the task's turn for this tick; it
+ * resumes where it left off on the next tick. The task is done when body
+ * returns. init and destroy are optional as for task_new. A stopped coroutine
+ * gets its interrupt fn, if any, and is never resumed again: its stack is
+ * dropped without unwinding, so anything body holds must be cleaned up by
+ * interrupt or destroy.
+ */
+struct task *task_new_coro(task_fn_t init,
+                           task_fn_t body,
+                           task_fn_t destroy,
+                           task_fn_t interrupt,
+                           void *data);
+
+/**
+ * End the current coroutine task's turn. Must only be called from the body of
+ * a task_new_coro task.
+ */
+void task_yield(void);
+
+/**
+ * From a task's own fns, take it out of the per-tick walk until wake_ns, an
+ * absolute CLOCK_MONOTONIC time in ns. The task waits in the timer wheel once
+ * the current run (or coroutine turn) returns, and is run again on the first
+ * tick after that time (rounded up to SCHEDULER_TIMER_RESOLUTION_NS). A time
+ * that has already passed just leaves it in its run list. A stop wakes it
+ * early for its interrupt.
+ */
+void task_sleep_until(struct task *task, uint64_t wake_ns);
+
+/**
+ * From a task's own fns, take it out of the per-tick walk until task_unpark
+ * is called on it. The task is parked once the current run (or coroutine
+ * turn) returns, unless task_unpark came first, which cancels the park: a
+ * task_unpark is never lost, though a task can occasionally be woken with
+ * nothing to do and should then park again. A stop wakes it for its
+ * interrupt.
+ */
+void task_park(struct task *task);
+
+/**
+ * Put a parked task back in its run list for the next tick. Lock free and
+ * safe to call from any thread once the task has been started.
+ */
+void task_unpark(struct task *task);
+
+/**
+ * Make task wait for parent: task is not initialized or run until parent has
+ * stopped, whether it finished or was stopped. A task may have any number of
+ * parents and a parent any number of dependents, for chains and fan-in joins,
+ * but they must not form a cycle. A task whose last parent stops runs later
+ * in the same tick, so a chain of n stages can finish in one tick rather than
+ * n; it waits for the next tick only if it has a higher priority than the
+ * parent, or under scheduler_run_parallel. A parent that queued I/O in its
+ * last run only counts as stopped once the request has completed, and its
+ * dependents then run from the tick that collects it. Both tasks must be for
+ * the same scheduler and neither may have been started yet. Returns false,
+ * after printing why, if the edge can't be stored.
+ */
+bool task_depends_on(struct task *task, struct task *parent);
+
+/**
+ * What a task_new_step task's step fn asks for next.
+ *
+ * TASK_CONTINUE: run it again next tick.
+ * TASK_DONE: the task is finished; it is removed (after destroy) next tick.
+ * TASK_SLEEP_UNTIL: not before *wake_ns, an absolute CLOCK_MONOTONIC time in
+ * ns that step has stored. The task waits in the timer wheel, so it costs
+ * nothing per tick, and wakes on the first tick after that time (rounded up
+ * to SCHEDULER_TIMER_RESOLUTION_NS).
+ * TASK_WAIT: not until the I/O request step has queued with task_read or
+ * friends completes or, with no request queued, as by task_park.
+ *
+ * TASK_CONTINUE leaves a task_sleep_until or task_park from step in place.
+ */
+enum task_status {
+    TASK_CONTINUE,
+    TASK_DONE,
+    TASK_SLEEP_UNTIL,
+    TASK_WAIT,
+};
+
+typedef enum task_status (*task_step_fn_t)(void *data, uint64_t *wake_ns);
+
+/**
+ * Generate a task whose step fn both does the work and says what comes next,
+ * so each tick costs one call rather than run and then is_done. init, destroy
+ * and interrupt are optional. A stopped task gets its interrupt fn, if any,
+ * and step is not called again.
+ */
+struct task *task_new_step(task_fn_t init,
+                           task_step_fn_t step,
+                           task_fn_t destroy,
+                           task_fn_t interrupt,
+                           void *data);
+
 void task_free(struct task *task);
 
+/**
+ * Asynchronous file I/O from inside a task's run (or init) fn. Each call
+ * queues one request for the task; once run returns, the request is handed to
+ * the scheduler's io_uring instance (or, where io_uring is unavailable, to a
+ * small thread pool) and the task is taken off the run list. Requests are
+ * submitted in one batch at the end of the tick, and completions are reaped in
+ * one batch at the start of each tick, after which the task's run fn is called
+ * again and can pick up the outcome with task_io_result. At most one request
+ * per run; buf must stay valid until it completes. Pass UINT64_MAX as offset
+ * to use the fd's own position instead (for pipes and sockets). A one-shot
+ * task, or one whose is_done is already true, is removed when the request
+ * completes instead of being run again. A task_new_coro body calls task_yield
+ * after queueing a request and is resumed once it completes.
+ *
+ * A task stopped while its request is in flight gets its interrupt once the
+ * request completes, and scheduler_free waits for every request in flight.
+ *
+ * The io_uring instance, or the thread pool, is only set up by the first
+ * request, so schedulers that do no I/O don't pay for it. If neither can be
+ * set up, the request fails with -ENOMEM and the task stays in its run list.
+ */
+void task_read(struct task *task,
+               int fd,
+               void *buf,
+               size_t len,
+               uint64_t offset);
+
+void task_write(struct task *task,
+                int fd,
+                const void *buf,
+                size_t len,
+                uint64_t offset);
+
+void task_fsync(struct task *task, int fd);
+
+/**
+ * The outcome of the task's last completed request: bytes transferred, 0 for
+ * task_fsync, or a negative errno.
+ */
+int64_t task_io_result(struct task *task);
+
+/**
+ * Make the task periodic. Instead of every tick, run is called at most once
+ * per period_ns, and the task is not visited at all by the ticks in between.
+ * Periods are rounded up to SCHEDULER_TIMER_RESOLUTION_NS (1ms by default).
+ * Pass 0 to go back to running every tick. Must not be called while the task
+ * is in a scheduler.
+ */
+void task_set_period(struct task *task, uint64_t period_ns);
+
+/**
+ * Task priorities. Each tick runs every task of a higher priority before any
+ * task of a lower one, and tasks of the same priority in the order they were
+ * started. New tasks get TASK_PRIORITY_DEFAULT, leaving room for both more and
+ * less urgent work.
+ */
+#define TASK_PRIORITY_MIN 0
+#define TASK_PRIORITY_DEFAULT 16
+#define TASK_PRIORITY_MAX 31
+
+/**
+ * Set the task's priority, from TASK_PRIORITY_MIN to TASK_PRIORITY_MAX. Must
+ * not be called while the task is in a scheduler. scheduler_run_parallel hands
+ * out higher priority tasks first, but runs them alongside lower priority ones.
+ */
+void task_set_priority(struct task *task, unsigned priority);
+
+/**
+ * No deadline: the task is run after every task that has one.
+ */
+#define TASK_NO_DEADLINE UINT64_MAX
+
+/**
+ * Give the task's next run a deadline, as an absolute CLOCK_MONOTONIC time in
+ * ns. A deadline covers a single run (or coroutine turn): it is cleared when
+ * the run starts, so a task that wants one every time sets the next one from
+ * its run fn. Whether the run finished by its deadline is counted in
+ * scheduler_deadline_stats under either policy, but only a SCHEDULER_EDF
+ * scheduler orders tasks by it. Must only be called before the task is started
+ * or from the task's own fns.
+ */
+void task_set_deadline(struct task *task, uint64_t deadline_ns);
+
 // scheduler_new and scheduler_run and scheduler_free should be called from the
 // same thread.
 
 struct scheduler *scheduler_new(void);
 
+/**
+ * How a scheduler orders the tasks of a tick. SCHEDULER_FIFO runs them by
+ * priority, then in the order they were started. SCHEDULER_EDF runs them
+ * earliest deadline first (see task_set_deadline), ties and tasks without a
+ * deadline in the order they became runnable, and ignores priorities.
+ * Deadlines set during a tick reorder the tasks from the next tick on.
+ */
+enum scheduler_policy {
+    SCHEDULER_FIFO,
+    SCHEDULER_EDF,
+};
+
+/**
+ * Like scheduler_new, but with the given policy. scheduler_new is the same as
+ * scheduler_new_policy(SCHEDULER_FIFO).
+ */
+struct scheduler *scheduler_new_policy(enum scheduler_policy policy);
+
 void scheduler_free(struct scheduler *);
 
 void scheduler_run(struct scheduler *);
 
+/**
+ * Like scheduler_run, but stop handing out tasks once budget_ns has passed
+ * since the call. The budget is checked after each task, so at least one task
+ * runs and a slow run fn can still overshoot it. The tasks a tick did not get
+ * to go first in the next one, so that a series of short ticks visits every
+ * task in turn; within that, higher priority tasks (or earlier deadlines)
+ * still come first, and can starve the rest if they alone fill the budget.
+ * Returns true if every task got its turn.
+ */
+bool scheduler_run_for(struct scheduler *, uint64_t budget_ns);
+
+/**
+ * Run ticks until scheduler_break is called. Whenever a tick leaves no task in
+ * the run list, the calling thread sleeps instead of spinning, until a task is
+ * started or stopped, a timer is due, an fd task is ready, or scheduler_wakeup
+ * is called.
+ */
+void scheduler_loop(struct scheduler *);
+
+/**
+ * Make scheduler_loop run another tick even if it has nothing to do. Safe to
+ * call from any thread.
+ */
+void scheduler_wakeup(struct scheduler *);
+
+/**
+ * Make scheduler_loop return after the current tick. Safe to call from any
+ * thread, including from inside a task.
+ */
+void scheduler_break(struct scheduler *);
+
+/**
+ * Statistics of the pool behind task_new_in. Only exact while no other thread
+ * is allocating from it.
+ */
+struct scheduler_pool_stats {
+    size_t slabs;  // slabs allocated so far
+    size_t free;   // length of the free list
+    size_t in_use; // tasks handed out and not yet returned
+};
+
+void scheduler_pool_stats(struct scheduler *, struct scheduler_pool_stats *);
+
+/**
+ * Runs that had a deadline, by whether they returned by it. Kept from
+ * scheduler_new on, under either policy.
+ */
+struct scheduler_deadline_stats {
+    uint64_t met;    // returned at or before the deadline
+    uint64_t missed; // returned after it
+};
+
+void scheduler_deadline_stats(struct scheduler *,
+                              struct scheduler_deadline_stats *);
+
+/**
+ * Where a scheduler's ticks go, counted from scheduler_new on. Kept only when
+ * scheduler.c is built with SCHEDULER_STATS=1, as the clock is read around
+ * every run; otherwise scheduler_get_stats zeroes them and returns false.
+ * Table tasks (scheduler_add) count towards tick times but not tasks_run.
+ */
+struct scheduler_stats {
+    uint64_t ticks;              // scheduler_run, _run_for and _run_parallel
+    uint64_t tasks_run;          // task runs over all ticks
+    uint64_t max_tasks_per_tick; // most task runs in one tick
+    uint64_t tick_ns;            // total time in ticks
+    uint64_t max_tick_ns;        // longest tick
+    uint64_t lock_wait_ns;       // scheduler_run_parallel blocked on workers
+};
+
+bool scheduler_get_stats(struct scheduler *, struct scheduler_stats *);
+
+/**
+ * Latency histograms a scheduler keeps under SCHEDULER_STATS=1, from
+ * scheduler_new on.
+ *
+ * SCHEDULER_HIST_TICK: the duration of each tick, as in scheduler_stats.
+ * SCHEDULER_HIST_RUN: the duration of each task run, as in task_stats.
+ * SCHEDULER_HIST_START: for each task, the time from when it was due to start
+ * (scheduler_start, or the end of the delay of scheduler_start_after) to the
+ * start of its first run.
+ */
+enum scheduler_hist {
+    SCHEDULER_HIST_TICK,
+    SCHEDULER_HIST_RUN,
+    SCHEDULER_HIST_START,
+};
+
+struct hist;
+
+/**
+ * Copy one of the scheduler's histograms, in ns, into snapshot, for
+ * hist_quantile and friends from hist.h, and clear it if reset is true.
+ * Recording is a lock free add to one bucket, on top of the clock reads the
+ * stats already take, and no value is lost to a reset. Safe to call from any
+ * thread. Without SCHEDULER_STATS=1, clears snapshot and returns false.
+ */
+bool scheduler_get_hist(struct scheduler *,
+                        enum scheduler_hist which,
+                        struct hist *snapshot,
+                        bool reset);
+
+/**
+ * Where a task's time goes, under SCHEDULER_STATS=1 as for
+ * scheduler_get_stats. A run is a call of run, step or a coroutine turn, and
+ * does not include init, is_done or interrupt. Only exact from the thread
+ * that runs the task's scheduler, or once it is out of one.
+ */
+struct task_stats {
+    uint64_t runs;          // runs so far
+    uint64_t run_ns;        // total time in them
+    uint64_t max_run_ns;    // longest of them
+    uint64_t start_wait_ns; // from when it was due to start to its init
+};
+
+bool task_get_stats(struct task *, struct task_stats *);
+
+/**
+ * Turn the reaper on or off. While it is on, tasks that leave the scheduler
+ * are handed to a background thread, which calls their destroy fns, and frees
+ * task_new_in tasks, in batches of one tick's worth, so a slow destroy no
+ * longer holds up the tick. Each destroy is still called exactly once, but
+ * may come after scheduler_run returns, so a task_new task may only be freed
+ * once its destroy has been called, or after scheduler_free. Task table tasks
+ * are destroyed inline either way. Turning it off waits for the reaper to
+ * finish what it was given. Call from the thread that runs the scheduler,
+ * between ticks. Returns false, after printing why, if the thread can't be
+ * started.
+ */
+bool scheduler_reaper(struct scheduler *, bool enable);
+
+/**
+ * Start or stop recording trace events: each tick, each init, run, interrupt
+ * and destroy call with its task and fn, each task state change, and the
+ * waits on the worker pool's lock in scheduler_run_parallel. Events go to a
+ * ring buffer per thread, which keeps the last TRACE_EVENTS (16384 by
+ * default) of that thread, so recording takes no lock; while tracing is off,
+ * each event site costs a single load. Safe to call from any thread.
+ */
+void scheduler_trace(struct scheduler *, bool enable);
+
+/**
+ * Write the recorded events to path as Chrome trace JSON, for
+ * chrome://tracing or ui.perfetto.dev. Tasks and fns appear as addresses, to
+ * be matched against the program's symbols. Can be called from any thread,
+ * even while the scheduler runs and records, say from a task that found the
+ * last tick too slow. Returns false, after printing why, if path can't be
+ * written.
+ */
+bool scheduler_trace_dump(struct scheduler *, const char *path);
+
+/**
+ * Run one tick of the scheduler, spreading the tasks over nthreads workers
+ * (the calling thread is one of them). Each worker starts with its own share
+ * of the tick and steals from the others once it runs out. Task lifecycle is
+ * the same as scheduler_run, but tasks started during the tick wait for the
+ * next one. The worker threads are kept between calls and joined by
+ * scheduler_free. nthreads <= 1 is the same as scheduler_run.
+ */
+void scheduler_run_parallel(struct scheduler *, unsigned nthreads);
+
+/**
+ * Add a task to the scheduler. Lock free and safe to call from any thread.
+ * The task is picked up at the start of the next scheduler_run.
+ */
 void scheduler_start(struct scheduler *, struct task *);
 
+/**
+ * Start n tasks at once, in array order. The tasks are linked into one chain
+ * and handed to the scheduler in a single step, rather than one per task.
+ */
+void scheduler_start_batch(struct scheduler *, struct task **tasks, size_t n);
+
+/**
+ * Like scheduler_start, but the task is not initialized or run until delay_ns
+ * has passed. The task is kept in a timing wheel until then, so it costs
+ * nothing per tick.
+ */
+void scheduler_start_after(struct scheduler *,
+                           struct task *,
+                           uint64_t delay_ns);
+
+/**
+ * Identifies a task added with scheduler_add: a slot in the task table and a
+ * generation, which moves on when the task is removed. Stale ids are refused
+ * rather than reaching whatever task took the slot next, until the slot has
+ * been reused 256 times.
+ */
+typedef uint32_t task_id_t;
+#define TASK_ID_NONE UINT32_MAX
+
+/**
+ * Add a plain task to the scheduler's dense task table instead of as a
+ * struct task. The fns are as for task_new, and the task goes through the
+ * same lifecycle, but its fields are kept in contiguous per-field arrays, so
+ * that running many small tasks is a linear scan rather than a walk over
+ * separately allocated objects, at about 64 bytes a task. Table tasks have no
+ * priority, deadline, period, fd or I/O, and run after every linked task of a
+ * tick, all on the calling thread under scheduler_run_parallel, and whole or
+ * not at all under scheduler_run_for. The table grows as needed, up to 16M
+ * tasks; returns TASK_ID_NONE if it cannot. Not thread safe: call from the
+ * thread that runs the scheduler, which includes from inside its tasks.
+ */
+task_id_t scheduler_add(struct scheduler *,
+                        task_fn_t init,
+                        task_fn_t run,
+                        task_fn_t destroy,
+                        task_fn_t interrupt,
+                        task_cond_t is_done,
+                        void *data);
+
+/**
+ * Add a waiting task to the task table. It is like one from scheduler_add,
+ * but after its first run it only runs on the tick after a scheduler_ready for
+ * it, once however many calls came in between, or to get its interrupt after
+ * a stop. A tick finds the ready tasks by scanning a bitmap with a bit per
+ * table slot, many bits per compare, and skips the scan when none has been
+ * set, so waiting tasks that are not ready cost next to nothing per tick.
+ * Not thread safe, as scheduler_add.
+ */
+task_id_t scheduler_add_waiting(struct scheduler *,
+                                task_fn_t init,
+                                task_fn_t run,
+                                task_fn_t destroy,
+                                task_fn_t interrupt,
+                                task_cond_t is_done,
+                                void *data);
+
+/**
+ * Make a task from scheduler_add_waiting run on the next tick. Returns false if
+ * id is stale. Readying a task from scheduler_add does nothing, as it runs on
+ * every tick anyway. Lock free and safe to call from any thread, up until
+ * scheduler_free; wakes scheduler_loop if it is idle.
+ */
+bool scheduler_ready(struct scheduler *, task_id_t id);
+
+/**
+ * Ask a task from scheduler_add to stop, as scheduler_stop does. Returns false
+ * if id is stale, that is the task has already been removed, and true
+ * otherwise, though a task that has not been initialized by the next tick is
+ * left alone. Lock free and safe to call from any thread, up until
+ * scheduler_free.
+ */
+bool scheduler_stop_id(struct scheduler *, task_id_t id);
+
+/**
+ * Ask a running task to stop. Its interrupt fn is called on the next tick and
+ * it is removed on the one after. Lock free and safe to call from any thread,
+ * including while scheduler_run is in progress. Tasks that have not been
+ * initialized yet, or are already stopping, are left alone.
+ */
 void scheduler_stop(struct scheduler *, struct task *);
 
+/**
+ * Stop n tasks at once, as if by scheduler_stop on each, but with a single
+ * hand-over to the scheduler for all of them.
+ */
+void scheduler_stop_batch(struct scheduler *, struct task **tasks, size_t n);
+
 #ifdef __cplusplus
 }
 #endif
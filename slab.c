@@ -0,0 +1,164 @@
+#include "slab.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Each slab is SLAB_BYTES aligned and starts with one cache line
+   holding its slab number, so the index of any object can be
+   found from its address alone:
+
+        +--------+-------+-------+-----+-------+
+        | header | obj 0 | obj 1 | ... | obj n |
+        +--------+-------+-------+-----+-------+
+
+   While an object is free its first four bytes hold the index,
+   plus one, of the next free object. */
+
+struct slab_header {
+    size_t number;
+};
+
+static inline uint64_t pack(uint32_t tag, uint32_t link) {
+    return ((uint64_t)tag << 32) | link;
+}
+
+/* Returns the object at INDEX in POOL. */
+static inline void *slot(struct slab_pool *pool, uint32_t index) {
+    uint8_t *slab = (uint8_t *)pool->slabs[index / pool->per_slab];
+    return slab + SLAB_CACHE_LINE + (index % pool->per_slab) * pool->obj_size;
+}
+
+/* Returns the index of OBJ in POOL. */
+static inline uint32_t index_of(struct slab_pool *pool, void *obj) {
+    uintptr_t base = (uintptr_t)obj & ~(uintptr_t)(SLAB_BYTES - 1);
+    struct slab_header *header = (struct slab_header *)base;
+    size_t offset = (uintptr_t)obj - base - SLAB_CACHE_LINE;
+
+    assert(offset % pool->obj_size == 0);
+    return header->number * pool->per_slab + offset / pool->obj_size;
+}
+
+static inline uint32_t *link_of(void *obj) {
+    return (uint32_t *)obj;
+}
+
+/* Pushes the chain FIRST...LAST, already linked through their
+   free links, onto POOL's free stack. */
+static void push_chain(struct slab_pool *pool, uint32_t first,
+                       uint32_t last, size_t cnt) {
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    uint64_t new_head;
+
+    do {
+        __atomic_store_n(link_of(slot(pool, last)), (uint32_t)head,
+                         __ATOMIC_RELAXED);
+        new_head = pack((uint32_t)(head >> 32) + 1, first + 1);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, new_head, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&pool->nfree, cnt, __ATOMIC_RELAXED);
+}
+
+/* Adds one slab to POOL, unless another thread already refilled
+   the free stack.  Returns false if POOL is full or out of
+   memory. */
+static bool grow(struct slab_pool *pool) {
+    bool ok = true;
+
+    pthread_mutex_lock(&pool->grow_lock);
+    if ((uint32_t)__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE) == 0) {
+        size_t n = pool->nslabs;
+        void *slab = NULL;
+
+        if (n == SLAB_MAX || posix_memalign(&slab, SLAB_BYTES, SLAB_BYTES)) {
+            ok = false;
+        }
+        else {
+            ((struct slab_header *)slab)->number = n;
+            pool->slabs[n] = slab;
+            __atomic_store_n(&pool->nslabs, n + 1, __ATOMIC_RELEASE);
+
+            uint32_t first = n * pool->per_slab;
+            uint32_t last = first + pool->per_slab - 1;
+            for (uint32_t i = first; i < last; i++)
+                *link_of(slot(pool, i)) = i + 2;
+            push_chain(pool, first, last, pool->per_slab);
+        }
+    }
+    pthread_mutex_unlock(&pool->grow_lock);
+    return ok;
+}
+
+/* Initializes POOL for objects of OBJ_SIZE bytes.  No memory is
+   allocated until the first slab_alloc(). */
+void slab_init(struct slab_pool *pool, size_t obj_size) {
+    assert(pool != NULL);
+    assert(obj_size > 0);
+
+    pool->head = 0;
+    pool->obj_size = (obj_size + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1);
+    assert(pool->obj_size <= SLAB_BYTES - SLAB_CACHE_LINE);
+    pool->per_slab = (SLAB_BYTES - SLAB_CACHE_LINE) / pool->obj_size;
+    pool->nslabs = 0;
+    pool->nfree = 0;
+    pthread_mutex_init(&pool->grow_lock, NULL);
+}
+
+/* Releases every slab in POOL.  Any object still allocated from
+   POOL is freed along with it. */
+void slab_destroy(struct slab_pool *pool) {
+    for (size_t i = 0; i < pool->nslabs; i++)
+        free(pool->slabs[i]);
+    pool->nslabs = 0;
+    pool->nfree = 0;
+    pool->head = 0;
+    pthread_mutex_destroy(&pool->grow_lock);
+}
+
+/* Returns a cache line aligned object from POOL, or NULL if the
+   pool has reached SLAB_MAX slabs or memory is exhausted. */
+void *slab_alloc(struct slab_pool *pool) {
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t top = (uint32_t)head;
+        if (top == 0) {
+            if (!grow(pool))
+                return NULL;
+            head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        /* The link may be stale if another thread pops TOP first,
+           but then the tag has moved on and the exchange fails. */
+        void *obj = slot(pool, top - 1);
+        uint32_t next = __atomic_load_n(link_of(obj), __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&pool->head, &head,
+                                        pack((uint32_t)(head >> 32) + 1, next),
+                                        true, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_sub(&pool->nfree, 1, __ATOMIC_RELAXED);
+            return obj;
+        }
+    }
+}
+
+/* Returns OBJ, which must have come from POOL, to the pool. */
+void slab_free(struct slab_pool *pool, void *obj) {
+    uint32_t index;
+
+    if (obj == NULL)
+        return;
+    index = index_of(pool, obj);
+    push_chain(pool, index, index, 1);
+}
+
+/* Fills STATS with a snapshot of POOL.  The numbers are only
+   consistent with each other if no other thread is using the
+   pool. */
+void slab_stats(struct slab_pool *pool, struct slab_stats *stats) {
+    stats->slabs = __atomic_load_n(&pool->nslabs, __ATOMIC_ACQUIRE);
+    stats->free = __atomic_load_n(&pool->nfree, __ATOMIC_RELAXED);
+    if (stats->free > stats->slabs * pool->per_slab)
+        stats->free = stats->slabs * pool->per_slab;
+    stats->in_use = stats->slabs * pool->per_slab - stats->free;
+}
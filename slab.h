@@ -0,0 +1,52 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+/* Fixed size object pool.
+
+   Objects are carved out of SLAB_BYTES sized slabs and rounded
+   up to a whole number of cache lines, so no two objects share a
+   line.  Slabs are only returned to the system by slab_destroy(),
+   which means a pointer into the pool always points at mapped
+   memory even after it has been freed.
+
+   Free objects are kept on a single lock-free stack.  Objects are
+   named by a 32-bit index rather than a pointer, which leaves
+   room for a 32-bit tag in the same word to defeat ABA.
+   slab_alloc() and slab_free() may be called from any thread;
+   only growing the pool by a slab takes a lock. */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_CACHE_LINE 64
+#define SLAB_BYTES (128 * 1024)
+#define SLAB_MAX 1024
+
+/* Object pool. */
+struct slab_pool {
+    uint64_t head;      /* Free stack, tag << 32 | (index + 1). */
+    size_t obj_size;    /* Rounded up to SLAB_CACHE_LINE. */
+    size_t per_slab;    /* Objects per slab. */
+    size_t nslabs;      /* Slabs allocated so far. */
+    size_t nfree;       /* Objects on the free stack. */
+    pthread_mutex_t grow_lock;
+    void *slabs[SLAB_MAX];
+};
+
+/* Pool statistics. */
+struct slab_stats {
+    size_t slabs;  /* Slabs allocated. */
+    size_t free;   /* Length of the free list. */
+    size_t in_use; /* Objects handed out and not yet freed. */
+};
+
+void slab_init(struct slab_pool *, size_t obj_size);
+void slab_destroy(struct slab_pool *);
+
+void *slab_alloc(struct slab_pool *);
+void slab_free(struct slab_pool *, void *);
+
+void slab_stats(struct slab_pool *, struct slab_stats *);
+
+#endif /* slab.h */
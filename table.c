@@ -0,0 +1,507 @@
+#include "table.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG_LIVE 0x1 /* The slot belongs to a task. */
+#define TAG_STOP 0x2 /* The slot is in the stop stack. */
+#define CHUNK_SLOTS (1u << TABLE_CHUNK_BITS)
+#define SLOT_MASK ((1u << TABLE_SLOT_BITS) - 1)
+
+/* Task states, as for linked tasks. */
+enum {
+    STARTING,
+    RUNNING,
+    INTERRUPTED,
+    STOPPED,
+};
+
+/* Initializes TABLE as an empty table. */
+void task_table_init(struct task_table *table) {
+    table->run = NULL;
+    table->is_done = NULL;
+    table->data = NULL;
+    table->state = NULL;
+    table->cold = NULL;
+    table->id = NULL;
+    table->size = 0;
+    table->npolled = 0;
+    table->cap = 0;
+    table->chunks = NULL;
+    table->nslots = 0;
+    table->free_head = TASK_ID_NONE;
+    table->free_tail = TASK_ID_NONE;
+    table->stops = TASK_ID_NONE;
+    table->any_ready = false;
+}
+
+/* Frees TABLE's memory.  The tasks left in it are dropped without
+   calling any of their fns; see task_table_clear(). */
+void task_table_destroy(struct task_table *table) {
+    free(table->run);
+    free(table->is_done);
+    free(table->data);
+    free(table->state);
+    free(table->cold);
+    free(table->id);
+    if (table->chunks) {
+        for (uint32_t c = 0; c < TABLE_CHUNKS; c++)
+            free(table->chunks[c]);
+        free(table->chunks);
+    }
+    task_table_init(table);
+}
+
+/* Returns slot number S of TABLE. */
+static inline struct task_table_slot *slot_at(struct task_table *table,
+                                              uint32_t s) {
+    return &table->chunks[s >> TABLE_CHUNK_BITS]->slots[s & (CHUNK_SLOTS - 1)];
+}
+
+/* Sets the ready bit of slot S, for the next task_table_run().
+   any_ready is stored sequentially consistent so that a thread
+   checking whether the scheduler is asleep afterwards, and the
+   scheduler checking task_table_busy() after announcing it is
+   going to sleep, cannot both miss each other. */
+static void mark_ready(struct task_table *table, uint32_t s) {
+    bitmap_set(table->chunks[s >> TABLE_CHUNK_BITS]->ready,
+               s & (CHUNK_SLOTS - 1));
+    __atomic_store_n(&table->any_ready, true, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the generation in slot tag TAG. */
+static inline uint32_t tag_generation(uint32_t tag) {
+    return (tag >> 2) & (TABLE_GENERATIONS - 1);
+}
+
+/* Resizes *ARRAY to CAP elements of SIZE bytes.  Returns false,
+   leaving *ARRAY alone, if out of memory. */
+static bool resize(void **array, size_t cap, size_t size) {
+    void *p = realloc(*array, cap * size);
+    if (!p)
+        return false;
+    *array = p;
+    return true;
+}
+
+/* Makes room for one more task.  The arrays are grown one by one,
+   and the capacity only raised once all of them have grown. */
+static bool reserve(struct task_table *table) {
+    if (table->size == table->cap) {
+        uint32_t cap = table->cap ? table->cap * 2 : 64;
+        if (!resize((void **)&table->run, cap, sizeof(*table->run)) ||
+            !resize((void **)&table->is_done, cap,
+                    sizeof(*table->is_done)) ||
+            !resize((void **)&table->data, cap, sizeof(*table->data)) ||
+            !resize((void **)&table->state, cap, sizeof(*table->state)) ||
+            !resize((void **)&table->cold, cap, sizeof(*table->cold)) ||
+            !resize((void **)&table->id, cap, sizeof(*table->id))) {
+            perror("realloc(task_table)");
+            return false;
+        }
+        table->cap = cap;
+    }
+    if (table->free_head != TASK_ID_NONE)
+        return true;
+
+    /* A fresh slot, in a new chunk if need be. */
+    if (table->nslots == TABLE_SLOTS) {
+        fprintf(stderr, "task_table: out of slots\n");
+        return false;
+    }
+    if (!table->chunks) {
+        table->chunks = (struct task_table_chunk **)calloc(
+            TABLE_CHUNKS, sizeof(*table->chunks));
+        if (!table->chunks) {
+            perror("calloc(task_table chunks)");
+            return false;
+        }
+    }
+    if (table->nslots % CHUNK_SLOTS == 0) {
+        uint32_t c = table->nslots >> TABLE_CHUNK_BITS;
+        table->chunks[c] = (struct task_table_chunk *)calloc(
+            1, sizeof(struct task_table_chunk));
+        if (!table->chunks[c]) {
+            perror("malloc(task_table chunk)");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Moves the task at index FROM in TABLE to index TO, over whatever
+   was there. */
+static void move(struct task_table *table, uint32_t from, uint32_t to) {
+    if (from == to)
+        return;
+    table->run[to] = table->run[from];
+    table->is_done[to] = table->is_done[from];
+    table->data[to] = table->data[from];
+    table->state[to] = table->state[from];
+    table->cold[to] = table->cold[from];
+    table->id[to] = table->id[from];
+    slot_at(table, table->id[to] & SLOT_MASK)->index = to;
+}
+
+/* Adds a polled task, or a waiting one if WAITING is true.  See
+   task_table_add(). */
+static task_id_t add(struct task_table *table,
+                     bool waiting,
+                     task_fn_t init,
+                     task_fn_t run,
+                     task_fn_t destroy,
+                     task_fn_t interrupt,
+                     task_cond_t is_done,
+                     void *data) {
+    struct task_table_slot *slot;
+    uint32_t s, i, tag;
+
+    assert(run != NULL);
+    if (is_done || interrupt) {
+        assert(is_done && interrupt);
+    }
+    if (!reserve(table))
+        return TASK_ID_NONE;
+
+    if (table->free_head != TASK_ID_NONE) {
+        s = table->free_head;
+        slot = slot_at(table, s);
+        table->free_head = slot->index;
+        if (table->free_head == TASK_ID_NONE)
+            table->free_tail = TASK_ID_NONE;
+    }
+    else {
+        /* The slot is set up before other threads can see it. */
+        s = table->nslots;
+        slot = slot_at(table, s);
+        slot->tag = 0;
+        __atomic_store_n(&table->nslots, s + 1, __ATOMIC_RELEASE);
+    }
+
+    /* A polled task takes the place of the first waiting one,
+       which moves to the end. */
+    i = table->size++;
+    if (!waiting) {
+        move(table, table->npolled, i);
+        i = table->npolled++;
+    }
+    table->run[i] = run;
+    table->is_done[i] = is_done;
+    table->data[i] = data;
+    table->state[i] = STARTING;
+    table->cold[i].init = init;
+    table->cold[i].destroy = destroy;
+    table->cold[i].interrupt = interrupt;
+    slot->index = i;
+
+    tag = slot->tag;
+    __atomic_store_n(&slot->tag, tag | TAG_LIVE, __ATOMIC_RELEASE);
+    table->id[i] = tag_generation(tag) << TABLE_SLOT_BITS | s;
+
+    /* A waiting task is initialized, and run once, straight away. */
+    if (waiting)
+        mark_ready(table, s);
+    return table->id[i];
+}
+
+/* Adds a polled task to TABLE, to be initialized and run from the
+   next task_table_run() on.  The fns are as for task_new().
+   Returns its id, or TASK_ID_NONE if out of memory. */
+task_id_t task_table_add(struct task_table *table,
+                         task_fn_t init,
+                         task_fn_t run,
+                         task_fn_t destroy,
+                         task_fn_t interrupt,
+                         task_cond_t is_done,
+                         void *data) {
+    return add(table, false, init, run, destroy, interrupt, is_done, data);
+}
+
+/* Adds a waiting task to TABLE.  Like task_table_add(), but after
+   its first run the task is only run again on the tick after a
+   task_table_ready() for it, once per call, or to get its
+   interrupt. */
+task_id_t task_table_add_waiting(struct task_table *table,
+                                 task_fn_t init,
+                                 task_fn_t run,
+                                 task_fn_t destroy,
+                                 task_fn_t interrupt,
+                                 task_cond_t is_done,
+                                 void *data) {
+    return add(table, true, init, run, destroy, interrupt, is_done, data);
+}
+
+/* Returns the slot of ID if it is a task in TABLE, or NULL.  Safe
+   to call from any thread. */
+static struct task_table_slot *live_slot(struct task_table *table,
+                                         task_id_t id) {
+    uint32_t s = id & SLOT_MASK;
+
+    if (id == TASK_ID_NONE ||
+        s >= __atomic_load_n(&table->nslots, __ATOMIC_ACQUIRE))
+        return NULL;
+    return slot_at(table, s);
+}
+
+/* Asks task ID in TABLE to stop, as scheduler_stop() does: the
+   stop takes effect at the start of the next task_table_run(), and
+   is dropped if the task has not been initialized by then.  Safe
+   to call from any thread.  Returns false if ID is not of a task
+   in TABLE, say because it has already been removed. */
+bool task_table_stop(struct task_table *table, task_id_t id) {
+    struct task_table_slot *slot = live_slot(table, id);
+    uint32_t want = (id >> TABLE_SLOT_BITS) << 2 | TAG_LIVE;
+    uint32_t tag, top;
+
+    if (!slot)
+        return false;
+    tag = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+    do {
+        if ((tag & ~TAG_STOP) != want)
+            return false;
+        if (tag & TAG_STOP)
+            return true;
+    } while (!__atomic_compare_exchange_n(&slot->tag, &tag, tag | TAG_STOP,
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+
+    /* The slot is ours to push until the table clears TAG_STOP.
+       The push is sequentially consistent for the same reason as
+       mark_ready()'s store. */
+    top = __atomic_load_n(&table->stops, __ATOMIC_RELAXED);
+    do {
+        slot->next = top;
+    } while (!__atomic_compare_exchange_n(&table->stops, &top,
+                                          id & SLOT_MASK, false,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+    return true;
+}
+
+/* Makes waiting task ID in TABLE run on the next tick.  Readying a
+   task that is already ready, or a polled task, does nothing.  Safe
+   to call from any thread.  Returns false if ID is not of a task
+   in TABLE.  That check can race with the task's removal, in which
+   case the next task in the slot may be run once for nothing. */
+bool task_table_ready(struct task_table *table, task_id_t id) {
+    struct task_table_slot *slot = live_slot(table, id);
+    uint32_t want = (id >> TABLE_SLOT_BITS) << 2 | TAG_LIVE;
+
+    if (!slot ||
+        (__atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE) & ~TAG_STOP) != want)
+        return false;
+    mark_ready(table, id & SLOT_MASK);
+    return true;
+}
+
+/* Takes every slot off TABLE's stop stack and interrupts its task
+   if it is running, or only clears the stops if APPLY is false. */
+static void drain_stops(struct task_table *table, bool apply) {
+    uint32_t s = __atomic_exchange_n(&table->stops, TASK_ID_NONE,
+                                     __ATOMIC_ACQUIRE);
+
+    while (s != TASK_ID_NONE) {
+        struct task_table_slot *slot = slot_at(table, s);
+        uint32_t next = slot->next;
+
+        /* A slot with TAG_STOP set is never freed, so its task is
+           still at slot->index. */
+        if (apply && table->state[slot->index] == RUNNING) {
+            table->state[slot->index] = INTERRUPTED;
+            if (slot->index >= table->npolled)
+                mark_ready(table, s);
+        }
+        __atomic_fetch_and(&slot->tag, ~TAG_STOP, __ATOMIC_RELEASE);
+        s = next;
+    }
+}
+
+/* Moves slot S, whose tag has already moved on, to the back of
+   TABLE's free list. */
+static void free_slot(struct task_table *table, uint32_t s) {
+    slot_at(table, s)->index = TASK_ID_NONE;
+    if (table->free_tail != TASK_ID_NONE)
+        slot_at(table, table->free_tail)->index = s;
+    else
+        table->free_head = s;
+    table->free_tail = s;
+}
+
+/* Returns the tag slot S gets once its task is gone: the next
+   generation, not live. */
+static inline uint32_t next_tag(uint32_t tag) {
+    return ((tag_generation(tag) + 1) & (TABLE_GENERATIONS - 1)) << 2;
+}
+
+/* Removes the task at index I from TABLE, filling its place with
+   a task from the end of its kind, and frees its slot.  Returns
+   false, leaving the task where it is, if a stop is still on its
+   way in. */
+static bool remove_at(struct task_table *table, uint32_t i) {
+    uint32_t s = table->id[i] & SLOT_MASK;
+    struct task_table_slot *slot = slot_at(table, s);
+    uint32_t tag = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+    uint32_t last;
+
+    /* Once the tag moves on, stops with the old id are refused. */
+    if ((tag & TAG_STOP) ||
+        !__atomic_compare_exchange_n(&slot->tag, &tag, next_tag(tag), false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return false;
+
+    if (table->cold[i].destroy)
+        table->cold[i].destroy(table->data[i]);
+
+    /* A polled task's place goes to the last polled task, whose
+       place goes to the last task. */
+    last = --table->size;
+    if (i < table->npolled) {
+        move(table, --table->npolled, i);
+        i = table->npolled;
+    }
+    move(table, last, i);
+    free_slot(table, s);
+    return true;
+}
+
+/* Steps the task at index *I of TABLE, which must not be STOPPED,
+   as task_step() does for linked tasks.  A fn that adds a polled
+   task moves the first waiting task to the end, and may grow the
+   arrays, so *I is read again after every call: a polled task's
+   index stays put, and a waiting task's is its slot's. */
+static void step(struct task_table *table, const uint32_t *i) {
+    void *data = table->data[*i];
+    task_cond_t is_done;
+
+    switch (table->state[*i]) {
+    case STARTING:
+        if (table->cold[*i].init)
+            table->cold[*i].init(data);
+        table->state[*i] = RUNNING;
+        // fall through
+    case RUNNING:
+        is_done = table->is_done[*i];
+        table->run[*i](data);
+        if (!is_done || is_done(data))
+            table->state[*i] = STOPPED;
+        break;
+    case INTERRUPTED:
+        table->cold[*i].interrupt(data);
+        table->state[*i] = STOPPED;
+        break;
+    }
+}
+
+/* Visits the waiting task in slot S, whose ready bit was set. */
+static void visit_ready(struct task_table *table, uint32_t s) {
+    struct task_table_slot *slot = slot_at(table, s);
+    uint32_t i = slot->index;
+
+    /* A bit can outlive its task, or be set for a polled one. */
+    if (!(__atomic_load_n(&slot->tag, __ATOMIC_RELAXED) & TAG_LIVE) ||
+        i < table->npolled)
+        return;
+
+    if (table->state[i] != STOPPED) {
+        step(table, &slot->index);
+        i = slot->index;
+    }
+    /* Removed on the tick after it stops, as polled tasks are. */
+    else if (remove_at(table, i)) {
+        return;
+    }
+    if (table->state[i] == STOPPED)
+        mark_ready(table, s);
+}
+
+/* Runs one tick of TABLE: every polled task, and the waiting tasks
+   whose ready bit is set.  Tasks that stopped on an earlier tick
+   are destroyed and removed, and the others are stepped as linked
+   tasks are: init and the first run on the first tick, interrupt
+   on the tick after a stop.  Polled tasks added during the tick are
+   run in it too. */
+void task_table_run(struct task_table *table) {
+    uint32_t i = 0;
+
+    if (__atomic_load_n(&table->stops, __ATOMIC_RELAXED) != TASK_ID_NONE)
+        drain_stops(table, true);
+
+    while (i < table->npolled) {
+        if (table->state[i] == STOPPED) {
+            /* The last polled task moves into I and is run next. */
+            if (remove_at(table, i))
+                continue;
+        }
+        else {
+            step(table, &i);
+        }
+        i++;
+    }
+
+    /* Bits set from here on are for the next tick, unless the scan
+       has yet to reach them. */
+    if (!__atomic_exchange_n(&table->any_ready, false, __ATOMIC_ACQ_REL))
+        return;
+    for (uint32_t c = 0; c * CHUNK_SLOTS < table->nslots; c++) {
+        uint64_t *ready = table->chunks[c]->ready;
+        size_t nwords = BITMAP_WORDS(CHUNK_SLOTS);
+
+        for (size_t w = bitmap_next_word(ready, nwords, 0); w < nwords;
+             w = bitmap_next_word(ready, nwords, w + 1)) {
+            uint64_t bits = bitmap_take_word(ready, w);
+
+            while (bits) {
+                unsigned b = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                visit_ready(table, c * CHUNK_SLOTS + w * BITMAP_WORD_BITS + b);
+            }
+        }
+    }
+}
+
+/* Takes every task out of TABLE as scheduler_free() does: running
+   tasks that are not done get their interrupt, and every task that
+   was initialized is destroyed.  Pending stops are dropped. */
+void task_table_clear(struct task_table *table) {
+    drain_stops(table, false);
+    for (uint32_t i = 0; i < table->size; i++) {
+        uint32_t s = table->id[i] & SLOT_MASK;
+        struct task_table_slot *slot = slot_at(table, s);
+        void *data = table->data[i];
+
+        switch (table->state[i]) {
+        case RUNNING:
+            if (!table->is_done[i] || table->is_done[i](data))
+                break;
+            // fall through
+        case INTERRUPTED:
+            table->cold[i].interrupt(data);
+            break;
+        }
+        if (table->state[i] != STARTING && table->cold[i].destroy)
+            table->cold[i].destroy(data);
+        __atomic_store_n(&slot->tag, next_tag(slot->tag), __ATOMIC_RELEASE);
+        free_slot(table, s);
+    }
+    table->size = 0;
+    table->npolled = 0;
+    for (uint32_t c = 0; c * CHUNK_SLOTS < table->nslots; c++)
+        memset(table->chunks[c]->ready, 0, sizeof(table->chunks[c]->ready));
+    table->any_ready = false;
+}
+
+/* Returns the number of tasks in TABLE. */
+size_t task_table_size(struct task_table *table) {
+    return table->size;
+}
+
+/* Returns true if the next task_table_run() has anything to do:
+   polled tasks to run, or waiting tasks readied or stopped since
+   the last one.  Safe to call from any thread, though only exact
+   on the table's own. */
+bool task_table_busy(struct task_table *table) {
+    return __atomic_load_n(&table->npolled, __ATOMIC_RELAXED) > 0 ||
+           __atomic_load_n(&table->any_ready, __ATOMIC_SEQ_CST) ||
+           __atomic_load_n(&table->stops, __ATOMIC_SEQ_CST) != TASK_ID_NONE;
+}
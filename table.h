@@ -0,0 +1,124 @@
+#ifndef __TABLE_H
+#define __TABLE_H
+
+/* Dense task table.
+
+   A task table holds plain run/is_done tasks as parallel arrays
+   rather than as linked `struct task' objects, so that running a
+   tick is a linear scan over a few contiguous arrays.  The fields
+   every tick touches (run, is_done, data and state) each get an
+   array of their own; init, destroy and interrupt, which are only
+   needed once or twice in a task's life, are kept together in a
+   separate cold array.
+
+   Live tasks always occupy indices 0 to size - 1.  A task that is
+   removed has the last task moved into its place, so indices are
+   not stable; each task is instead known by an id, made of a slot
+   number and the slot's generation.  The slot maps to the task's
+   current index, and once the task is removed the slot's
+   generation moves on, so a stale id no longer matches it.  Slots
+   live in fixed chunks that never move, and freed slots are
+   reused oldest first, so a generation only comes round again
+   after a slot has been reused TABLE_GENERATIONS times.
+
+   Tasks come in two kinds.  Polled tasks are run on every tick,
+   and are kept at the front of the arrays, indices 0 to npolled -
+   1, so that they are a linear scan of their own.  Waiting tasks
+   come after them and are only run on ticks after their slot's
+   bit has been set in a ready bitmap, which each chunk of slots
+   carries along with the slots.  A tick scans the bitmap words of
+   every chunk for set bits, and skips the scan altogether when no
+   bit has been set since the last one, so a table of waiting
+   tasks costs little more than the ones that are ready.
+
+   A table belongs to the thread that runs it, and its fns may add
+   tasks to it while it runs.  task_table_stop() and
+   task_table_ready() alone are safe from any thread.  Both check
+   the id against its slot; a stop then pushes the slot onto a
+   lock-free stack that the next task_table_run() drains, and
+   task_table_ready() sets the slot's bit. */
+
+#include "bitmap.h"
+#include "scheduler.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TABLE_SLOT_BITS 24
+#define TABLE_SLOTS ((1u << TABLE_SLOT_BITS) - 1) /* TASK_ID_NONE's is out */
+#define TABLE_GENERATIONS (1u << (32 - TABLE_SLOT_BITS))
+#define TABLE_CHUNK_BITS 12
+#define TABLE_CHUNKS (1u << (TABLE_SLOT_BITS - TABLE_CHUNK_BITS))
+
+/* Rarely used fns of a task. */
+struct task_table_cold {
+    task_fn_t init;
+    task_fn_t destroy;
+    task_fn_t interrupt;
+};
+
+/* Where the task with a given slot number is. */
+struct task_table_slot {
+    uint32_t tag;   /* Generation << 2 | live | stop pending, atomic. */
+    uint32_t index; /* Of the task while live, else next free slot. */
+    uint32_t next;  /* Next slot in the stop stack. */
+};
+
+/* A fixed block of slots, and their ready bits. */
+struct task_table_chunk {
+    uint64_t ready[BITMAP_WORDS(1 << TABLE_CHUNK_BITS)];
+    struct task_table_slot slots[1 << TABLE_CHUNK_BITS];
+};
+
+/* Task table. */
+struct task_table {
+    /* Hot, by index. */
+    task_fn_t *run;
+    task_cond_t *is_done;
+    void **data;
+    uint8_t *state;
+
+    /* Cold, by index. */
+    struct task_table_cold *cold;
+    task_id_t *id; /* Of the task at each index. */
+
+    uint32_t size;    /* Live tasks. */
+    uint32_t npolled; /* Polled tasks, which come first. */
+    uint32_t cap;     /* Of the by-index arrays. */
+
+    /* By slot number, TABLE_CHUNKS chunks of 1 << TABLE_CHUNK_BITS. */
+    struct task_table_chunk **chunks;
+    uint32_t nslots;    /* Slots handed out so far, atomic. */
+    uint32_t free_head; /* Oldest free slot, or TASK_ID_NONE. */
+    uint32_t free_tail; /* Newest free slot. */
+    uint32_t stops;     /* Top of the stop stack, or TASK_ID_NONE. */
+    bool any_ready;     /* A ready bit was set since the last scan. */
+};
+
+void task_table_init(struct task_table *);
+void task_table_destroy(struct task_table *);
+
+task_id_t task_table_add(struct task_table *,
+                         task_fn_t init,
+                         task_fn_t run,
+                         task_fn_t destroy,
+                         task_fn_t interrupt,
+                         task_cond_t is_done,
+                         void *data);
+task_id_t task_table_add_waiting(struct task_table *,
+                                 task_fn_t init,
+                                 task_fn_t run,
+                                 task_fn_t destroy,
+                                 task_fn_t interrupt,
+                                 task_cond_t is_done,
+                                 void *data);
+bool task_table_stop(struct task_table *, task_id_t);
+bool task_table_ready(struct task_table *, task_id_t);
+
+void task_table_run(struct task_table *);
+void task_table_clear(struct task_table *);
+
+size_t task_table_size(struct task_table *);
+bool task_table_busy(struct task_table *);
+
+#endif /* table.h */
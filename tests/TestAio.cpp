@@ -0,0 +1,163 @@
+#include "gtest/gtest.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+
+#include "../aio.h"
+
+	static struct aio_request make_request(enum aio_op op, int fd, void *buf,
+					       size_t len, uint64_t offset) {
+		struct aio_request req;
+		memset(&req, 0, sizeof(req));
+		req.op = op;
+		req.fd = fd;
+		req.buf = buf;
+		req.len = len;
+		req.offset = offset;
+		req.result = 1234;
+		return req;
+	}
+}
+
+namespace {
+	// Returns an unlinked temporary file
+	static int temp_file() {
+		char path[] = "/tmp/TestAioXXXXXX";
+		int fd = mkstemp(path);
+		unlink(path);
+		return fd;
+	}
+
+	// Flushes CTX and reaps into DONE until N requests have come back
+	static void complete(struct aio_context *ctx, struct list *done,
+			     size_t n) {
+		size_t got = 0;
+		aio_flush(ctx);
+		while (got < n) {
+			aio_wait(ctx);
+			got += aio_reap(ctx, done);
+		}
+		EXPECT_EQ(0, ctx->pending);
+	}
+
+	static void write_read_fsync(unsigned flags) {
+		struct aio_context ctx;
+		struct list done;
+		ASSERT_TRUE(aio_init(&ctx, flags));
+		list_init(&done);
+		int fd = temp_file();
+		ASSERT_GE(fd, 0);
+
+		char out[] = "hello, world";
+		auto w = make_request(AIO_WRITE, fd, out, sizeof(out), 4);
+		aio_submit(&ctx, &w);
+		EXPECT_EQ(1, ctx.pending);
+		EXPECT_EQ(0, aio_reap(&ctx, &done));
+		complete(&ctx, &done, 1);
+		EXPECT_EQ(&w.elem, list_pop_front(&done));
+		EXPECT_EQ((int64_t)sizeof(out), w.result);
+
+		char in[sizeof(out)] = { 0 };
+		auto r = make_request(AIO_READ, fd, in, sizeof(in), 4);
+		auto s = make_request(AIO_FSYNC, fd, NULL, 0, 0);
+		aio_submit(&ctx, &r);
+		aio_submit(&ctx, &s);
+		complete(&ctx, &done, 2);
+		EXPECT_EQ(2, list_size(&done));
+		EXPECT_EQ((int64_t)sizeof(in), r.result);
+		EXPECT_STREQ(out, in);
+		EXPECT_EQ(0, s.result);
+
+		aio_destroy(&ctx);
+		close(fd);
+	}
+
+	TEST(AioTest, WriteReadFsync) {
+		write_read_fsync(0);
+	}
+
+	TEST(AioTest, WriteReadFsyncThreads) {
+		write_read_fsync(AIO_NO_URING);
+	}
+
+	static void errors(unsigned flags) {
+		struct aio_context ctx;
+		struct list done;
+		ASSERT_TRUE(aio_init(&ctx, flags));
+		list_init(&done);
+
+		char buf[8];
+		auto r = make_request(AIO_READ, -1, buf, sizeof(buf), 0);
+		aio_submit(&ctx, &r);
+		complete(&ctx, &done, 1);
+		EXPECT_EQ(-EBADF, r.result);
+
+		aio_destroy(&ctx);
+	}
+
+	TEST(AioTest, Errors) {
+		errors(0);
+	}
+
+	TEST(AioTest, ErrorsThreads) {
+		errors(AIO_NO_URING);
+	}
+
+	// More requests than fit in the ring at once
+	static void many(unsigned flags) {
+		struct aio_context ctx;
+		struct list done;
+		ASSERT_TRUE(aio_init(&ctx, flags));
+		list_init(&done);
+		int fd = temp_file();
+		ASSERT_GE(fd, 0);
+
+		const size_t n = AIO_ENTRIES * 3;
+		std::vector<uint32_t> data(n);
+		for (size_t i = 0; i < n; i++)
+			data[i] = i * 7;
+		ASSERT_EQ((ssize_t)(n * 4), write(fd, data.data(), n * 4));
+
+		std::vector<uint32_t> in(n);
+		std::vector<struct aio_request> reqs(n);
+		for (size_t i = 0; i < n; i++) {
+			reqs[i] = make_request(AIO_READ, fd, &in[i], 4, i * 4);
+			aio_submit(&ctx, &reqs[i]);
+		}
+		complete(&ctx, &done, n);
+		EXPECT_EQ(n, list_size(&done));
+		for (size_t i = 0; i < n; i++) {
+			EXPECT_EQ(4, reqs[i].result);
+			EXPECT_EQ(i * 7, in[i]);
+		}
+
+		aio_destroy(&ctx);
+		close(fd);
+	}
+
+	TEST(AioTest, Many) {
+		many(0);
+	}
+
+	TEST(AioTest, ManyThreads) {
+		many(AIO_NO_URING);
+	}
+
+	// aio_destroy waits for requests that were never reaped
+	TEST(AioTest, DestroyPending) {
+		struct aio_context ctx;
+		ASSERT_TRUE(aio_init(&ctx, AIO_NO_URING));
+		int fd = temp_file();
+		char buf[4] = "abc";
+		auto w = make_request(AIO_WRITE, fd, buf, sizeof(buf), 0);
+		aio_submit(&ctx, &w);
+		aio_flush(&ctx);
+		aio_destroy(&ctx);
+		EXPECT_EQ(4, w.result);
+		close(fd);
+	}
+}
@@ -0,0 +1,76 @@
+#include "gtest/gtest.h"
+#include <random>
+#include <vector>
+
+extern "C" {
+
+#include "../bitmap.h"
+}
+
+namespace {
+	TEST(BitmapTest, SetTestTake) {
+		uint64_t words[BITMAP_WORDS(200)] = {0};
+		EXPECT_EQ(4, BITMAP_WORDS(200));
+
+		bitmap_set(words, 0);
+		bitmap_set(words, 63);
+		bitmap_set(words, 130);
+		EXPECT_TRUE(bitmap_test(words, 0));
+		EXPECT_TRUE(bitmap_test(words, 63));
+		EXPECT_FALSE(bitmap_test(words, 64));
+		EXPECT_TRUE(bitmap_test(words, 130));
+
+		EXPECT_EQ((uint64_t)1 | (uint64_t)1 << 63,
+			  bitmap_take_word(words, 0));
+		EXPECT_EQ(0, bitmap_take_word(words, 0));
+		EXPECT_FALSE(bitmap_test(words, 0));
+		EXPECT_EQ((uint64_t)1 << 2, bitmap_take_word(words, 2));
+	}
+
+	// Every set word is found, from every starting point, at sizes
+	// that leave words over after the vector compares
+	TEST(BitmapTest, NextWord) {
+		std::mt19937 rng(5);
+		for (size_t n : {1, 2, 3, 4, 5, 7, 8, 9, 64, 67}) {
+			std::vector<uint64_t> words(n, 0);
+			EXPECT_EQ(n, bitmap_next_word(words.data(), n, 0));
+
+			for (size_t i = 0; i < n; i++)
+				if (rng() % 3 == 0)
+					bitmap_set(words.data(),
+						   i * BITMAP_WORD_BITS +
+							   rng() % BITMAP_WORD_BITS);
+			for (size_t from = 0; from <= n; from++) {
+				size_t want = from;
+				while (want < n && !words[want])
+					want++;
+				EXPECT_EQ(want,
+					  bitmap_next_word(words.data(), n, from));
+			}
+		}
+	}
+
+	// A scan with takes sees each set bit once
+	TEST(BitmapTest, Scan) {
+		const size_t bits = 4096;
+		uint64_t words[BITMAP_WORDS(bits)] = {0};
+		std::vector<bool> want(bits);
+		for (size_t b = 7; b < bits; b += 97) {
+			bitmap_set(words, b);
+			want[b] = true;
+		}
+
+		std::vector<bool> seen(bits);
+		size_t n = BITMAP_WORDS(bits);
+		for (size_t w = bitmap_next_word(words, n, 0); w < n;
+		     w = bitmap_next_word(words, n, w + 1)) {
+			uint64_t word = bitmap_take_word(words, w);
+			EXPECT_NE(0, word);
+			for (; word; word &= word - 1)
+				seen[w * BITMAP_WORD_BITS + __builtin_ctzll(word)] =
+					true;
+		}
+		EXPECT_EQ(want, seen);
+		EXPECT_EQ(n, bitmap_next_word(words, n, 0));
+	}
+}
@@ -0,0 +1,171 @@
+#include "gtest/gtest.h"
+#include <cfenv>
+#include <pthread.h>
+#include <vector>
+
+extern "C" {
+
+#include "../coro.h"
+
+	struct Counter {
+		int steps = 0;
+		int limit = 3;
+	};
+
+	static void count_body(void *a) {
+		struct Counter *c = (struct Counter *)a;
+		while (c->steps < c->limit) {
+			c->steps++;
+			coro_yield();
+		}
+	}
+
+	// Yields from a few frames down
+	static int deep(int n) {
+		if (n == 0) {
+			coro_yield();
+			return 0;
+		}
+		return deep(n - 1) + 1;
+	}
+
+	static void deep_body(void *a) {
+		*(int *)a = deep(100);
+	}
+
+	// Rounds up from its first turn on, and records the mode it
+	// finds on each turn
+	static void round_body(void *a) {
+		int *modes = (int *)a;
+		modes[0] = fegetround();
+		fesetround(FE_UPWARD);
+		coro_yield();
+		modes[1] = fegetround();
+	}
+}
+
+namespace {
+	TEST(CoroTest, ResumeYield) {
+		struct coro_stack_pool pool;
+		struct Counter c;
+		coro_pool_init(&pool, CORO_STACK_SIZE);
+
+		auto co = coro_new(&pool, count_body, &c);
+		ASSERT_NE(nullptr, co);
+		EXPECT_EQ(nullptr, coro_self());
+		EXPECT_EQ(0, c.steps);
+		for (int i = 1; i <= 3; i++) {
+			EXPECT_FALSE(coro_resume(co));
+			EXPECT_EQ(i, c.steps);
+			EXPECT_EQ(nullptr, coro_self());
+		}
+		EXPECT_TRUE(coro_resume(co));
+		EXPECT_TRUE(co->done);
+
+		coro_free(&pool, co);
+		coro_pool_destroy(&pool);
+	}
+
+	TEST(CoroTest, YieldFromDepth) {
+		struct coro_stack_pool pool;
+		int result = -1;
+		coro_pool_init(&pool, CORO_STACK_SIZE);
+
+		auto co = coro_new(&pool, deep_body, &result);
+		EXPECT_FALSE(coro_resume(co));
+		EXPECT_EQ(-1, result);
+		EXPECT_TRUE(coro_resume(co));
+		EXPECT_EQ(100, result);
+
+		coro_free(&pool, co);
+		coro_pool_destroy(&pool);
+	}
+
+	TEST(CoroTest, RoundingModeStaysInside) {
+		struct coro_stack_pool pool;
+		int modes[2] = { -1, -1 };
+		coro_pool_init(&pool, CORO_STACK_SIZE);
+
+		fesetround(FE_TOWARDZERO);
+		auto co = coro_new(&pool, round_body, modes);
+		EXPECT_FALSE(coro_resume(co));
+		EXPECT_EQ(FE_TONEAREST, modes[0]);
+		EXPECT_EQ(FE_TOWARDZERO, fegetround());
+		EXPECT_TRUE(coro_resume(co));
+		EXPECT_EQ(FE_UPWARD, modes[1]);
+		EXPECT_EQ(FE_TOWARDZERO, fegetround());
+		fesetround(FE_TONEAREST);
+
+		coro_free(&pool, co);
+		coro_pool_destroy(&pool);
+	}
+
+	TEST(CoroTest, StacksReused) {
+		struct coro_stack_pool pool;
+		struct Counter c;
+		coro_pool_init(&pool, 10000);
+		EXPECT_EQ(0, pool.stack_size % 4096);
+		EXPECT_GE(pool.stack_size, 10000);
+
+		// An unfinished coroutine can be freed, and its stack comes back
+		auto a = coro_new(&pool, count_body, &c);
+		EXPECT_FALSE(coro_resume(a));
+		coro_free(&pool, a);
+		auto b = coro_new(&pool, count_body, &c);
+		EXPECT_EQ(a, b);
+		EXPECT_EQ(1, pool.nstacks);
+
+		auto d = coro_new(&pool, count_body, &c);
+		EXPECT_NE(b, d);
+		EXPECT_EQ(2, pool.nstacks);
+
+		coro_free(&pool, b);
+		coro_free(&pool, d);
+		coro_pool_destroy(&pool);
+	}
+
+	struct Handoff {
+		struct coro *co;
+		bool done;
+	};
+
+	static void *resume_thread(void *a) {
+		struct Handoff *h = (struct Handoff *)a;
+		h->done = coro_resume(h->co);
+		return NULL;
+	}
+
+	// A coroutine can continue on another thread
+	TEST(CoroTest, ResumeOnOtherThread) {
+		struct coro_stack_pool pool;
+		struct Counter c;
+		c.limit = 4;
+		coro_pool_init(&pool, CORO_STACK_SIZE);
+
+		struct Handoff h = { coro_new(&pool, count_body, &c), false };
+		while (!h.done) {
+			pthread_t thread;
+			pthread_create(&thread, NULL, resume_thread, &h);
+			pthread_join(thread, NULL);
+		}
+		EXPECT_EQ(4, c.steps);
+
+		coro_free(&pool, h.co);
+		coro_pool_destroy(&pool);
+	}
+
+	static void overflow_body(void *a) {
+		volatile char buf[1024];
+		buf[0] = 1;
+		overflow_body(a);
+		(void)buf[0];
+	}
+
+	TEST(CoroDeathTest, GuardPage) {
+		EXPECT_DEATH({
+			struct coro_stack_pool pool;
+			coro_pool_init(&pool, 16 * 1024);
+			coro_resume(coro_new(&pool, overflow_body, NULL));
+		}, "");
+	}
+}
@@ -0,0 +1,120 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+
+extern "C" {
+
+#include "../heap.h"
+
+	struct HeapItem {
+		struct heap_elem elem;
+		int key;
+	};
+
+	static bool item_less(const struct heap_elem *a,
+			      const struct heap_elem *b, void *aux) {
+		(void)aux;
+		return heap_entry(a, struct HeapItem, elem)->key <
+		       heap_entry(b, struct HeapItem, elem)->key;
+	}
+}
+
+namespace {
+	static int pop_key(struct heap *h) {
+		struct heap_elem *e = heap_pop(h);
+		return e ? heap_entry(e, struct HeapItem, elem)->key : -1;
+	}
+
+	TEST(HeapTest, Empty) {
+		struct heap h;
+		heap_init(&h, item_less, NULL);
+		EXPECT_TRUE(heap_empty(&h));
+		EXPECT_EQ(0, heap_size(&h));
+		EXPECT_EQ(nullptr, heap_min(&h));
+		EXPECT_EQ(nullptr, heap_pop(&h));
+	}
+
+	TEST(HeapTest, Sorts) {
+		const int n = 1000;
+		std::vector<struct HeapItem> items(n);
+		std::mt19937 rng(1);
+		struct heap h;
+		heap_init(&h, item_less, NULL);
+
+		for (int i = 0; i < n; i++) {
+			items[i].key = rng() % 100;
+			heap_push(&h, &items[i].elem);
+		}
+		EXPECT_EQ(n, heap_size(&h));
+
+		std::vector<int> keys;
+		for (auto &item : items)
+			keys.push_back(item.key);
+		std::sort(keys.begin(), keys.end());
+		EXPECT_EQ(keys[0], heap_entry(heap_min(&h), struct HeapItem, elem)->key);
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(keys[i], pop_key(&h));
+		EXPECT_TRUE(heap_empty(&h));
+	}
+
+	TEST(HeapTest, Remove) {
+		const int n = 500;
+		std::vector<struct HeapItem> items(n);
+		std::vector<bool> in(n, true);
+		std::mt19937 rng(2);
+		struct heap h;
+		heap_init(&h, item_less, NULL);
+
+		for (int i = 0; i < n; i++) {
+			items[i].key = rng() % 1000;
+			heap_push(&h, &items[i].elem);
+		}
+		// Pop once so the heap has some shape, then remove every third
+		// element that is left, and finally the root itself
+		struct HeapItem *min = heap_entry(heap_pop(&h), struct HeapItem, elem);
+		in[min - &items[0]] = false;
+		for (int i = 0; i < n; i += 3) {
+			if (!in[i])
+				continue;
+			heap_remove(&h, &items[i].elem);
+			in[i] = false;
+		}
+		min = heap_entry(heap_min(&h), struct HeapItem, elem);
+		heap_remove(&h, &min->elem);
+		in[min - &items[0]] = false;
+
+		std::vector<int> left;
+		for (int i = 0; i < n; i++)
+			if (in[i])
+				left.push_back(items[i].key);
+		std::sort(left.begin(), left.end());
+		EXPECT_EQ(left.size(), heap_size(&h));
+		for (int key : left)
+			EXPECT_EQ(key, pop_key(&h));
+		EXPECT_TRUE(heap_empty(&h));
+	}
+
+	TEST(HeapTest, Interleaved) {
+		std::vector<struct HeapItem> items(200);
+		std::multiset<int> model;
+		std::mt19937 rng(3);
+		struct heap h;
+		heap_init(&h, item_less, NULL);
+
+		size_t next = 0;
+		for (int round = 0; round < 2000; round++) {
+			if (next < items.size() && (model.empty() || rng() % 3)) {
+				items[next].key = rng() % 50;
+				model.insert(items[next].key);
+				heap_push(&h, &items[next++].elem);
+			}
+			else if (!model.empty()) {
+				EXPECT_EQ(*model.begin(), pop_key(&h));
+				model.erase(model.begin());
+			}
+			EXPECT_EQ(model.size(), heap_size(&h));
+		}
+	}
+}
@@ -0,0 +1,109 @@
+#include "gtest/gtest.h"
+#include <pthread.h>
+#include <random>
+
+extern "C" {
+
+#include "../hist.h"
+}
+
+namespace {
+	TEST(HistTest, Buckets) {
+		// Small values are exact
+		for (uint64_t v = 0; v < 2 * HIST_SUB_BUCKETS; v++) {
+			EXPECT_EQ(v, hist_bucket(v));
+			EXPECT_EQ(v, hist_bucket_min(v));
+			EXPECT_EQ(v, hist_bucket_max(v));
+		}
+
+		// Buckets tile the range, each within 1/32 of its values
+		for (size_t b = 1; b < HIST_BUCKETS; b++) {
+			EXPECT_EQ(hist_bucket_max(b - 1) + 1, hist_bucket_min(b));
+			EXPECT_EQ(b, hist_bucket(hist_bucket_min(b)));
+			EXPECT_EQ(b, hist_bucket(hist_bucket_max(b)));
+			EXPECT_LE(hist_bucket_max(b) - hist_bucket_min(b),
+				  hist_bucket_min(b) / HIST_SUB_BUCKETS);
+		}
+		EXPECT_EQ(HIST_BUCKETS - 1, hist_bucket(UINT64_MAX));
+		EXPECT_EQ(UINT64_MAX, hist_bucket_max(HIST_BUCKETS - 1));
+	}
+
+	TEST(HistTest, Quantiles) {
+		struct hist h;
+		hist_init(&h);
+		EXPECT_EQ(0, hist_count(&h));
+		EXPECT_EQ(0, hist_quantile(&h, 0.5));
+
+		// 1 to 1000, and one outlier
+		for (uint64_t v = 1; v <= 1000; v++)
+			hist_record(&h, v);
+		hist_record(&h, 1000000);
+		EXPECT_EQ(1001, hist_count(&h));
+
+		auto near = [](uint64_t want, uint64_t got) {
+			EXPECT_GE(got, want);
+			EXPECT_LE(got, want + want / HIST_SUB_BUCKETS);
+		};
+		near(501, hist_quantile(&h, 0.5));
+		near(991, hist_quantile(&h, 0.99));
+		near(1000, hist_quantile(&h, 0.999));
+		near(1000000, hist_quantile(&h, 1));
+		EXPECT_EQ(1, hist_quantile(&h, 0));
+	}
+
+	TEST(HistTest, SnapshotReset) {
+		struct hist h, snap;
+		hist_init(&h);
+		for (int i = 0; i < 100; i++)
+			hist_record(&h, i * 1000);
+
+		hist_snapshot(&h, &snap, false);
+		EXPECT_EQ(100, hist_count(&snap));
+		EXPECT_EQ(100, hist_count(&h));
+
+		hist_snapshot(&h, &snap, true);
+		EXPECT_EQ(100, hist_count(&snap));
+		EXPECT_EQ(0, hist_count(&h));
+		hist_record(&h, 5);
+		EXPECT_EQ(5, hist_quantile(&h, 1));
+	}
+
+	struct Recorder {
+		struct hist *h;
+		int n;
+		unsigned seed;
+	};
+
+	static void *record_thread(void *a) {
+		struct Recorder *r = (struct Recorder *)a;
+		std::mt19937_64 rng(r->seed);
+		for (int i = 0; i < r->n; i++)
+			hist_record(r->h, rng() >> (rng() % 64));
+		return NULL;
+	}
+
+	// Values recorded while snapshots reset the histogram are never
+	// lost
+	TEST(HistTest, Concurrent) {
+		const int n = 100000, nthreads = 4;
+		struct hist h, snap;
+		uint64_t total = 0;
+		hist_init(&h);
+
+		struct Recorder r[nthreads];
+		pthread_t threads[nthreads];
+		for (int i = 0; i < nthreads; i++) {
+			r[i] = { &h, n, (unsigned)i };
+			pthread_create(&threads[i], NULL, record_thread, &r[i]);
+		}
+		for (int i = 0; i < 100; i++) {
+			hist_snapshot(&h, &snap, true);
+			total += hist_count(&snap);
+		}
+		for (int i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		hist_snapshot(&h, &snap, true);
+		total += hist_count(&snap);
+		EXPECT_EQ((uint64_t)n * nthreads, total);
+	}
+}
@@ -0,0 +1,124 @@
+#include "gtest/gtest.h"
+#include <pthread.h>
+#include <vector>
+
+extern "C" {
+
+#include "../mpsc.h"
+
+	struct Item {
+		struct list_elem elem;
+		int producer;
+		int seq;
+	};
+}
+
+namespace {
+	TEST(MpscTest, Empty) {
+		struct mpsc_queue q;
+		mpsc_init(&q);
+		EXPECT_EQ(nullptr, mpsc_pop(&q));
+		EXPECT_EQ(nullptr, mpsc_pop(&q));
+	}
+
+	TEST(MpscTest, Fifo) {
+		struct mpsc_queue q;
+		struct Item items[5];
+		mpsc_init(&q);
+
+		for (int i = 0; i < 5; i++) {
+			items[i].seq = i;
+			mpsc_push(&q, &items[i].elem);
+		}
+		for (int i = 0; i < 3; i++)
+			EXPECT_EQ(&items[i].elem, mpsc_pop(&q));
+
+		// Refill after partially draining, including the last element
+		mpsc_push(&q, &items[0].elem);
+		EXPECT_EQ(&items[3].elem, mpsc_pop(&q));
+		EXPECT_EQ(&items[4].elem, mpsc_pop(&q));
+		EXPECT_EQ(&items[0].elem, mpsc_pop(&q));
+		EXPECT_EQ(nullptr, mpsc_pop(&q));
+	}
+
+	TEST(MpscTest, Chain) {
+		struct mpsc_queue q;
+		struct Item items[4];
+		mpsc_init(&q);
+
+		mpsc_push(&q, &items[0].elem);
+		for (int i = 1; i < 3; i++)
+			items[i].elem.next = &items[i + 1].elem;
+		mpsc_push_chain(&q, &items[1].elem, &items[3].elem);
+
+		for (int i = 0; i < 4; i++)
+			EXPECT_EQ(&items[i].elem, mpsc_pop(&q));
+		EXPECT_EQ(nullptr, mpsc_pop(&q));
+	}
+
+	TEST(MpscTest, Drain) {
+		struct mpsc_queue q;
+		struct Item items[3];
+		struct list l;
+		mpsc_init(&q);
+		list_init(&l);
+
+		for (int i = 0; i < 3; i++)
+			mpsc_push(&q, &items[i].elem);
+		EXPECT_EQ(3, mpsc_drain(&q, &l));
+		EXPECT_EQ(3, list_size(&l));
+		EXPECT_EQ(&items[0].elem, list_front(&l));
+		EXPECT_EQ(&items[2].elem, list_back(&l));
+		EXPECT_EQ(0, mpsc_drain(&q, &l));
+	}
+
+	const int n_producers = 4;
+	const int n_per_producer = 10000;
+
+	struct Producer {
+		struct mpsc_queue *q;
+		struct Item *items;
+	};
+
+	static void *produce(void *a) {
+		struct Producer *p = (struct Producer *)a;
+		for (int i = 0; i < n_per_producer; i++)
+			mpsc_push(p->q, &p->items[i].elem);
+		return NULL;
+	}
+
+	// Every element arrives once, and each producer's elements in order
+	TEST(MpscTest, ManyProducers) {
+		struct mpsc_queue q;
+		mpsc_init(&q);
+
+		std::vector<struct Item> items(n_producers * n_per_producer);
+		struct Producer producers[n_producers];
+		pthread_t threads[n_producers];
+		for (int p = 0; p < n_producers; p++) {
+			producers[p].q = &q;
+			producers[p].items = &items[p * n_per_producer];
+			for (int i = 0; i < n_per_producer; i++) {
+				producers[p].items[i].producer = p;
+				producers[p].items[i].seq = i;
+			}
+			pthread_create(&threads[p], NULL, produce, &producers[p]);
+		}
+
+		int next[n_producers] = { 0 };
+		int total = 0;
+		while (total < n_producers * n_per_producer) {
+			struct list_elem *e = mpsc_pop(&q);
+			if (!e)
+				continue;
+			struct Item *item = list_entry(e, struct Item, elem);
+			EXPECT_EQ(next[item->producer], item->seq);
+			next[item->producer] = item->seq + 1;
+			total++;
+		}
+
+		for (int p = 0; p < n_producers; p++)
+			pthread_join(threads[p], NULL);
+		EXPECT_EQ(nullptr, mpsc_pop(&q));
+	}
+}
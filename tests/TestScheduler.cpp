@@ -1,8 +1,13 @@
 #include "gtest/gtest.h"
 #include <memory>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
 
 extern "C" {
 
+// The tests build scheduler.c themselves, with the stats switched on
+#define SCHEDULER_STATS 1
 #include "../scheduler.c"
 
 	struct TestStruct {
@@ -16,24 +21,37 @@ extern "C" {
 
 	static void init(void *a) {
 		struct TestStruct *s = (struct TestStruct *)a;
-		s->n_init++;
+		__atomic_add_fetch(&s->n_init, 1, __ATOMIC_RELEASE);
 	}
 	static void run(void *a) {
 		struct TestStruct *s = (struct TestStruct *)a;
-		s->n_run++;
+		__atomic_add_fetch(&s->n_run, 1, __ATOMIC_RELEASE);
 	}
 	static void destroy(void *a) {
 		struct TestStruct *s = (struct TestStruct *)a;
-		s->n_destroy++;
+		__atomic_add_fetch(&s->n_destroy, 1, __ATOMIC_RELEASE);
 	}
 	static void interrupt(void *a) {
 		struct TestStruct *s = (struct TestStruct *)a;
-		s->n_interrupt++;
+		__atomic_add_fetch(&s->n_interrupt, 1, __ATOMIC_RELEASE);
 	}
 	static bool is_done(void *a) {
 		struct TestStruct *s = (struct TestStruct *)a;
-		s->n_is_done++;
-		return s->n_interrupt > 0 || s->is_one_shot;
+		__atomic_add_fetch(&s->n_is_done, 1, __ATOMIC_RELEASE);
+		return __atomic_load_n(&s->n_interrupt, __ATOMIC_ACQUIRE) > 0 ||
+		       s->is_one_shot;
+	}
+
+	// Number of tasks in the run lists of SCHED
+	static size_t runq_size(struct scheduler *sched) {
+		size_t n = 0;
+		for (auto &runq : sched->runq)
+			n += list_size(&runq);
+		return n;
+	}
+
+	static bool runq_empty(struct scheduler *sched) {
+		return runq_size(sched) == 0;
 	}
 }
 
@@ -66,14 +84,15 @@ namespace {
 	TEST(SchedulerTest, SchedulerInit) {
 		auto s = scheduler_new();
 		EXPECT_NE(nullptr, s);
-		EXPECT_EQ(s->tasks.head.next, &s->tasks.tail);
-		EXPECT_EQ(s->tasks.tail.prev, &s->tasks.head);
-		EXPECT_EQ(NULL, s->tasks.head.prev);
-		EXPECT_EQ(NULL, s->tasks.tail.next);
-		EXPECT_EQ(0, pthread_mutex_lock(&s->tasks_lock));
-		EXPECT_EQ(0, pthread_mutex_unlock(&s->tasks_lock));
-		EXPECT_EQ(0, pthread_mutex_lock(&s->state_lock));
-		EXPECT_EQ(0, pthread_mutex_unlock(&s->state_lock));
+		for (auto &runq : s->runq) {
+			EXPECT_EQ(runq.head.next, &runq.tail);
+			EXPECT_EQ(runq.tail.prev, &runq.head);
+			EXPECT_EQ(NULL, runq.head.prev);
+			EXPECT_EQ(NULL, runq.tail.next);
+		}
+		EXPECT_EQ(0, s->runq_mask);
+		EXPECT_EQ(nullptr, mpsc_pop(&s->incoming));
+		EXPECT_EQ(nullptr, mpsc_pop(&s->stopped));
 		scheduler_free(s);
 	}
 
@@ -92,27 +111,28 @@ namespace {
 
 		scheduler_start(s, t);
 		expect_data(data, 0, 0, 0, 0, 0);
-		EXPECT_EQ(1, list_size(&s->tasks));
-		EXPECT_EQ(&t->elem, list_begin(&s->tasks));
+		EXPECT_TRUE(runq_empty(s));
 		EXPECT_EQ(STARTING, t->state);
 
 		scheduler_run(s);
 		expect_data(data, 1, 1, 0, 0, 1);
+		EXPECT_EQ(1, runq_size(s));
+		EXPECT_EQ(&t->elem, list_begin(&s->runq[TASK_PRIORITY_DEFAULT]));
 		EXPECT_EQ(RUNNING, t->state);
 
 		scheduler_stop(s, t);
 		expect_data(data, 1, 1, 0, 0, 1);
-		EXPECT_FALSE(list_empty(&s->tasks));
+		EXPECT_FALSE(runq_empty(s));
 		EXPECT_EQ(INTERRUPTED, t->state);
 
 		scheduler_run(s);
 		expect_data(data, 1, 1, 0, 1, 1);
-		EXPECT_FALSE(list_empty(&s->tasks));
+		EXPECT_FALSE(runq_empty(s));
 		EXPECT_EQ(STOPPED, t->state);
 
 		scheduler_run(s);
 		expect_data(data, 1, 1, 1, 1, 1);
-		EXPECT_TRUE(list_empty(&s->tasks));
+		EXPECT_TRUE(runq_empty(s));
 		EXPECT_EQ(STOPPED, t->state);
 
 		scheduler_free(s);
@@ -191,11 +211,11 @@ namespace {
 
 		scheduler_run(s);
 		expect_data(data, 0, 1, 0, 0, 0);
-		EXPECT_FALSE(list_empty(&s->tasks));
+		EXPECT_FALSE(runq_empty(s));
 
 		scheduler_run(s);
 		expect_data(data, 0, 1, 0, 0, 0);
-		EXPECT_TRUE(list_empty(&s->tasks));
+		EXPECT_TRUE(runq_empty(s));
 
 		scheduler_free(s);
 		expect_data(data, 0, 1, 0, 0, 0);
@@ -216,17 +236,17 @@ namespace {
 			scheduler_start(s, t[i]);
 			expect_data(data[i], 0, 0, 0, 0, 0);
 		}
-		EXPECT_EQ(n, list_size(&s->tasks));
+		EXPECT_TRUE(runq_empty(s));
 
 		scheduler_run(s);
 		for (int i = 0; i < n; i++)
 			expect_data(data[i], 1, 1, 0, 0, 1);
-		EXPECT_EQ(n, list_size(&s->tasks));
+		EXPECT_EQ(n, runq_size(s));
 
 		scheduler_run(s);
 		for (int i = 0; i < n; i++)
 			expect_data(data[i], 1, 2, 0, 0, 2);
-		EXPECT_EQ(n, list_size(&s->tasks));
+		EXPECT_EQ(n, runq_size(s));
 
 		scheduler_free(s);
 		for (int i = 0; i < n; i++)
@@ -302,5 +322,1843 @@ namespace {
 		task_free(t);
 	}
 
+	TEST(SchedulerTest, RunParallel) {
+		const int n = 100;
+		struct TestStruct data[n];
+		struct task *t[n];
+		for (int i = 0; i < n; i++) {
+			data[i].is_one_shot = i % 3 == 0;
+			t[i] = task_new(init, run, destroy, interrupt, is_done, &data[i]);
+		}
+
+		auto s = scheduler_new();
+		for (int i = 0; i < n; i++)
+			scheduler_start(s, t[i]);
+
+		scheduler_run_parallel(s, 4);
+		for (int i = 0; i < n; i++)
+			expect_data(data[i], 1, 1, 0, 0, 1);
+		EXPECT_NE(nullptr, s->pool);
+		EXPECT_EQ(4, s->pool->nthreads);
+
+		scheduler_run_parallel(s, 3);
+		for (int i = 0; i < n; i++) {
+			if (data[i].is_one_shot)
+				expect_data(data[i], 1, 1, 1, 0, 1)
+			else
+				expect_data(data[i], 1, 2, 0, 0, 2)
+		}
+		EXPECT_EQ(3, s->pool->nthreads);
+		EXPECT_EQ(n - (n + 2) / 3, runq_size(s));
+
+		scheduler_free(s);
+		for (int i = 0; i < n; i++) {
+			if (data[i].is_one_shot)
+				expect_data(data[i], 1, 1, 1, 0, 1)
+			else
+				expect_data(data[i], 1, 2, 1, 1, 3)
+		}
+
+		for (int i = 0; i < n; i++)
+			task_free(t[i]);
+	}
+
+	TEST(SchedulerTest, RunParallelSingleThread) {
+		struct TestStruct data;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run_parallel(s, 1);
+		expect_data(data, 1, 1, 0, 0, 1);
+		EXPECT_EQ(nullptr, s->pool);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, StartAfter) {
+		struct TestStruct data;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		scheduler_start_after(s, t, 20 * 1000000);
+		EXPECT_TRUE(runq_empty(s));
+		EXPECT_EQ(0, s->timers.count);
+
+		scheduler_run(s);
+		expect_data(data, 0, 0, 0, 0, 0);
+		EXPECT_TRUE(runq_empty(s));
+		EXPECT_EQ(1, s->timers.count);
+		EXPECT_TRUE(t->timed);
+
+		usleep(30 * 1000);
+		scheduler_run(s);
+		expect_data(data, 1, 1, 0, 0, 1);
+		EXPECT_FALSE(t->timed);
+		EXPECT_EQ(0, s->timers.count);
+		EXPECT_EQ(1, runq_size(s));
+
+		scheduler_free(s);
+		expect_data(data, 1, 1, 1, 1, 2);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, StopInFlight) {
+		struct TestStruct data;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+
+		// A stopper that has made the transition but not pushed yet
+		// keeps the task in, even once it has stopped
+		EXPECT_TRUE(task_stop_begin(t));
+		scheduler_run(s);
+		scheduler_run(s);
+		expect_data(data, 1, 1, 0, 1, 1);
+		EXPECT_FALSE(runq_empty(s));
+
+		mpsc_push(&s->stopped, &t->stop_elem);
+		scheduler_run(s);
+		expect_data(data, 1, 1, 1, 1, 1);
+		EXPECT_TRUE(runq_empty(s));
+
+		// A stop that finds the task stopped leaves no count behind
+		EXPECT_FALSE(task_stop_begin(t));
+		EXPECT_EQ(0u, t->stop_pending);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, Periodic) {
+		struct TestStruct data;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		task_set_period(t, 10 * 1000000);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+		expect_data(data, 1, 1, 0, 0, 1);
+		EXPECT_TRUE(t->timed);
+		EXPECT_TRUE(runq_empty(s));
+
+		// Not due yet, not visited
+		scheduler_run(s);
+		expect_data(data, 1, 1, 0, 0, 1);
+
+		for (int i = 0; i < 50 && data.n_run < 3; i++) {
+			usleep(1000);
+			scheduler_run(s);
+		}
+		EXPECT_EQ(3, data.n_run);
+		EXPECT_TRUE(t->timed);
+
+		// Stopping a sleeping task interrupts it on the next tick
+		scheduler_stop(s, t);
+		EXPECT_TRUE(t->stop_pending);
+		scheduler_run(s);
+		EXPECT_FALSE(t->timed);
+		EXPECT_FALSE(t->stop_pending);
+		expect_data(data, 1, 3, 0, 1, 3);
+		scheduler_run(s);
+		expect_data(data, 1, 3, 1, 1, 3);
+		EXPECT_TRUE(runq_empty(s));
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, PeriodicAtFree) {
+		struct TestStruct data;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		task_set_period(t, 1000 * 1000000);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_TRUE(t->timed);
+
+		scheduler_free(s);
+		expect_data(data, 1, 1, 1, 1, 2);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, StopTwice) {
+		struct TestStruct data;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+		scheduler_stop(s, t);
+		scheduler_stop(s, t);
+		EXPECT_EQ(INTERRUPTED, t->state);
+		scheduler_run(s);
+		expect_data(data, 1, 1, 0, 1, 1);
+		scheduler_stop(s, t);
+		EXPECT_EQ(STOPPED, t->state);
+		scheduler_run(s);
+		expect_data(data, 1, 1, 1, 1, 1);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	// Stop from another thread while the tick is inside a slow run fn
+	static void slow_run(void *a) {
+		struct TestStruct *s = (struct TestStruct *)a;
+		s->n_run++;
+		usleep(50 * 1000);
+	}
+
+	static void *stop_thread(void *a) {
+		auto args = (std::pair<struct scheduler *, struct task *> *)a;
+		usleep(10 * 1000);
+		scheduler_stop(args->first, args->second);
+		return NULL;
+	}
+
+	TEST(SchedulerTest, StopDuringRun) {
+		struct TestStruct data;
+		auto t = task_new(init, slow_run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+
+		auto args = std::make_pair(s, t);
+		pthread_t thread;
+		pthread_create(&thread, NULL, stop_thread, &args);
+		scheduler_run(s);
+		pthread_join(thread, NULL);
+		EXPECT_EQ(INTERRUPTED, t->state);
+		expect_data(data, 1, 2, 0, 0, 2);
+
+		scheduler_run(s);
+		expect_data(data, 1, 2, 0, 1, 2);
+		scheduler_run(s);
+		expect_data(data, 1, 2, 1, 1, 2);
+		EXPECT_TRUE(runq_empty(s));
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	// Tasks keep the order they were started in
+	TEST(SchedulerTest, StartOrder) {
+		const int n = 5;
+		struct TestStruct data[n];
+		struct task *t[n];
+		auto s = scheduler_new();
+		for (int i = 0; i < n; i++) {
+			t[i] = task_new(init, run, destroy, interrupt, is_done, &data[i]);
+			scheduler_start(s, t[i]);
+		}
+
+		scheduler_run(s);
+		struct list_elem *e = list_begin(&s->runq[TASK_PRIORITY_DEFAULT]);
+		for (int i = 0; i < n; i++, e = list_next(e))
+			EXPECT_EQ(&t[i]->elem, e);
+
+		scheduler_free(s);
+		for (int i = 0; i < n; i++)
+			task_free(t[i]);
+	}
+
+	static void *start_thread(void *a) {
+		auto args = (std::pair<struct scheduler *, std::vector<struct task *> *> *)a;
+		for (auto t : *args->second)
+			scheduler_start(args->first, t);
+		return NULL;
+	}
+
+	// Producers start tasks while the scheduler runs
+	TEST(SchedulerTest, StartFromThreads) {
+		const int n_threads = 4;
+		const int n_per_thread = 500;
+		std::vector<struct TestStruct> data(n_threads * n_per_thread);
+		std::vector<struct task *> tasks[n_threads];
+		std::pair<struct scheduler *, std::vector<struct task *> *> args[n_threads];
+		pthread_t threads[n_threads];
+		auto s = scheduler_new();
+
+		for (int i = 0; i < n_threads; i++) {
+			for (int j = 0; j < n_per_thread; j++) {
+				data[i * n_per_thread + j].is_one_shot = true;
+				tasks[i].push_back(task_new(init, run, destroy, interrupt,
+				                            is_done,
+				                            &data[i * n_per_thread + j]));
+			}
+			args[i] = std::make_pair(s, &tasks[i]);
+			pthread_create(&threads[i], NULL, start_thread, &args[i]);
+		}
+
+		for (int i = 0; i < 100; i++)
+			scheduler_run(s);
+		for (int i = 0; i < n_threads; i++)
+			pthread_join(threads[i], NULL);
+		scheduler_run(s);
+		scheduler_run(s);
+
+		for (auto &d : data)
+			expect_data(d, 1, 1, 1, 0, 1);
+		EXPECT_TRUE(runq_empty(s));
+
+		scheduler_free(s);
+		for (int i = 0; i < n_threads; i++)
+			for (auto t : tasks[i])
+				task_free(t);
+	}
+
+	TEST(SchedulerTest, TaskNewIn) {
+		struct TestStruct data;
+		struct scheduler_pool_stats stats;
+		auto s = scheduler_new();
+
+		scheduler_pool_stats(s, &stats);
+		EXPECT_EQ(0, stats.slabs);
+
+		auto t = task_new_in(s, init, run, destroy, interrupt, is_done, &data);
+		EXPECT_EQ(0, (uintptr_t)t % 64);
+		EXPECT_TRUE(t->owned);
+		EXPECT_EQ(&s->task_pool, t->pool);
+		EXPECT_EQ(STARTING, t->state);
+		scheduler_pool_stats(s, &stats);
+		EXPECT_EQ(1, stats.slabs);
+		EXPECT_EQ(1, stats.in_use);
+
+		// Never started, the caller frees it
+		task_free(t);
+		scheduler_pool_stats(s, &stats);
+		EXPECT_EQ(0, stats.in_use);
+
+		scheduler_free(s);
+	}
+
+	// Fire-and-forget tasks go back to the pool when they leave
+	TEST(SchedulerTest, TaskNewInOneShot) {
+		const int n = 100;
+		struct TestStruct data[n];
+		struct scheduler_pool_stats stats;
+		auto s = scheduler_new();
+
+		for (int i = 0; i < n; i++)
+			scheduler_start(s, task_new_in(s, NULL, run, NULL, NULL, NULL,
+			                               &data[i]));
+		scheduler_pool_stats(s, &stats);
+		EXPECT_EQ(n, stats.in_use);
+
+		scheduler_run(s);
+		scheduler_run(s);
+		for (int i = 0; i < n; i++)
+			expect_data(data[i], 0, 1, 0, 0, 0);
+		scheduler_pool_stats(s, &stats);
+		EXPECT_EQ(0, stats.in_use);
+		EXPECT_EQ(1, stats.slabs);
+
+		// Slots are reused rather than growing the pool
+		for (int i = 0; i < n; i++)
+			scheduler_start(s, task_new_in(s, NULL, run, NULL, NULL, NULL,
+			                               &data[i]));
+		scheduler_run_parallel(s, 2);
+		scheduler_run_parallel(s, 2);
+		scheduler_pool_stats(s, &stats);
+		EXPECT_EQ(0, stats.in_use);
+		EXPECT_EQ(1, stats.slabs);
+
+		// Left over at free
+		auto t = task_new_in(s, init, run, destroy, interrupt, is_done, &data[0]);
+		scheduler_start(s, t);
+		scheduler_run(s);
+		scheduler_free(s);
+		expect_data(data[0], 1, 3, 1, 1, 2);
+	}
+
+	TEST(SchedulerTest, Batch) {
+		const int n = 10;
+		struct TestStruct data[n];
+		struct task *t[n];
+		for (int i = 0; i < n; i++)
+			t[i] = task_new(init, run, destroy, interrupt, is_done, &data[i]);
+		auto s = scheduler_new();
+
+		scheduler_start_batch(s, t, 0);
+		scheduler_start_batch(s, t, n);
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(STARTING, t[i]->state);
+
+		scheduler_run(s);
+		EXPECT_EQ(n, runq_size(s));
+		struct list_elem *e = list_begin(&s->runq[TASK_PRIORITY_DEFAULT]);
+		for (int i = 0; i < n; i++, e = list_next(e)) {
+			EXPECT_EQ(&t[i]->elem, e);
+			expect_data(data[i], 1, 1, 0, 0, 1);
+		}
+
+		// Stop every other task, including one twice
+		struct task *odd[n / 2 + 1];
+		for (int i = 0; i < n / 2; i++)
+			odd[i] = t[2 * i + 1];
+		odd[n / 2] = t[1];
+		scheduler_stop_batch(s, odd, n / 2 + 1);
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(i % 2 ? INTERRUPTED : RUNNING, t[i]->state);
+
+		scheduler_run(s);
+		scheduler_run(s);
+		EXPECT_EQ(n / 2, runq_size(s));
+		for (int i = 0; i < n; i++) {
+			if (i % 2)
+				expect_data(data[i], 1, 1, 1, 1, 1)
+			else
+				expect_data(data[i], 1, 3, 0, 0, 3)
+		}
+
+		scheduler_free(s);
+		for (int i = 0; i < n; i++)
+			task_free(t[i]);
+	}
+
+	static void *loop_thread(void *a) {
+		scheduler_loop((struct scheduler *)a);
+		return NULL;
+	}
+
+	// Waits up to a second for COUNTER to reach N
+	static bool wait_for(int *counter, int n) {
+		for (int i = 0; i < 1000; i++) {
+			if (__atomic_load_n(counter, __ATOMIC_ACQUIRE) >= n)
+				return true;
+			usleep(1000);
+		}
+		return false;
+	}
+
+	TEST(SchedulerTest, LoopSleepsUntilStart) {
+		struct TestStruct data;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, loop_thread, s);
+		usleep(20 * 1000);
+		EXPECT_TRUE(__atomic_load_n(&s->idle, __ATOMIC_ACQUIRE));
+
+		scheduler_start(s, t);
+		EXPECT_TRUE(wait_for(&data.n_run, 3));
+
+		// Keeps ticking while the task is in the run list, then sleeps again
+		// once it has been stopped and removed
+		scheduler_stop(s, t);
+		EXPECT_TRUE(wait_for(&data.n_destroy, 1));
+		usleep(20 * 1000);
+		EXPECT_TRUE(__atomic_load_n(&s->idle, __ATOMIC_ACQUIRE));
+
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+		EXPECT_EQ(1, data.n_init);
+		EXPECT_EQ(1, data.n_interrupt);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, LoopWakesForTimer) {
+		struct TestStruct data = { .is_one_shot = true };
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, loop_thread, s);
+		uint64_t start = clock_ns();
+		scheduler_start_after(s, t, 30 * 1000000);
+		EXPECT_TRUE(wait_for(&data.n_run, 1));
+		EXPECT_GE(clock_ns() - start, 30 * 1000000);
+		EXPECT_TRUE(wait_for(&data.n_destroy, 1));
+
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	static void break_run(void *a) {
+		scheduler_break((struct scheduler *)a);
+	}
+
+	TEST(SchedulerTest, LoopBreakFromTask) {
+		auto s = scheduler_new();
+		auto t = task_new(NULL, break_run, NULL, NULL, NULL, s);
+
+		scheduler_wakeup(s);
+		scheduler_start(s, t);
+		scheduler_loop(s);
+		EXPECT_EQ(STOPPED, t->state);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	struct FdTestStruct {
+		struct TestStruct counts;
+		int fd;
+	};
+
+	static void fd_run(void *a) {
+		struct FdTestStruct *s = (struct FdTestStruct *)a;
+		char c;
+		if (read(s->fd, &c, 1) == 1)
+			__atomic_add_fetch(&s->counts.n_run, 1, __ATOMIC_RELEASE);
+	}
+
+	TEST(SchedulerTest, FdTask) {
+		int fds[2];
+		ASSERT_EQ(0, pipe(fds));
+		struct FdTestStruct data;
+		data.fd = fds[0];
+		auto t = task_new_fd(fds[0], TASK_FD_READ, init, fd_run, destroy,
+				     interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		// Initialized on the first tick, then parked until readable
+		scheduler_start(s, t);
+		for (int i = 0; i < 3; i++)
+			scheduler_run(s);
+		expect_data(data.counts, 1, 0, 0, 0, 0)
+		EXPECT_TRUE(runq_empty(s));
+		EXPECT_TRUE(t->fd_waiting);
+
+		// Runs once per readiness
+		ASSERT_EQ(1, write(fds[1], "x", 1));
+		scheduler_run(s);
+		expect_data(data.counts, 1, 1, 0, 0, 1)
+		scheduler_run(s);
+		expect_data(data.counts, 1, 1, 0, 0, 1)
+		ASSERT_EQ(2, write(fds[1], "xy", 2));
+		scheduler_run(s);
+		scheduler_run(s);
+		scheduler_run(s);
+		expect_data(data.counts, 1, 3, 0, 0, 3)
+
+		// Stopping a parked task wakes it for the interrupt
+		scheduler_stop(s, t);
+		scheduler_run(s);
+		expect_data(data.counts, 1, 3, 0, 1, 3)
+		scheduler_run(s);
+		expect_data(data.counts, 1, 3, 1, 1, 3)
+		EXPECT_FALSE(t->fd_registered);
+
+		scheduler_free(s);
+		task_free(t);
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	TEST(SchedulerTest, FdTaskAtFree) {
+		int fds[2];
+		ASSERT_EQ(0, pipe(fds));
+		struct FdTestStruct data;
+		data.fd = fds[0];
+		auto t = task_new_fd(fds[0], TASK_FD_READ, init, fd_run, destroy,
+				     interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_TRUE(t->fd_waiting);
+		scheduler_free(s);
+		expect_data(data.counts, 1, 0, 1, 1, 1)
+
+		task_free(t);
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	TEST(SchedulerTest, LoopWakesForFd) {
+		int fds[2];
+		ASSERT_EQ(0, pipe(fds));
+		struct FdTestStruct data;
+		data.fd = fds[0];
+		auto t = task_new_fd(fds[0], TASK_FD_READ, init, fd_run, destroy,
+				     interrupt, is_done, &data);
+		auto s = scheduler_new();
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, loop_thread, s);
+		scheduler_start(s, t);
+		usleep(20 * 1000);
+		EXPECT_TRUE(__atomic_load_n(&s->idle, __ATOMIC_ACQUIRE));
+		EXPECT_EQ(0, __atomic_load_n(&data.counts.n_run, __ATOMIC_ACQUIRE));
+
+		ASSERT_EQ(1, write(fds[1], "x", 1));
+		EXPECT_TRUE(wait_for(&data.counts.n_run, 1));
+
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+		scheduler_free(s);
+		task_free(t);
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	struct IoTestStruct {
+		struct TestStruct counts;
+		struct task *task;
+		int fd;
+		int step = 0;
+		char buf[16];
+		int64_t results[3];
+	};
+
+	// Writes, reads back and then finishes, one request per run
+	static void io_run(void *a) {
+		struct IoTestStruct *s = (struct IoTestStruct *)a;
+		__atomic_add_fetch(&s->counts.n_run, 1, __ATOMIC_RELEASE);
+		if (s->step > 0)
+			s->results[s->step - 1] = task_io_result(s->task);
+		switch (s->step++) {
+		case 0:
+			task_write(s->task, s->fd, "data", 5, 0);
+			break;
+		case 1:
+			memset(s->buf, 0, sizeof(s->buf));
+			task_read(s->task, s->fd, s->buf, sizeof(s->buf), 0);
+			break;
+		}
+	}
+
+	static bool io_is_done(void *a) {
+		struct IoTestStruct *s = (struct IoTestStruct *)a;
+		return s->step >= 3 || s->counts.n_interrupt > 0;
+	}
+
+	TEST(SchedulerTest, IoTask) {
+		char path[] = "/tmp/TestSchedulerXXXXXX";
+		struct IoTestStruct data;
+		data.fd = mkstemp(path);
+		unlink(path);
+		ASSERT_GE(data.fd, 0);
+		auto t = task_new(init, io_run, destroy, interrupt, io_is_done, &data);
+		data.task = t;
+		auto s = scheduler_new();
+		EXPECT_FALSE(s->aio_ready);
+
+		// run is only called again once each request has completed
+		scheduler_start(s, t);
+		for (int i = 0; i < 1000 && data.counts.n_destroy == 0; i++) {
+			scheduler_run(s);
+			EXPECT_EQ(data.step, data.counts.n_run);
+			usleep(100);
+		}
+		EXPECT_TRUE(s->aio_ready);
+		EXPECT_EQ(3, data.counts.n_run);
+		EXPECT_EQ(1, data.counts.n_destroy);
+		EXPECT_EQ(5, data.results[0]);
+		EXPECT_EQ(5, data.results[1]);
+		EXPECT_STREQ("data", data.buf);
+
+		scheduler_free(s);
+		task_free(t);
+		close(data.fd);
+	}
+
+	// Writes in init, then reads back and finishes
+	static void io_init(void *a) {
+		struct IoTestStruct *s = (struct IoTestStruct *)a;
+		__atomic_add_fetch(&s->counts.n_init, 1, __ATOMIC_RELEASE);
+		task_write(s->task, s->fd, "init", 5, 0);
+		s->step = 1;
+	}
+
+	TEST(SchedulerTest, IoFromInit) {
+		char path[] = "/tmp/TestSchedulerXXXXXX";
+		struct IoTestStruct data;
+		data.fd = mkstemp(path);
+		unlink(path);
+		ASSERT_GE(data.fd, 0);
+		auto t = task_new(io_init, io_run, destroy, interrupt, io_is_done,
+				  &data);
+		data.task = t;
+		auto s = scheduler_new();
+
+		// run waits for the write from init, and can queue its own
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_init);
+		EXPECT_EQ(0, data.counts.n_run);
+		for (int i = 0; i < 1000 && data.counts.n_destroy == 0; i++) {
+			scheduler_run(s);
+			usleep(100);
+		}
+		EXPECT_EQ(2, data.counts.n_run);
+		EXPECT_EQ(5, data.results[0]);
+		EXPECT_EQ(5, data.results[1]);
+		EXPECT_STREQ("init", data.buf);
+
+		scheduler_free(s);
+		task_free(t);
+		close(data.fd);
+	}
+
+	TEST(SchedulerTest, IoTaskStop) {
+		int fds[2];
+		ASSERT_EQ(0, pipe(fds));
+		struct IoTestStruct data;
+		data.fd = fds[0];
+		data.step = 1;
+		auto t = task_new(init, io_run, destroy, interrupt, io_is_done, &data);
+		data.task = t;
+		auto s = scheduler_new();
+
+		// The read blocks until the pipe is written to
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_TRUE(t->io_busy);
+		scheduler_stop(s, t);
+		for (int i = 0; i < 5; i++)
+			scheduler_run(s);
+		EXPECT_EQ(0, data.counts.n_interrupt);
+
+		// The interrupt comes once the buffer is no longer in use
+		ASSERT_EQ(1, write(fds[1], "x", 1));
+		for (int i = 0; i < 1000 && data.counts.n_destroy == 0; i++) {
+			scheduler_run(s);
+			usleep(100);
+		}
+		EXPECT_EQ(1, data.counts.n_run);
+		EXPECT_EQ(1, data.counts.n_interrupt);
+		EXPECT_EQ(1, data.counts.n_destroy);
+
+		scheduler_free(s);
+		task_free(t);
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	// Reads one byte at a time from the pipe
+	static void pipe_run(void *a) {
+		struct IoTestStruct *s = (struct IoTestStruct *)a;
+		s->results[0] = task_io_result(s->task);
+		__atomic_add_fetch(&s->counts.n_run, 1, __ATOMIC_RELEASE);
+		task_read(s->task, s->fd, s->buf, 1, UINT64_MAX);
+	}
+
+	TEST(SchedulerTest, LoopWakesForIo) {
+		int fds[2];
+		ASSERT_EQ(0, pipe(fds));
+		struct IoTestStruct data;
+		data.fd = fds[0];
+		auto t = task_new(init, pipe_run, destroy, interrupt, is_done, &data);
+		data.task = t;
+		auto s = scheduler_new();
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, loop_thread, s);
+		scheduler_start(s, t);
+		EXPECT_TRUE(wait_for(&data.counts.n_run, 1));
+		usleep(20 * 1000);
+		EXPECT_TRUE(__atomic_load_n(&s->idle, __ATOMIC_ACQUIRE));
+		EXPECT_EQ(1, __atomic_load_n(&data.counts.n_run, __ATOMIC_ACQUIRE));
+
+		ASSERT_EQ(1, write(fds[1], "x", 1));
+		EXPECT_TRUE(wait_for(&data.counts.n_run, 2));
+		EXPECT_EQ(1, data.results[0]);
+
+		// scheduler_free waits for the read in flight
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+		ASSERT_EQ(1, write(fds[1], "y", 1));
+		scheduler_free(s);
+		task_free(t);
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	TEST(SchedulerTest, LoopIdleAfterIo) {
+		char path[] = "/tmp/TestSchedulerXXXXXX";
+		struct IoTestStruct data;
+		data.fd = mkstemp(path);
+		unlink(path);
+		ASSERT_GE(data.fd, 0);
+		auto t = task_new(init, io_run, destroy, interrupt, io_is_done, &data);
+		data.task = t;
+		auto s = scheduler_new();
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, loop_thread, s);
+		scheduler_start(s, t);
+		EXPECT_TRUE(wait_for(&data.counts.n_destroy, 1));
+
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+
+		// A late signal on the aio eventfd, with nothing left to reap,
+		// wakes the loop once rather than keeping it spinning
+		uint64_t one = 1;
+		struct scheduler_stats before, after;
+		scheduler_get_stats(s, &before);
+		pthread_create(&thread, NULL, loop_thread, s);
+		ASSERT_EQ((ssize_t)sizeof(one),
+			  write(s->aio.event_fd, &one, sizeof(one)));
+		usleep(40 * 1000);
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+		scheduler_get_stats(s, &after);
+		EXPECT_LE(after.ticks - before.ticks, 4);
+		scheduler_free(s);
+		task_free(t);
+		close(data.fd);
+	}
+
+	// Yields three times in the middle of a loop, so run is called once per
+	// tick for four ticks
+	static void coro_body(void *a) {
+		struct TestStruct *s = (struct TestStruct *)a;
+		for (int i = 0; i < 3; i++) {
+			s->n_run++;
+			task_yield();
+		}
+		s->n_run++;
+	}
+
+	TEST(SchedulerTest, CoroTask) {
+		struct TestStruct data;
+		auto t = task_new_coro(init, coro_body, destroy, interrupt, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		for (int i = 1; i <= 4; i++) {
+			scheduler_run(s);
+			expect_data(data, 1, i, 0, 0, 0)
+		}
+		EXPECT_EQ(STOPPED, t->state);
+		scheduler_run(s);
+		expect_data(data, 1, 4, 1, 0, 0)
+		EXPECT_EQ(nullptr, t->coro);
+		EXPECT_EQ(1, s->stacks.nstacks);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, CoroTaskStop) {
+		struct TestStruct data;
+		auto t = task_new_coro(init, coro_body, destroy, interrupt, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+		scheduler_stop(s, t);
+		scheduler_run(s);
+		expect_data(data, 1, 1, 0, 1, 0)
+		scheduler_run(s);
+		expect_data(data, 1, 1, 1, 1, 0)
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, CoroTaskParallel) {
+		const int n = 64;
+		struct TestStruct data[n];
+		struct task *t[n];
+		auto s = scheduler_new();
+
+		for (int i = 0; i < n; i++) {
+			t[i] = task_new_coro(init, coro_body, destroy, interrupt,
+					     &data[i]);
+			scheduler_start(s, t[i]);
+		}
+		for (int i = 0; i < 6; i++)
+			scheduler_run_parallel(s, 4);
+		for (int i = 0; i < n; i++)
+			expect_data(data[i], 1, 4, 1, 0, 0)
+		EXPECT_TRUE(runq_empty(s));
+
+		// Stacks left at scheduler_free are released with their tasks
+		for (int i = 0; i < n; i++) {
+			task_free(t[i]);
+			data[i] = TestStruct();
+			t[i] = task_new_coro(init, coro_body, destroy, interrupt,
+					     &data[i]);
+			scheduler_start(s, t[i]);
+		}
+		scheduler_run_parallel(s, 4);
+		scheduler_free(s);
+		for (int i = 0; i < n; i++) {
+			expect_data(data[i], 1, 1, 1, 1, 0)
+			task_free(t[i]);
+		}
+	}
+
+	struct OrderStruct {
+		std::vector<int> *order;
+		int id;
+	};
+
+	static void order_run(void *a) {
+		struct OrderStruct *s = (struct OrderStruct *)a;
+		s->order->push_back(s->id);
+	}
+
+	TEST(SchedulerTest, Priority) {
+		std::vector<int> order;
+		const int n = 6;
+		// Started lowest priority first
+		unsigned prio[n] = { TASK_PRIORITY_MIN, TASK_PRIORITY_DEFAULT, 3,
+				     TASK_PRIORITY_MAX, TASK_PRIORITY_DEFAULT, 3 };
+		struct OrderStruct data[n];
+		struct task *t[n];
+		auto s = scheduler_new();
+
+		for (int i = 0; i < n; i++) {
+			data[i] = { &order, i };
+			t[i] = task_new(NULL, order_run, NULL, NULL, NULL, &data[i]);
+			task_set_priority(t[i], prio[i]);
+			scheduler_start(s, t[i]);
+		}
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 3, 1, 4, 2, 5, 0 }), order);
+		EXPECT_EQ((1u << TASK_PRIORITY_MIN) | (1u << 3) |
+			  (1u << TASK_PRIORITY_DEFAULT) | (1u << TASK_PRIORITY_MAX),
+			  s->runq_mask);
+
+		// One-shots, so the levels empty out on the next tick
+		scheduler_run(s);
+		EXPECT_EQ(0, s->runq_mask);
+		EXPECT_TRUE(runq_empty(s));
+
+		scheduler_free(s);
+		for (int i = 0; i < n; i++)
+			task_free(t[i]);
+	}
+
+	// A high priority task runs first even when started after bulk work
+	TEST(SchedulerTest, PriorityAfterTimer) {
+		std::vector<int> order;
+		struct OrderStruct bulk = { &order, 0 }, urgent = { &order, 1 };
+		auto b = task_new(NULL, order_run, NULL, NULL, NULL, &bulk);
+		auto u = task_new(NULL, order_run, NULL, NULL, NULL, &urgent);
+		task_set_priority(u, TASK_PRIORITY_MAX);
+		auto s = scheduler_new();
+
+		scheduler_start(s, b);
+		scheduler_start_after(s, u, 1);
+		usleep(2 * SCHEDULER_TIMER_RESOLUTION_NS / 1000);
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 1, 0 }), order);
+
+		scheduler_free(s);
+		task_free(b);
+		task_free(u);
+	}
+
+	struct EdfStruct {
+		std::vector<int> *order;
+		int id;
+		int runs;
+		uint64_t next[2]; // deadlines to set for the next two ticks
+		struct task *task;
+	};
+
+	static void edf_run(void *a) {
+		struct EdfStruct *s = (struct EdfStruct *)a;
+		s->order->push_back(s->id);
+		if (s->runs < 2)
+			task_set_deadline(s->task, s->next[s->runs]);
+		s->runs++;
+	}
+
+	static bool edf_done(void *a) {
+		return ((struct EdfStruct *)a)->runs >= 3;
+	}
+
+	static void edf_interrupt(void *a) {
+		((struct EdfStruct *)a)->runs = 3;
+	}
+
+	TEST(SchedulerTest, EdfOrder) {
+		std::vector<int> order;
+		const int n = 4;
+		// Deadlines far enough out to all be met
+		uint64_t base = clock_ns() + 60 * 1000000000ull;
+		uint64_t first[n] = { base + 3, TASK_NO_DEADLINE, base + 1, base + 3 };
+		struct EdfStruct data[n] = {
+			{ &order, 0, 0, { base + 1, base + 2 }, NULL },
+			{ &order, 1, 0, { base, TASK_NO_DEADLINE }, NULL },
+			{ &order, 2, 0, { base + 2, base }, NULL },
+			{ &order, 3, 0, { TASK_NO_DEADLINE, base + 1 }, NULL },
+		};
+		auto s = scheduler_new_policy(SCHEDULER_EDF);
+
+		for (int i = 0; i < n; i++) {
+			data[i].task = task_new(NULL, edf_run, NULL, edf_interrupt,
+						edf_done, &data[i]);
+			task_set_deadline(data[i].task, first[i]);
+			// Priorities are ignored under EDF
+			task_set_priority(data[i].task, TASK_PRIORITY_MAX - i);
+			scheduler_start(s, data[i].task);
+		}
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 2, 0, 3, 1 }), order);
+		order.clear();
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 1, 0, 2, 3 }), order);
+		order.clear();
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 2, 3, 0, 1 }), order);
+		EXPECT_EQ(0, s->runq_mask);
+
+		struct scheduler_deadline_stats stats;
+		scheduler_deadline_stats(s, &stats);
+		EXPECT_EQ(9, stats.met);
+		EXPECT_EQ(0, stats.missed);
+
+		// Done, and removed
+		scheduler_run(s);
+		EXPECT_TRUE(heap_empty(&s->edf));
+
+		scheduler_free(s);
+		for (int i = 0; i < n; i++)
+			task_free(data[i].task);
+	}
+
+	// Deadlines are counted under the default policy too
+	TEST(SchedulerTest, DeadlineStats) {
+		std::vector<int> order;
+		struct OrderStruct late = { &order, 0 }, early = { &order, 1 };
+		auto l = task_new(NULL, order_run, NULL, NULL, NULL, &late);
+		auto e = task_new(NULL, order_run, NULL, NULL, NULL, &early);
+		auto s = scheduler_new();
+
+		task_set_deadline(l, 1);
+		task_set_deadline(e, clock_ns() + 60 * 1000000000ull);
+		scheduler_start(s, l);
+		scheduler_start(s, e);
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 0, 1 }), order);
+
+		struct scheduler_deadline_stats stats;
+		scheduler_deadline_stats(s, &stats);
+		EXPECT_EQ(1, stats.met);
+		EXPECT_EQ(1, stats.missed);
+
+		scheduler_free(s);
+		task_free(l);
+		task_free(e);
+	}
+
+	static void sleepy_run(void *a) {
+		struct TestStruct *s = (struct TestStruct *)a;
+		s->n_run++;
+		usleep(s->n_run == 2 ? 3000 : 1000);
+	}
+
+	TEST(SchedulerTest, Stats) {
+		struct TestStruct slow, fast;
+		auto t = task_new(init, sleepy_run, destroy, interrupt, is_done, &slow);
+		auto f = task_new(init, run, destroy, interrupt, is_done, &fast);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_start_after(s, f, 10 * 1000000);
+		for (int i = 0; i < 3; i++)
+			scheduler_run(s);
+		EXPECT_EQ(0, fast.n_run);
+
+		struct task_stats ts;
+		EXPECT_TRUE(task_get_stats(t, &ts));
+		EXPECT_EQ(3, ts.runs);
+		EXPECT_GE(ts.run_ns, 5 * 1000000);
+		EXPECT_GE(ts.max_run_ns, 3 * 1000000);
+		EXPECT_LT(ts.max_run_ns, ts.run_ns);
+		EXPECT_LT(ts.start_wait_ns, 1000000);
+
+		// The delay does not count as waiting, only the lateness
+		usleep(8 * 1000);
+		scheduler_run(s);
+		EXPECT_TRUE(task_get_stats(f, &ts));
+		EXPECT_EQ(1, ts.runs);
+		EXPECT_GE(ts.start_wait_ns, 1000000);
+		EXPECT_LT(ts.start_wait_ns, 10 * 1000000);
+
+		struct scheduler_stats ss;
+		EXPECT_TRUE(scheduler_get_stats(s, &ss));
+		EXPECT_EQ(4, ss.ticks);
+		EXPECT_EQ(5, ss.tasks_run);
+		EXPECT_EQ(2, ss.max_tasks_per_tick);
+		EXPECT_GE(ss.tick_ns, 6 * 1000000);
+		EXPECT_GE(ss.max_tick_ns, 3 * 1000000);
+		EXPECT_EQ(0, ss.lock_wait_ns);
+
+		// Parallel ticks count too
+		scheduler_run_parallel(s, 2);
+		EXPECT_TRUE(scheduler_get_stats(s, &ss));
+		EXPECT_EQ(5, ss.ticks);
+		EXPECT_EQ(7, ss.tasks_run);
+		EXPECT_GT(ss.lock_wait_ns, 0);
+
+		scheduler_free(s);
+		task_free(t);
+		task_free(f);
+	}
+
+	TEST(SchedulerTest, Histograms) {
+		struct TestStruct slow, fast;
+		auto t = task_new(init, sleepy_run, destroy, interrupt, is_done,
+				  &slow);
+		auto f = task_new(init, run, destroy, interrupt, is_done, &fast);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_start(s, f);
+		for (int i = 0; i < 3; i++)
+			scheduler_run(s);
+
+		struct hist h;
+		EXPECT_TRUE(scheduler_get_hist(s, SCHEDULER_HIST_TICK, &h, false));
+		EXPECT_EQ(3, hist_count(&h));
+		EXPECT_GE(hist_quantile(&h, 1), 3 * 1000000);
+		EXPECT_LT(hist_quantile(&h, 0), 3 * 1000000);
+
+		// The sleepy task's middle run is the slowest, the other task's
+		// the fastest
+		EXPECT_TRUE(scheduler_get_hist(s, SCHEDULER_HIST_RUN, &h, true));
+		EXPECT_EQ(6, hist_count(&h));
+		EXPECT_GE(hist_quantile(&h, 1), 3 * 1000000);
+		EXPECT_LT(hist_quantile(&h, 0.5), 1000000);
+		EXPECT_GE(hist_quantile(&h, 0.99), 3 * 1000000);
+		EXPECT_TRUE(scheduler_get_hist(s, SCHEDULER_HIST_RUN, &h, false));
+		EXPECT_EQ(0, hist_count(&h));
+
+		// One per task; the second one waited behind the first's run
+		EXPECT_TRUE(scheduler_get_hist(s, SCHEDULER_HIST_START, &h, false));
+		EXPECT_EQ(2, hist_count(&h));
+		EXPECT_GE(hist_quantile(&h, 1), 1000000);
+
+		scheduler_run_parallel(s, 2);
+		EXPECT_TRUE(scheduler_get_hist(s, SCHEDULER_HIST_RUN, &h, false));
+		EXPECT_EQ(2, hist_count(&h));
+
+		scheduler_free(s);
+		task_free(t);
+		task_free(f);
+	}
+
+	TEST(SchedulerTest, Trace) {
+		struct TestStruct data;
+		data.is_one_shot = true;
+		auto t = task_new(init, run, destroy, interrupt, is_done, &data);
+		auto s = scheduler_new();
+		char path[] = "/tmp/scheduler_trace_XXXXXX";
+		int fd = mkstemp(path);
+		ASSERT_GE(fd, 0);
+		close(fd);
+
+		// Off by default
+		scheduler_run(s);
+		scheduler_trace(s, true);
+		scheduler_start(s, t);
+		scheduler_run(s);
+		scheduler_run(s);
+		scheduler_trace(s, false);
+		scheduler_run(s);
+		EXPECT_TRUE(scheduler_trace_dump(s, path));
+
+		FILE *f = fopen(path, "r");
+		std::string json;
+		char buf[4096];
+		size_t len;
+		while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+			json.append(buf, len);
+		fclose(f);
+		unlink(path);
+
+		auto count = [&](const std::string &what) {
+			size_t n = 0;
+			for (size_t at = json.find(what); at != std::string::npos;
+			     at = json.find(what, at + 1))
+				n++;
+			return n;
+		};
+		EXPECT_EQ(2, count("\"name\":\"tick\""));
+		EXPECT_EQ(1, count("\"name\":\"init\""));
+		EXPECT_EQ(1, count("\"name\":\"run\""));
+		EXPECT_EQ(1, count("\"name\":\"destroy\""));
+		EXPECT_EQ(1, count("\"state\":\"RUNNING\""));
+		EXPECT_EQ(1, count("\"state\":\"STOPPED\""));
+		snprintf(buf, sizeof(buf), "\"fn\":\"%p\"", (void *)run);
+		EXPECT_EQ(1, count(buf));
+		EXPECT_FALSE(scheduler_trace_dump(s, "/nonexistent/trace.json"));
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	static void sleepy_destroy(void *a) {
+		struct TestStruct *s = (struct TestStruct *)a;
+		usleep(20 * 1000);
+		s->n_destroy++;
+	}
+
+	TEST(SchedulerTest, Reaper) {
+		struct TestStruct data[4];
+		auto s = scheduler_new();
+		ASSERT_TRUE(scheduler_reaper(s, true));
+		EXPECT_TRUE(scheduler_reaper(s, true));
+
+		for (auto &d : data)
+			d.is_one_shot = true;
+		auto t = task_new(init, run, sleepy_destroy, interrupt, is_done,
+				  &data[0]);
+		scheduler_start(s, t);
+		scheduler_start(s, task_new_in(s, init, run, sleepy_destroy,
+					       interrupt, is_done, &data[1]));
+		scheduler_start(s, task_new_in(s, init, run, sleepy_destroy,
+					       interrupt, is_done, &data[2]));
+		scheduler_run(s);
+
+		// The destroys happen on the reaper, not in the tick
+		uint64_t start = clock_ns();
+		scheduler_run(s);
+		EXPECT_LT(clock_ns() - start, 20 * 1000000);
+		EXPECT_TRUE(runq_empty(s));
+
+		// Turning it off waits for them
+		EXPECT_TRUE(scheduler_reaper(s, false));
+		for (int i = 0; i < 3; i++)
+			EXPECT_EQ(1, data[i].n_destroy);
+
+		// Parallel ticks, and tasks still there at scheduler_free
+		EXPECT_TRUE(scheduler_reaper(s, true));
+		scheduler_start(s, t);
+		scheduler_run_parallel(s, 2);
+		start = clock_ns();
+		scheduler_run_parallel(s, 2);
+		EXPECT_LT(clock_ns() - start, 20 * 1000000);
+		data[3].is_one_shot = false;
+		scheduler_start(s, task_new_in(s, init, run, sleepy_destroy,
+					       interrupt, is_done, &data[3]));
+		scheduler_run(s);
+
+		scheduler_free(s);
+		EXPECT_EQ(2, data[0].n_destroy);
+		EXPECT_EQ(1, data[3].n_destroy);
+		EXPECT_EQ(1, data[3].n_interrupt);
+		task_free(t);
+	}
+
+	struct StageStruct {
+		std::vector<int> *order;
+		int id;
+	};
+
+	static void stage_run(void *a) {
+		struct StageStruct *s = (struct StageStruct *)a;
+		s->order->push_back(s->id);
+	}
+
+	TEST(SchedulerTest, DependsOn) {
+		const int n = 12;
+		std::vector<int> order;
+		struct StageStruct stages[n];
+		struct task *tasks[n];
+		auto s = scheduler_new();
+
+		// A chain, started back to front, runs front to back in one tick
+		for (int i = 0; i < n; i++) {
+			stages[i] = { &order, i };
+			tasks[i] = task_new(NULL, stage_run, NULL, NULL, NULL,
+					    &stages[i]);
+			if (i > 0)
+				ASSERT_TRUE(task_depends_on(tasks[i], tasks[i - 1]));
+		}
+		task_set_priority(tasks[n - 1], TASK_PRIORITY_MIN);
+		for (int i = n - 1; i >= 0; i--)
+			scheduler_start(s, tasks[i]);
+		scheduler_run(s);
+		ASSERT_EQ(n, (int)order.size());
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(i, order[i]);
+		scheduler_run(s);
+		EXPECT_TRUE(runq_empty(s));
+		for (auto t : tasks)
+			task_free(t);
+
+		// A fan-in join waits for the last of its parents, stopped ones
+		// included
+		struct TestStruct a, b;
+		b.is_one_shot = true;
+		auto pa = task_new(init, run, destroy, interrupt, is_done, &a);
+		auto pb = task_new(init, run, destroy, interrupt, is_done, &b);
+		order.clear();
+		stages[0] = { &order, 0 };
+		auto join = task_new(NULL, stage_run, NULL, NULL, NULL, &stages[0]);
+		ASSERT_TRUE(task_depends_on(join, pa));
+		ASSERT_TRUE(task_depends_on(join, pb));
+		scheduler_start(s, join);
+		scheduler_start(s, pa);
+		scheduler_start(s, pb);
+		scheduler_run(s);
+		scheduler_run(s);
+		EXPECT_TRUE(order.empty());
+		scheduler_stop(s, pa);
+		scheduler_run(s);
+		EXPECT_EQ(1, a.n_interrupt);
+		EXPECT_EQ(1u, order.size());
+
+		// A dependent still blocked at scheduler_free is not initialized
+		struct TestStruct c, d;
+		auto pc = task_new(init, run, destroy, interrupt, is_done, &c);
+		auto pd = task_new(init, run, destroy, interrupt, is_done, &d);
+		ASSERT_TRUE(task_depends_on(pd, pc));
+		scheduler_start(s, pc);
+		scheduler_start(s, pd);
+		scheduler_run(s);
+		scheduler_free(s);
+		EXPECT_EQ(1, c.n_destroy);
+		EXPECT_EQ(0, d.n_init);
+		EXPECT_EQ(0, d.n_destroy);
+		for (auto t : { pa, pb, join, pc, pd })
+			task_free(t);
+	}
+
+	struct WriteThenRead {
+		struct task *writer;
+		int fd;
+		int writer_runs = 0;
+		int reader_runs = 0;
+		char buf[8];
+		ssize_t read;
+	};
+
+	static void write_run(void *a) {
+		struct WriteThenRead *s = (struct WriteThenRead *)a;
+		s->writer_runs++;
+		task_write(s->writer, s->fd, "data", 5, 0);
+	}
+
+	static void read_run(void *a) {
+		struct WriteThenRead *s = (struct WriteThenRead *)a;
+		s->reader_runs++;
+		s->read = pread(s->fd, s->buf, sizeof(s->buf), 0);
+	}
+
+	TEST(SchedulerTest, DependsOnIo) {
+		char path[] = "/tmp/TestSchedulerXXXXXX";
+		struct WriteThenRead data;
+		data.fd = mkstemp(path);
+		unlink(path);
+		ASSERT_GE(data.fd, 0);
+		auto w = task_new(NULL, write_run, NULL, NULL, NULL, &data);
+		auto r = task_new(NULL, read_run, NULL, NULL, NULL, &data);
+		data.writer = w;
+		ASSERT_TRUE(task_depends_on(r, w));
+		auto s = scheduler_new();
+
+		// The one-shot writer stops in its run, but the reader waits
+		// for the write itself
+		scheduler_start(s, w);
+		scheduler_start(s, r);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.writer_runs);
+		EXPECT_EQ(0, data.reader_runs);
+		for (int i = 0; i < 1000 && data.reader_runs == 0; i++) {
+			usleep(100);
+			scheduler_run(s);
+		}
+		EXPECT_EQ(1, data.reader_runs);
+		EXPECT_EQ(5, data.read);
+		EXPECT_STREQ("data", data.buf);
+
+		scheduler_free(s);
+		task_free(w);
+		task_free(r);
+		close(data.fd);
+	}
+
+	TEST(SchedulerTest, DependsOnIoFailed) {
+		char path[] = "/tmp/TestSchedulerXXXXXX";
+		struct WriteThenRead data;
+		data.fd = mkstemp(path);
+		unlink(path);
+		ASSERT_GE(data.fd, 0);
+		auto w = task_new(NULL, write_run, NULL, NULL, NULL, &data);
+		auto r = task_new(NULL, read_run, NULL, NULL, NULL, &data);
+		data.writer = w;
+		ASSERT_TRUE(task_depends_on(r, w));
+		auto s = scheduler_new();
+
+		// Out of fds, setting up aio fails on the writer's request
+		struct rlimit old, low;
+		ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &old));
+		int next = dup(0);
+		ASSERT_GE(next, 0);
+		close(next);
+		low = old;
+		low.rlim_cur = next;
+		ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &low));
+
+		// The failed write is as done as a completed one
+		scheduler_start(s, w);
+		scheduler_start(s, r);
+		scheduler_run(s);
+		scheduler_run(s);
+		EXPECT_EQ(0, setrlimit(RLIMIT_NOFILE, &old));
+		EXPECT_FALSE(s->aio_ready);
+		EXPECT_EQ(-ENOMEM, task_io_result(w));
+		EXPECT_EQ(1, data.writer_runs);
+		EXPECT_EQ(1, data.reader_runs);
+		EXPECT_EQ(0, data.read);
+
+		scheduler_free(s);
+		task_free(w);
+		task_free(r);
+		close(data.fd);
+	}
+
+	TEST(SchedulerTest, DependsOnEdfParallel) {
+		std::vector<int> order;
+		struct StageStruct stages[3];
+		struct task *tasks[3];
+		auto s = scheduler_new_policy(SCHEDULER_EDF);
+
+		for (int i = 0; i < 3; i++) {
+			stages[i] = { &order, i };
+			tasks[i] = task_new(NULL, stage_run, NULL, NULL, NULL,
+					    &stages[i]);
+			if (i > 0)
+				ASSERT_TRUE(task_depends_on(tasks[i], tasks[i - 1]));
+		}
+		for (int i = 2; i >= 0; i--)
+			scheduler_start(s, tasks[i]);
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 0, 1, 2 }), order);
+		scheduler_free(s);
+		for (auto t : tasks)
+			task_free(t);
+
+		// Parallel ticks release dependents for the next one
+		order.clear();
+		s = scheduler_new();
+		for (int i = 0; i < 2; i++) {
+			tasks[i] = task_new(NULL, stage_run, NULL, NULL, NULL,
+					    &stages[i]);
+		}
+		ASSERT_TRUE(task_depends_on(tasks[1], tasks[0]));
+		scheduler_start(s, tasks[1]);
+		scheduler_start(s, tasks[0]);
+		scheduler_run_parallel(s, 2);
+		EXPECT_EQ((std::vector<int>{ 0 }), order);
+		scheduler_run_parallel(s, 2);
+		EXPECT_EQ((std::vector<int>{ 0, 1 }), order);
+		scheduler_free(s);
+		task_free(tasks[0]);
+		task_free(tasks[1]);
+	}
+
+	TEST(SchedulerTest, EdfParallel) {
+		std::vector<int> order[64];
+		const int n = 64;
+		uint64_t base = clock_ns() + 60 * 1000000000ull;
+		struct EdfStruct data[n];
+		auto s = scheduler_new_policy(SCHEDULER_EDF);
+
+		for (int i = 0; i < n; i++) {
+			data[i] = { &order[i], i, 0,
+				    { base + n - i, base + i }, NULL };
+			data[i].task = task_new(NULL, edf_run, NULL, edf_interrupt,
+						edf_done, &data[i]);
+			task_set_deadline(data[i].task, base + i);
+			scheduler_start(s, data[i].task);
+		}
+		for (int i = 0; i < 4; i++)
+			scheduler_run_parallel(s, 4);
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(3, data[i].runs);
+		EXPECT_TRUE(heap_empty(&s->edf));
+
+		struct scheduler_deadline_stats stats;
+		scheduler_deadline_stats(s, &stats);
+		EXPECT_EQ(3 * n, stats.met);
+
+		scheduler_free(s);
+		for (int i = 0; i < n; i++)
+			task_free(data[i].task);
+	}
+
+	static void order_forever_run(void *a) {
+		order_run(a);
+	}
+
+	static bool order_never_done(void *a) {
+		(void)a;
+		return false;
+	}
+
+	static void order_interrupt(void *a) {
+		(void)a;
+	}
+
+	TEST(SchedulerTest, RunFor) {
+		std::vector<int> order;
+		const int n = 3;
+		struct OrderStruct data[n + 1];
+		struct task *t[n + 1];
+		auto s = scheduler_new();
+
+		for (int i = 0; i <= n; i++) {
+			data[i] = { &order, i };
+			t[i] = task_new(NULL, order_forever_run, NULL, order_interrupt,
+					order_never_done, &data[i]);
+			if (i < n)
+				scheduler_start(s, t[i]);
+		}
+
+		// A spent budget still runs one task, and the next tick picks up
+		// after it
+		for (int i = 0; i < 2 * n; i++)
+			EXPECT_FALSE(scheduler_run_for(s, 0));
+		EXPECT_EQ((std::vector<int>{ 0, 1, 2, 0, 1, 2 }), order);
+
+		order.clear();
+		EXPECT_FALSE(scheduler_run_for(s, 0));
+		EXPECT_TRUE(scheduler_run_for(s, 60 * 1000000000ull));
+		EXPECT_EQ((std::vector<int>{ 0, 1, 2, 0 }), order);
+
+		// Higher priority tasks are still visited first
+		order.clear();
+		task_set_priority(t[n], TASK_PRIORITY_MAX);
+		scheduler_start(s, t[n]);
+		EXPECT_FALSE(scheduler_run_for(s, 0));
+		EXPECT_FALSE(scheduler_run_for(s, 0));
+		EXPECT_EQ((std::vector<int>{ 3, 3 }), order);
+
+		for (int i = 0; i <= n; i++)
+			scheduler_stop(s, t[i]);
+		while (!runq_empty(s))
+			scheduler_run(s);
+		scheduler_free(s);
+		for (int i = 0; i <= n; i++)
+			task_free(t[i]);
+	}
+
+	TEST(SchedulerTest, RunForEdf) {
+		std::vector<int> order;
+		const int n = 3;
+		struct OrderStruct data[n];
+		struct task *t[n];
+		auto s = scheduler_new_policy(SCHEDULER_EDF);
+
+		for (int i = 0; i < n; i++) {
+			data[i] = { &order, i };
+			t[i] = task_new(NULL, order_forever_run, NULL, order_interrupt,
+					order_never_done, &data[i]);
+			scheduler_start(s, t[i]);
+		}
+		// Without deadlines, skipped tasks go first as under FIFO
+		for (int i = 0; i < 2 * n; i++)
+			scheduler_run_for(s, 0);
+		EXPECT_EQ((std::vector<int>{ 0, 1, 2, 0, 1, 2 }), order);
+
+		for (int i = 0; i < n; i++)
+			scheduler_stop(s, t[i]);
+		while (!heap_empty(&s->edf))
+			scheduler_run(s);
+		scheduler_free(s);
+		for (int i = 0; i < n; i++)
+			task_free(t[i]);
+	}
+
+	struct StepTestStruct {
+		struct TestStruct counts;
+		std::vector<enum task_status> script;
+		uint64_t wake_ns = 0;
+	};
+
+	// Returns the next status from the script
+	static enum task_status scripted_step(void *a, uint64_t *wake_ns) {
+		struct StepTestStruct *s = (struct StepTestStruct *)a;
+		enum task_status status = s->script[s->counts.n_run++];
+		if (status == TASK_SLEEP_UNTIL)
+			*wake_ns = s->wake_ns;
+		return status;
+	}
+
+	TEST(SchedulerTest, StepTask) {
+		struct StepTestStruct data;
+		data.script = { TASK_CONTINUE, TASK_CONTINUE, TASK_DONE };
+		auto t = task_new_step(init, scripted_step, destroy, interrupt, &data);
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		for (int i = 1; i <= 3; i++) {
+			scheduler_run(s);
+			EXPECT_EQ(i, data.counts.n_run);
+		}
+		EXPECT_EQ(STOPPED, t->state);
+		scheduler_run(s);
+		EXPECT_TRUE(runq_empty(s));
+		EXPECT_EQ(1, data.counts.n_init);
+		EXPECT_EQ(1, data.counts.n_destroy);
+		EXPECT_EQ(0, data.counts.n_interrupt);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, StepTaskSleep) {
+		struct StepTestStruct data;
+		data.script = { TASK_SLEEP_UNTIL, TASK_SLEEP_UNTIL, TASK_CONTINUE };
+		auto t = task_new_step(init, scripted_step, destroy, interrupt, &data);
+		auto s = scheduler_new();
+
+		// Sleeps out of the run list until it is due
+		uint64_t start = clock_ns();
+		data.wake_ns = start + 20 * 1000000;
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_run);
+		EXPECT_TRUE(runq_empty(s));
+		while (data.counts.n_run == 1)
+			scheduler_run(s);
+		EXPECT_GE(clock_ns(), data.wake_ns);
+
+		// A time that has passed only waits for the next tick
+		EXPECT_EQ(2, data.counts.n_run);
+		EXPECT_EQ(1, runq_size(s));
+		scheduler_run(s);
+		EXPECT_EQ(3, data.counts.n_run);
+
+		scheduler_stop(s, t);
+		scheduler_run(s);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_interrupt);
+		EXPECT_EQ(1, data.counts.n_destroy);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	static enum task_status io_step(void *a, uint64_t *wake_ns) {
+		(void)wake_ns;
+		io_run(a);
+		return io_is_done(a) ? TASK_DONE : TASK_WAIT;
+	}
+
+	TEST(SchedulerTest, StepTaskWait) {
+		char path[] = "/tmp/TestSchedulerXXXXXX";
+		struct IoTestStruct data;
+		data.fd = mkstemp(path);
+		unlink(path);
+		ASSERT_GE(data.fd, 0);
+		auto t = task_new_step(init, io_step, destroy, interrupt, &data);
+		data.task = t;
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		for (int i = 0; i < 1000 && data.counts.n_destroy == 0; i++) {
+			scheduler_run(s);
+			EXPECT_EQ(data.step, data.counts.n_run);
+			usleep(100);
+		}
+		EXPECT_EQ(3, data.counts.n_run);
+		EXPECT_EQ(1, data.counts.n_destroy);
+		EXPECT_STREQ("data", data.buf);
+
+		scheduler_free(s);
+		task_free(t);
+		close(data.fd);
+	}
+
+	struct ParkTestStruct {
+		struct TestStruct counts;
+		struct task *task;
+		bool unpark_first = false;
+	};
+
+	static void park_run(void *a) {
+		struct ParkTestStruct *s = (struct ParkTestStruct *)a;
+		__atomic_add_fetch(&s->counts.n_run, 1, __ATOMIC_RELEASE);
+		task_park(s->task);
+		if (s->unpark_first)
+			task_unpark(s->task);
+	}
+
+	TEST(SchedulerTest, Park) {
+		struct ParkTestStruct data;
+		auto t = task_new(init, park_run, destroy, interrupt, is_done, &data);
+		data.task = t;
+		auto s = scheduler_new();
+
+		// Parked tasks are not visited
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_run);
+		EXPECT_TRUE(runq_empty(s));
+		EXPECT_EQ(1, list_size(&s->parked));
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_run);
+		EXPECT_EQ(1, data.counts.n_is_done);
+
+		task_unpark(t);
+		scheduler_run(s);
+		EXPECT_EQ(2, data.counts.n_run);
+		EXPECT_EQ(1, list_size(&s->parked));
+
+		// An unpark before the park takes effect cancels it
+		data.unpark_first = true;
+		task_unpark(t);
+		scheduler_run(s);
+		EXPECT_EQ(3, data.counts.n_run);
+		EXPECT_EQ(1, runq_size(s));
+		scheduler_run(s);
+		EXPECT_EQ(4, data.counts.n_run);
+
+		// Stopping a parked task wakes it for its interrupt
+		data.unpark_first = false;
+		scheduler_run(s);
+		EXPECT_EQ(1, list_size(&s->parked));
+		scheduler_stop(s, t);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_interrupt);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_destroy);
+		EXPECT_TRUE(runq_empty(s));
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, LoopWakesForUnpark) {
+		struct ParkTestStruct data;
+		auto t = task_new(init, park_run, destroy, interrupt, is_done, &data);
+		data.task = t;
+		auto s = scheduler_new();
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, loop_thread, s);
+		scheduler_start(s, t);
+		EXPECT_TRUE(wait_for(&data.counts.n_run, 1));
+		usleep(20 * 1000);
+		EXPECT_EQ(1, __atomic_load_n(&data.counts.n_run, __ATOMIC_ACQUIRE));
+		task_unpark(t);
+		EXPECT_TRUE(wait_for(&data.counts.n_run, 2));
+
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	struct SleepTestStruct {
+		struct TestStruct counts;
+		struct task *task;
+		uint64_t wake_ns;
+	};
+
+	static void sleep_run(void *a) {
+		struct SleepTestStruct *s = (struct SleepTestStruct *)a;
+		s->counts.n_run++;
+		task_sleep_until(s->task, s->wake_ns);
+	}
+
+	TEST(SchedulerTest, SleepUntil) {
+		struct SleepTestStruct data;
+		auto t = task_new(init, sleep_run, destroy, interrupt, is_done,
+				  &data);
+		data.task = t;
+		data.wake_ns = clock_ns() + 20 * 1000000;
+		auto s = scheduler_new();
+
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_run);
+		EXPECT_TRUE(runq_empty(s));
+		while (data.counts.n_run == 1)
+			scheduler_run(s);
+		EXPECT_GE(clock_ns(), data.wake_ns);
+		EXPECT_EQ(2, data.counts.n_is_done);
+
+		// A stop wakes it early
+		data.wake_ns = clock_ns() + 60 * 1000000000ull;
+		scheduler_run(s);
+		EXPECT_TRUE(runq_empty(s));
+		scheduler_stop(s, t);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.counts.n_interrupt);
+
+		scheduler_free(s);
+		task_free(t);
+	}
+
+	TEST(SchedulerTest, TableTasks) {
+		std::vector<int> order;
+		struct OrderStruct linked = { &order, 0 }, dense = { &order, 1 };
+		struct TestStruct data;
+		auto t = task_new(NULL, order_run, NULL, NULL, NULL, &linked);
+		auto s = scheduler_new();
+
+		// Table tasks run after the linked ones
+		scheduler_add(s, NULL, order_run, NULL, NULL, NULL, &dense);
+		task_id_t id = scheduler_add(s, init, run, destroy, interrupt,
+					     is_done, &data);
+		EXPECT_NE(TASK_ID_NONE, id);
+		scheduler_start(s, t);
+		scheduler_run(s);
+		EXPECT_EQ((std::vector<int>{ 0, 1 }), order);
+		EXPECT_EQ(1, data.n_init);
+		EXPECT_EQ(1, data.n_run);
+
+		EXPECT_TRUE(scheduler_stop_id(s, id));
+		scheduler_run(s);
+		EXPECT_EQ(1, data.n_interrupt);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.n_destroy);
+		EXPECT_EQ(0, task_table_size(&s->table));
+
+		// Left over at free, as for linked tasks
+		struct TestStruct left;
+		scheduler_add(s, init, run, destroy, interrupt, is_done, &left);
+		scheduler_run(s);
+		scheduler_free(s);
+		EXPECT_EQ(1, left.n_interrupt);
+		EXPECT_EQ(1, left.n_destroy);
+		task_free(t);
+	}
+
+	// Waiting table tasks sleep through ticks until readied, even from
+	// another thread while the loop is idle
+	TEST(SchedulerTest, WaitingTableTask) {
+		struct TestStruct data;
+		auto s = scheduler_new();
+
+		task_id_t id = scheduler_add_waiting(s, init, run, destroy,
+						     interrupt, is_done, &data);
+		scheduler_run(s);
+		scheduler_run(s);
+		EXPECT_EQ(1, data.n_init);
+		EXPECT_EQ(1, data.n_run);
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, loop_thread, s);
+		usleep(20 * 1000);
+		EXPECT_EQ(1, __atomic_load_n(&data.n_run, __ATOMIC_ACQUIRE));
+		EXPECT_TRUE(scheduler_ready(s, id));
+		EXPECT_TRUE(wait_for(&data.n_run, 2));
+		EXPECT_TRUE(scheduler_stop_id(s, id));
+		EXPECT_TRUE(wait_for(&data.n_destroy, 1));
+		EXPECT_FALSE(scheduler_ready(s, id));
+
+		scheduler_break(s);
+		pthread_join(thread, NULL);
+		EXPECT_EQ(1, data.n_interrupt);
+		EXPECT_EQ(0, task_table_size(&s->table));
+		scheduler_free(s);
+	}
+
 	// mutli thread safety
 }
@@ -0,0 +1,119 @@
+#include "gtest/gtest.h"
+#include <pthread.h>
+#include <set>
+#include <vector>
+
+extern "C" {
+
+#include "../slab.h"
+
+	struct Obj {
+		int a[25];
+	};
+}
+
+namespace {
+	TEST(SlabTest, Init) {
+		struct slab_pool pool;
+		struct slab_stats stats;
+		slab_init(&pool, sizeof(struct Obj));
+		EXPECT_EQ(128, pool.obj_size);
+
+		slab_stats(&pool, &stats);
+		EXPECT_EQ(0, stats.slabs);
+		EXPECT_EQ(0, stats.free);
+		EXPECT_EQ(0, stats.in_use);
+		slab_destroy(&pool);
+	}
+
+	TEST(SlabTest, AllocFree) {
+		struct slab_pool pool;
+		struct slab_stats stats;
+		slab_init(&pool, sizeof(struct Obj));
+
+		void *a = slab_alloc(&pool);
+		void *b = slab_alloc(&pool);
+		EXPECT_NE(nullptr, a);
+		EXPECT_NE(nullptr, b);
+		EXPECT_NE(a, b);
+		EXPECT_EQ(0, (uintptr_t)a % SLAB_CACHE_LINE);
+		EXPECT_EQ(0, (uintptr_t)b % SLAB_CACHE_LINE);
+
+		slab_stats(&pool, &stats);
+		EXPECT_EQ(1, stats.slabs);
+		EXPECT_EQ(pool.per_slab - 2, stats.free);
+		EXPECT_EQ(2, stats.in_use);
+
+		// Freed objects are reused first
+		slab_free(&pool, a);
+		EXPECT_EQ(a, slab_alloc(&pool));
+		slab_free(&pool, a);
+		slab_free(&pool, b);
+		slab_free(&pool, NULL);
+
+		slab_stats(&pool, &stats);
+		EXPECT_EQ(pool.per_slab, stats.free);
+		EXPECT_EQ(0, stats.in_use);
+		slab_destroy(&pool);
+	}
+
+	TEST(SlabTest, Grow) {
+		struct slab_pool pool;
+		struct slab_stats stats;
+		slab_init(&pool, sizeof(struct Obj));
+
+		std::set<void *> objs;
+		for (size_t i = 0; i < pool.per_slab * 3 + 1; i++)
+			objs.insert(slab_alloc(&pool));
+		EXPECT_EQ(pool.per_slab * 3 + 1, objs.size());
+		EXPECT_EQ(0, objs.count(nullptr));
+
+		slab_stats(&pool, &stats);
+		EXPECT_EQ(4, stats.slabs);
+		EXPECT_EQ(pool.per_slab * 3 + 1, stats.in_use);
+
+		for (void *obj : objs)
+			slab_free(&pool, obj);
+		slab_stats(&pool, &stats);
+		EXPECT_EQ(pool.per_slab * 4, stats.free);
+		slab_destroy(&pool);
+	}
+
+	static void *churn(void *a) {
+		struct slab_pool *pool = (struct slab_pool *)a;
+		std::vector<struct Obj *> held;
+		for (int round = 0; round < 200; round++) {
+			for (int i = 0; i < 50; i++) {
+				struct Obj *obj = (struct Obj *)slab_alloc(pool);
+				for (int j = 0; j < 25; j++)
+					obj->a[j] = round;
+				held.push_back(obj);
+			}
+			for (struct Obj *obj : held) {
+				for (int j = 0; j < 25; j++)
+					EXPECT_EQ(round, obj->a[j]);
+				slab_free(pool, obj);
+			}
+			held.clear();
+		}
+		return NULL;
+	}
+
+	// No object is ever handed to two threads at once
+	TEST(SlabTest, Threads) {
+		const int n = 4;
+		struct slab_pool pool;
+		struct slab_stats stats;
+		pthread_t threads[n];
+		slab_init(&pool, sizeof(struct Obj));
+
+		for (int i = 0; i < n; i++)
+			pthread_create(&threads[i], NULL, churn, &pool);
+		for (int i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+
+		slab_stats(&pool, &stats);
+		EXPECT_EQ(0, stats.in_use);
+		slab_destroy(&pool);
+	}
+}
@@ -0,0 +1,417 @@
+#include "gtest/gtest.h"
+#include <pthread.h>
+#include <vector>
+
+extern "C" {
+
+#include "../table.h"
+
+	struct Counts {
+		int n_init = 0;
+		int n_run = 0;
+		int n_destroy = 0;
+		int n_interrupt = 0;
+		int runs_left = -1; // -1 to run until stopped
+	};
+
+	static void count_init(void *a) {
+		((struct Counts *)a)->n_init++;
+	}
+	static void count_run(void *a) {
+		struct Counts *c = (struct Counts *)a;
+		c->n_run++;
+		if (c->runs_left > 0)
+			c->runs_left--;
+	}
+	static void count_destroy(void *a) {
+		((struct Counts *)a)->n_destroy++;
+	}
+	static void count_interrupt(void *a) {
+		((struct Counts *)a)->n_interrupt++;
+	}
+	static bool count_done(void *a) {
+		return ((struct Counts *)a)->runs_left == 0;
+	}
+}
+
+namespace {
+	static task_id_t add(struct task_table *t, struct Counts *c) {
+		return task_table_add(t, count_init, count_run, count_destroy,
+				      count_interrupt, count_done, c);
+	}
+
+	static task_id_t add_waiting(struct task_table *t, struct Counts *c) {
+		return task_table_add_waiting(t, count_init, count_run,
+					      count_destroy, count_interrupt,
+					      count_done, c);
+	}
+
+	TEST(TableTest, Lifecycle) {
+		struct task_table t;
+		struct Counts c;
+		c.runs_left = 2;
+		task_table_init(&t);
+
+		task_id_t id = add(&t, &c);
+		EXPECT_NE(TASK_ID_NONE, id);
+		EXPECT_EQ(1, task_table_size(&t));
+		task_table_run(&t);
+		EXPECT_EQ(1, c.n_init);
+		EXPECT_EQ(1, c.n_run);
+		task_table_run(&t);
+		EXPECT_EQ(2, c.n_run);
+		EXPECT_EQ(0, c.n_destroy);
+
+		// Removed on the tick after it is done
+		task_table_run(&t);
+		EXPECT_EQ(2, c.n_run);
+		EXPECT_EQ(1, c.n_destroy);
+		EXPECT_EQ(0, task_table_size(&t));
+
+		task_table_destroy(&t);
+	}
+
+	TEST(TableTest, Stop) {
+		struct task_table t;
+		struct Counts c;
+		task_table_init(&t);
+
+		task_id_t id = add(&t, &c);
+		// Dropped, as the task is not initialized by the next run
+		EXPECT_TRUE(task_table_stop(&t, id));
+		EXPECT_NE(TASK_ID_NONE, t.stops);
+		task_table_run(&t);
+		EXPECT_EQ(TASK_ID_NONE, t.stops);
+		EXPECT_EQ(1, c.n_run);
+		EXPECT_EQ(0, c.n_interrupt);
+
+		EXPECT_TRUE(task_table_stop(&t, id));
+		EXPECT_TRUE(task_table_stop(&t, id));
+		task_table_run(&t);
+		EXPECT_EQ(1, c.n_run);
+		EXPECT_EQ(1, c.n_interrupt);
+		task_table_run(&t);
+		EXPECT_EQ(1, c.n_destroy);
+		EXPECT_EQ(0, task_table_size(&t));
+
+		// The id is stale now, even once its slot is reused
+		EXPECT_FALSE(task_table_stop(&t, id));
+		task_id_t again = add(&t, &c);
+		EXPECT_EQ(id & 0xffffff, again & 0xffffff);
+		EXPECT_NE(id, again);
+		EXPECT_FALSE(task_table_stop(&t, id));
+		EXPECT_FALSE(task_table_stop(&t, TASK_ID_NONE));
+		EXPECT_FALSE(task_table_stop(&t, 12345));
+
+		task_table_destroy(&t);
+	}
+
+	// Removing tasks moves others around, but their ids stay valid
+	TEST(TableTest, SwapRemove) {
+		const int n = 200;
+		struct task_table t;
+		std::vector<struct Counts> c(n);
+		std::vector<task_id_t> ids(n);
+		task_table_init(&t);
+
+		for (int i = 0; i < n; i++) {
+			c[i].runs_left = i % 3 == 0 ? 1 : -1;
+			ids[i] = add(&t, &c[i]);
+		}
+		task_table_run(&t);
+		task_table_run(&t);
+		EXPECT_EQ(n - (n + 2) / 3, task_table_size(&t));
+
+		for (int i = 0; i < n; i++) {
+			EXPECT_EQ(i % 3 == 0 ? 1 : 2, c[i].n_run);
+			if (i % 3 == 0)
+				continue;
+			uint32_t slot = ids[i] & ((1u << TABLE_SLOT_BITS) - 1);
+			uint32_t index = t.chunks[slot >> TABLE_CHUNK_BITS]
+				->slots[slot & ((1u << TABLE_CHUNK_BITS) - 1)].index;
+			EXPECT_EQ(&c[i], t.data[index]);
+			EXPECT_TRUE(task_table_stop(&t, ids[i]));
+		}
+		task_table_run(&t);
+		task_table_run(&t);
+		EXPECT_EQ(0, task_table_size(&t));
+		for (int i = 0; i < n; i++) {
+			EXPECT_EQ(1, c[i].n_init);
+			EXPECT_EQ(1, c[i].n_destroy);
+			EXPECT_EQ(i % 3 == 0 ? 0 : 1, c[i].n_interrupt);
+		}
+
+		// Slots are recycled, oldest first
+		task_id_t id = add(&t, &c[0]);
+		EXPECT_EQ(ids[0] & 0xffffff, id & 0xffffff);
+		EXPECT_EQ(n, t.nslots);
+
+		task_table_destroy(&t);
+	}
+
+	TEST(TableTest, Waiting) {
+		struct task_table t;
+		struct Counts c;
+		c.runs_left = 3;
+		task_table_init(&t);
+
+		// Run once when added, then only when readied
+		task_id_t id = add_waiting(&t, &c);
+		EXPECT_TRUE(task_table_busy(&t));
+		task_table_run(&t);
+		EXPECT_EQ(1, c.n_init);
+		EXPECT_EQ(1, c.n_run);
+		EXPECT_FALSE(task_table_busy(&t));
+		task_table_run(&t);
+		EXPECT_EQ(1, c.n_run);
+
+		// Once per tick, however often it was readied
+		EXPECT_TRUE(task_table_ready(&t, id));
+		EXPECT_TRUE(task_table_ready(&t, id));
+		EXPECT_TRUE(task_table_busy(&t));
+		task_table_run(&t);
+		task_table_run(&t);
+		EXPECT_EQ(2, c.n_run);
+
+		// Removed on the tick after it is done, without a ready
+		EXPECT_TRUE(task_table_ready(&t, id));
+		task_table_run(&t);
+		EXPECT_EQ(3, c.n_run);
+		EXPECT_EQ(0, c.n_destroy);
+		task_table_run(&t);
+		EXPECT_EQ(1, c.n_destroy);
+		EXPECT_EQ(0, task_table_size(&t));
+		EXPECT_FALSE(task_table_busy(&t));
+		EXPECT_FALSE(task_table_ready(&t, id));
+
+		// Stops reach waiting tasks without a ready
+		struct Counts d;
+		id = add_waiting(&t, &d);
+		task_table_run(&t);
+		EXPECT_TRUE(task_table_stop(&t, id));
+		task_table_run(&t);
+		EXPECT_EQ(1, d.n_run);
+		EXPECT_EQ(1, d.n_interrupt);
+		task_table_run(&t);
+		EXPECT_EQ(1, d.n_destroy);
+		EXPECT_EQ(0, task_table_size(&t));
+
+		task_table_destroy(&t);
+	}
+
+	// Polled and waiting tasks keep their places as either kind comes
+	// and goes
+	TEST(TableTest, Mixed) {
+		const int n = 3000;
+		struct task_table t;
+		std::vector<struct Counts> c(n);
+		std::vector<task_id_t> ids(n);
+		task_table_init(&t);
+
+		for (int i = 0; i < n; i++) {
+			if (i % 5 == 0)
+				c[i].runs_left = 2;
+			ids[i] = i % 2 ? add_waiting(&t, &c[i]) : add(&t, &c[i]);
+		}
+		EXPECT_EQ(n / 2, t.npolled);
+		task_table_run(&t);
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(1, c[i].n_run);
+
+		// Ready every third task; polled ones run anyway
+		for (int i = 0; i < n; i += 3)
+			EXPECT_TRUE(task_table_ready(&t, ids[i]));
+		task_table_run(&t);
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(i % 2 == 0 || i % 3 == 0 ? 2 : 1, c[i].n_run);
+
+		// The done tasks are gone, and the rest are where their
+		// slots say, each in the part of its kind
+		task_table_run(&t);
+		int left = 0;
+		for (int i = 0; i < n; i++) {
+			bool done = i % 5 == 0 && (i % 2 == 0 || i % 3 == 0);
+			EXPECT_EQ(done ? 1 : 0, c[i].n_destroy);
+			if (done)
+				continue;
+			left++;
+			uint32_t slot = ids[i] & ((1u << TABLE_SLOT_BITS) - 1);
+			uint32_t index = t.chunks[slot >> TABLE_CHUNK_BITS]
+				->slots[slot & ((1u << TABLE_CHUNK_BITS) - 1)].index;
+			EXPECT_EQ(&c[i], t.data[index]);
+			EXPECT_EQ(i % 2 == 0, index < t.npolled);
+		}
+		EXPECT_EQ(left, task_table_size(&t));
+
+		task_table_clear(&t);
+		EXPECT_EQ(0, t.npolled);
+		EXPECT_FALSE(task_table_busy(&t));
+		task_table_destroy(&t);
+	}
+
+	struct Readier {
+		struct task_table *table;
+		std::vector<task_id_t> *ids;
+		int rounds;
+	};
+
+	static void *ready_thread(void *a) {
+		struct Readier *r = (struct Readier *)a;
+		for (int k = 0; k < r->rounds; k++)
+			for (task_id_t id : *r->ids)
+				task_table_ready(r->table, id);
+		return NULL;
+	}
+
+	// Readies from another thread are never lost: the last one is
+	// always followed by a run
+	TEST(TableTest, ReadyFromThread) {
+		const int n = 1000;
+		struct task_table t;
+		std::vector<struct Counts> c(n);
+		std::vector<task_id_t> ids(n);
+		task_table_init(&t);
+
+		for (int i = 0; i < n; i++)
+			ids[i] = add_waiting(&t, &c[i]);
+		task_table_run(&t);
+
+		struct Readier r = { &t, &ids, 50 };
+		pthread_t thread;
+		pthread_create(&thread, NULL, ready_thread, &r);
+		for (int k = 0; k < 100; k++)
+			task_table_run(&t);
+		pthread_join(thread, NULL);
+		task_table_run(&t);
+		EXPECT_FALSE(task_table_busy(&t));
+
+		std::vector<int> runs(n);
+		for (int i = 0; i < n; i++)
+			runs[i] = c[i].n_run;
+		for (task_id_t id : ids)
+			EXPECT_TRUE(task_table_ready(&t, id));
+		task_table_run(&t);
+		for (int i = 0; i < n; i++) {
+			EXPECT_GE(runs[i], 2);
+			EXPECT_LE(runs[i], 51);
+			EXPECT_EQ(runs[i] + 1, c[i].n_run);
+		}
+
+		task_table_clear(&t);
+		task_table_destroy(&t);
+	}
+
+	struct Stopper {
+		struct task_table *table;
+		std::vector<task_id_t> *ids;
+		int stopped = 0;
+	};
+
+	static void *stop_thread(void *a) {
+		struct Stopper *s = (struct Stopper *)a;
+		for (task_id_t id : *s->ids)
+			__atomic_add_fetch(&s->stopped, task_table_stop(s->table, id),
+					   __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	// Stops from another thread while the table runs and removes tasks
+	TEST(TableTest, StopFromThread) {
+		const int n = 10000;
+		struct task_table t;
+		std::vector<struct Counts> c(n);
+		std::vector<task_id_t> ids(n);
+		task_table_init(&t);
+
+		for (int i = 0; i < n; i++)
+			ids[i] = add(&t, &c[i]);
+		task_table_run(&t);
+
+		struct Stopper s = { &t, &ids };
+		pthread_t thread;
+		pthread_create(&thread, NULL, stop_thread, &s);
+		while (task_table_size(&t) > 0 &&
+		       __atomic_load_n(&s.stopped, __ATOMIC_RELAXED) < n)
+			task_table_run(&t);
+		pthread_join(thread, NULL);
+		while (task_table_size(&t) > 0)
+			task_table_run(&t);
+
+		EXPECT_EQ(n, s.stopped);
+		for (int i = 0; i < n; i++) {
+			EXPECT_EQ(1, c[i].n_interrupt);
+			EXPECT_EQ(1, c[i].n_destroy);
+		}
+		for (task_id_t id : ids)
+			EXPECT_FALSE(task_table_stop(&t, id));
+
+		task_table_destroy(&t);
+	}
+
+	struct Spawner {
+		struct task_table *table;
+		struct Counts child;
+		bool spawned = false;
+	};
+
+	static void spawn_run(void *a) {
+		struct Spawner *s = (struct Spawner *)a;
+		if (!s->spawned) {
+			s->spawned = true;
+			add(s->table, &s->child);
+		}
+	}
+
+	// Tasks can add tasks while the table runs, growing it
+	TEST(TableTest, AddWhileRunning) {
+		const int n = 100;
+		struct task_table t;
+		std::vector<struct Spawner> s(n);
+		task_table_init(&t);
+
+		for (int i = 0; i < n; i++) {
+			s[i].table = &t;
+			task_table_add(&t, NULL, spawn_run, NULL, NULL, NULL, &s[i]);
+		}
+		task_table_run(&t);
+		for (int i = 0; i < n; i++)
+			EXPECT_EQ(1, s[i].child.n_run);
+		EXPECT_GE(t.cap, 2 * n);
+
+		// Clear interrupts the running tasks and destroys everything
+		task_table_clear(&t);
+		EXPECT_EQ(0, task_table_size(&t));
+		for (int i = 0; i < n; i++) {
+			EXPECT_EQ(1, s[i].child.n_interrupt);
+			EXPECT_EQ(1, s[i].child.n_destroy);
+		}
+
+		task_table_destroy(&t);
+	}
+
+	// A waiting task that adds a polled one is moved to make room,
+	// and its step carries on with it rather than the new task
+	TEST(TableTest, WaitingAddsPolled) {
+		const int n = 10;
+		struct task_table t;
+		std::vector<struct Spawner> s(n);
+		task_table_init(&t);
+
+		for (int i = 0; i < n; i++) {
+			s[i].table = &t;
+			task_table_add_waiting(&t, NULL, spawn_run, NULL, NULL, NULL,
+					       &s[i]);
+		}
+		task_table_run(&t);
+		task_table_run(&t);
+		EXPECT_EQ(n, task_table_size(&t));
+		for (int i = 0; i < n; i++) {
+			EXPECT_EQ(1, s[i].child.n_init);
+			EXPECT_EQ(1, s[i].child.n_run);
+			EXPECT_EQ(0, s[i].child.n_destroy);
+		}
+
+		task_table_clear(&t);
+		task_table_destroy(&t);
+	}
+}
@@ -0,0 +1,113 @@
+#include "gtest/gtest.h"
+#include <pthread.h>
+#include <string>
+
+extern "C" {
+
+#include "../trace.h"
+}
+
+namespace {
+	// Returns what TRACE dumps
+	static std::string dump(struct trace *trace) {
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&buf, &len);
+		EXPECT_TRUE(trace_dump(trace, f));
+		fclose(f);
+		std::string s(buf, len);
+		free(buf);
+		return s;
+	}
+
+	static size_t count(const std::string &s, const std::string &what) {
+		size_t n = 0;
+		for (size_t at = s.find(what); at != std::string::npos;
+		     at = s.find(what, at + 1))
+			n++;
+		return n;
+	}
+
+	TEST(TraceTest, Events) {
+		struct trace t;
+		int obj;
+		trace_init(&t);
+
+		// Nothing is recorded while off
+		trace_instant(&t, "off", NULL, NULL);
+		EXPECT_FALSE(trace_enabled(&t));
+		EXPECT_EQ(NULL, t.rings);
+
+		trace_enable(&t, true);
+		uint64_t start = trace_clock();
+		trace_complete(&t, "call", start, &obj, (const void *)dump);
+		trace_instant(&t, "state", "RUNNING", &obj);
+
+		std::string s = dump(&t);
+		EXPECT_EQ(0, s.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+		EXPECT_EQ(0, count(s, "\"off\""));
+		EXPECT_EQ(1, count(s, "\"name\":\"call\""));
+		EXPECT_EQ(1, count(s, "\"ph\":\"X\""));
+		EXPECT_EQ(1, count(s, "\"ph\":\"i\""));
+		EXPECT_EQ(1, count(s, "\"state\":\"RUNNING\""));
+		char addr[32];
+		snprintf(addr, sizeof(addr), "\"obj\":\"%p\"", (void *)&obj);
+		EXPECT_EQ(2, count(s, addr));
+		EXPECT_EQ(s.size() - 4, s.rfind("\n]}\n"));
+
+		trace_destroy(&t);
+	}
+
+	// The ring keeps the newest TRACE_EVENTS events
+	TEST(TraceTest, Wraps) {
+		struct trace t;
+		trace_init(&t);
+		trace_enable(&t, true);
+
+		trace_instant(&t, "old", NULL, NULL);
+		for (int i = 0; i < TRACE_EVENTS; i++)
+			trace_instant(&t, "new", NULL, NULL);
+		std::string s = dump(&t);
+		EXPECT_EQ(0, count(s, "\"old\""));
+		EXPECT_EQ(TRACE_EVENTS, count(s, "\"new\""));
+
+		trace_destroy(&t);
+	}
+
+	struct Recorder {
+		struct trace *trace;
+		int n;
+	};
+
+	static void *record_thread(void *a) {
+		struct Recorder *r = (struct Recorder *)a;
+		for (int i = 0; i < r->n; i++)
+			trace_instant(r->trace, "thread", NULL, NULL);
+		return NULL;
+	}
+
+	// Each thread gets a ring of its own, and dumps can run alongside
+	TEST(TraceTest, Threads) {
+		const int nthreads = 4, n = 1000;
+		struct trace t;
+		trace_init(&t);
+		trace_enable(&t, true);
+
+		struct Recorder r = { &t, n };
+		pthread_t threads[nthreads];
+		for (int i = 0; i < nthreads; i++)
+			pthread_create(&threads[i], NULL, record_thread, &r);
+		dump(&t);
+		for (int i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+
+		std::string s = dump(&t);
+		EXPECT_EQ(nthreads * n, count(s, "\"thread\""));
+		int rings = 0;
+		for (struct trace_ring *ring = t.rings; ring; ring = ring->next)
+			rings++;
+		EXPECT_EQ(nthreads, rings);
+
+		trace_destroy(&t);
+	}
+}
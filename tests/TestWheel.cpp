@@ -0,0 +1,175 @@
+#include "gtest/gtest.h"
+
+extern "C" {
+
+#include "../wheel.h"
+
+	struct Timer {
+		struct list_elem elem;
+		uint64_t expires;
+	};
+
+	static uint64_t timer_expires(const struct list_elem *e, void *aux) {
+		(void)aux;
+		return list_entry(e, struct Timer, elem)->expires;
+	}
+}
+
+namespace {
+	TEST(WheelTest, Init) {
+		struct timer_wheel w;
+		wheel_init(&w, 42, timer_expires, NULL);
+		EXPECT_EQ(42, w.now);
+		EXPECT_EQ(0, w.count);
+
+		struct list expired;
+		list_init(&expired);
+		wheel_advance(&w, 1000000, &expired);
+		EXPECT_EQ(1000000, w.now);
+		EXPECT_TRUE(list_empty(&expired));
+	}
+
+	// Every timer must come out exactly at its expiry, across all levels
+	TEST(WheelTest, ExpiresOnTime) {
+		const uint64_t due[] = { 1, 2, 63, 64, 65, 100, 4095, 4096, 4097,
+		                         70000, 262143, 262144, 300001 };
+		const int n = sizeof(due) / sizeof(due[0]);
+		struct Timer t[n];
+		struct timer_wheel w;
+		wheel_init(&w, 5, timer_expires, NULL);
+
+		for (int i = 0; i < n; i++) {
+			t[i].expires = 5 + due[i];
+			wheel_insert(&w, &t[i].elem);
+		}
+		EXPECT_EQ(n, w.count);
+
+		struct list expired;
+		list_init(&expired);
+		int fired = 0;
+		for (uint64_t now = 6; now <= 5 + 300001; now++) {
+			wheel_advance(&w, now, &expired);
+			while (!list_empty(&expired)) {
+				struct Timer *timer =
+					list_entry(list_pop_front(&expired), struct Timer, elem);
+				EXPECT_EQ(now, timer->expires);
+				fired++;
+			}
+		}
+		EXPECT_EQ(n, fired);
+		EXPECT_EQ(0, w.count);
+	}
+
+	TEST(WheelTest, AdvanceSkipsAhead) {
+		struct Timer a, b;
+		struct timer_wheel w;
+		wheel_init(&w, 0, timer_expires, NULL);
+
+		a.expires = 10;
+		b.expires = 5000;
+		wheel_insert(&w, &a.elem);
+		wheel_insert(&w, &b.elem);
+
+		struct list expired;
+		list_init(&expired);
+		wheel_advance(&w, 4999, &expired);
+		EXPECT_EQ(1, list_size(&expired));
+		EXPECT_EQ(&a.elem, list_front(&expired));
+
+		wheel_advance(&w, 6000, &expired);
+		EXPECT_EQ(2, list_size(&expired));
+		EXPECT_EQ(&b.elem, list_back(&expired));
+		EXPECT_EQ(0, w.count);
+	}
+
+	TEST(WheelTest, PastDueFiresNextTick) {
+		struct Timer a;
+		struct timer_wheel w;
+		wheel_init(&w, 100, timer_expires, NULL);
+
+		a.expires = 50;
+		wheel_insert(&w, &a.elem);
+
+		struct list expired;
+		list_init(&expired);
+		wheel_advance(&w, 100, &expired);
+		EXPECT_TRUE(list_empty(&expired));
+		wheel_advance(&w, 101, &expired);
+		EXPECT_EQ(&a.elem, list_front(&expired));
+	}
+
+	TEST(WheelTest, FarFuture) {
+		struct Timer a;
+		struct timer_wheel w;
+		wheel_init(&w, 0, timer_expires, NULL);
+
+		a.expires = ((uint64_t)1 << 24) + 5;
+		wheel_insert(&w, &a.elem);
+
+		struct list expired;
+		list_init(&expired);
+		wheel_advance(&w, a.expires - 1, &expired);
+		EXPECT_TRUE(list_empty(&expired));
+		wheel_advance(&w, a.expires, &expired);
+		EXPECT_EQ(&a.elem, list_front(&expired));
+	}
+
+	TEST(WheelTest, NextExpiry) {
+		struct Timer a, b, c;
+		struct timer_wheel w;
+		wheel_init(&w, 1000, timer_expires, NULL);
+		EXPECT_EQ(UINT64_MAX, wheel_next_expiry(&w));
+
+		// Far out, the answer is when the slot cascades
+		a.expires = 1000 + 5000;
+		wheel_insert(&w, &a.elem);
+		uint64_t next = wheel_next_expiry(&w);
+		EXPECT_GT(next, 1000);
+		EXPECT_LE(next, a.expires);
+
+		b.expires = 1000 + 100;
+		wheel_insert(&w, &b.elem);
+		next = wheel_next_expiry(&w);
+		EXPECT_GT(next, 1000);
+		EXPECT_LE(next, b.expires);
+
+		// Within the first level it is exact
+		c.expires = 1000 + 63;
+		wheel_insert(&w, &c.elem);
+		EXPECT_EQ(c.expires, wheel_next_expiry(&w));
+
+		// Following the hints never skips past a timer
+		struct list expired;
+		list_init(&expired);
+		while (w.count > 0) {
+			next = wheel_next_expiry(&w);
+			wheel_advance(&w, next, &expired);
+			EXPECT_EQ(next, w.now);
+		}
+		EXPECT_EQ(3, list_size(&expired));
+		EXPECT_EQ(a.expires, w.now);
+	}
+
+	TEST(WheelTest, RemoveAndFlush) {
+		struct Timer a, b;
+		struct timer_wheel w;
+		wheel_init(&w, 0, timer_expires, NULL);
+
+		a.expires = 3;
+		b.expires = 10000;
+		wheel_insert(&w, &a.elem);
+		wheel_insert(&w, &b.elem);
+		wheel_remove(&w, &a.elem);
+		EXPECT_EQ(1, w.count);
+
+		struct list expired;
+		list_init(&expired);
+		wheel_advance(&w, 10, &expired);
+		EXPECT_TRUE(list_empty(&expired));
+
+		wheel_flush(&w, &expired);
+		EXPECT_EQ(0, w.count);
+		EXPECT_EQ(1, list_size(&expired));
+		EXPECT_EQ(&b.elem, list_front(&expired));
+	}
+}
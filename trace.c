@@ -0,0 +1,209 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (TRACE_EVENTS - 1)
+
+/* Source of trace ids, never 0. */
+static uint64_t next_id = 1;
+
+/* The ring the calling thread last recorded into, and its trace. */
+static __thread uint64_t cached_id;
+static __thread struct trace_ring *cached_ring;
+
+/* Initializes TRACE, with recording off. */
+void trace_init(struct trace *trace) {
+    _Static_assert((TRACE_EVENTS & RING_MASK) == 0,
+                   "TRACE_EVENTS must be a power of two");
+    trace->enabled = false;
+    trace->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    trace->rings = NULL;
+}
+
+/* Frees TRACE's rings.  No thread may be recording into it. */
+void trace_destroy(struct trace *trace) {
+    struct trace_ring *ring = trace->rings;
+
+    while (ring) {
+        struct trace_ring *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    trace->rings = NULL;
+}
+
+/* Turns recording into TRACE on or off.  Safe to call from any
+   thread.  Events already recorded are kept either way. */
+void trace_enable(struct trace *trace, bool enable) {
+    __atomic_store_n(&trace->enabled, enable, __ATOMIC_RELAXED);
+}
+
+/* Returns true if TRACE is recording. */
+bool trace_enabled(struct trace *trace) {
+    return __atomic_load_n(&trace->enabled, __ATOMIC_RELAXED);
+}
+
+/* Returns the time, as trace events take it. */
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the calling thread's ring in TRACE, creating it on first
+   use.  Returns NULL if out of memory. */
+static struct trace_ring *ring_get(struct trace *trace) {
+    uint32_t tid;
+    struct trace_ring *ring;
+
+    if (cached_id == trace->id)
+        return cached_ring;
+
+    /* The thread may have a ring from before it recorded into
+       another trace. */
+    tid = (uint32_t)syscall(SYS_gettid);
+    for (ring = __atomic_load_n(&trace->rings, __ATOMIC_ACQUIRE); ring;
+         ring = ring->next)
+        if (ring->tid == tid)
+            break;
+
+    if (!ring) {
+        ring = (struct trace_ring *)malloc(sizeof(struct trace_ring));
+        if (!ring) {
+            perror("malloc(struct trace_ring)");
+            return NULL;
+        }
+        ring->tid = tid;
+        ring->head = 0;
+        ring->done = 0;
+        ring->next = __atomic_load_n(&trace->rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace->rings, &ring->next, ring,
+                                            false, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            continue;
+    }
+    cached_id = trace->id;
+    cached_ring = ring;
+    return ring;
+}
+
+/* Appends an event to the calling thread's ring in TRACE. */
+static void record(struct trace *trace,
+                   uint64_t ts,
+                   uint64_t dur,
+                   const char *name,
+                   const char *state,
+                   const void *obj,
+                   const void *fn) {
+    struct trace_ring *ring = ring_get(trace);
+    struct trace_event *e;
+    uint64_t h;
+
+    if (!ring)
+        return;
+
+    /* Claim the slot before writing it, so that a dump that sees
+       any of the new event also sees that the old one is gone. */
+    h = ring->head;
+    __atomic_store_n(&ring->head, h + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e = &ring->events[h & RING_MASK];
+    e->ts = ts;
+    e->dur = dur;
+    e->name = name;
+    e->state = state;
+    e->obj = obj;
+    e->fn = fn;
+    __atomic_store_n(&ring->done, h + 1, __ATOMIC_RELEASE);
+}
+
+/* Records a call NAME, of FN on OBJ (either may be NULL), that
+   started at START, from trace_clock(), and ends now.  Does
+   nothing if TRACE is not recording. */
+void trace_complete(struct trace *trace,
+                    const char *name,
+                    uint64_t start,
+                    const void *obj,
+                    const void *fn) {
+    if (trace_enabled(trace))
+        record(trace, start, trace_clock() - start, name, NULL, obj, fn);
+}
+
+/* Records that NAME happened to OBJ, which may be NULL, just now,
+   with an optional STATE.  Does nothing if TRACE is not
+   recording. */
+void trace_instant(struct trace *trace,
+                   const char *name,
+                   const char *state,
+                   const void *obj) {
+    if (trace_enabled(trace))
+        record(trace, trace_clock(), TRACE_INSTANT, name, state, obj, NULL);
+}
+
+/* Writes event E of thread TID as a Chrome trace event, preceded by
+   a comma unless FIRST. */
+static void write_event(FILE *f,
+                        const struct trace_event *e,
+                        uint32_t tid,
+                        bool first) {
+    fprintf(f, "%s\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f",
+            first ? "" : ",", e->name, (int)getpid(), tid, e->ts / 1000.0);
+    if (e->dur == TRACE_INSTANT)
+        fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"");
+    else
+        fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f", e->dur / 1000.0);
+
+    fprintf(f, ",\"args\":{");
+    if (e->obj)
+        fprintf(f, "\"obj\":\"%p\"%s", e->obj, e->fn || e->state ? "," : "");
+    if (e->fn)
+        fprintf(f, "\"fn\":\"%p\"%s", e->fn, e->state ? "," : "");
+    if (e->state)
+        fprintf(f, "\"state\":\"%s\"", e->state);
+    fprintf(f, "}}");
+}
+
+/* Writes the events in TRACE's rings to F as Chrome trace JSON,
+   thread by thread, oldest first.  Safe to call from any thread,
+   alongside recording.  Returns false on a write error. */
+bool trace_dump(struct trace *trace, FILE *f) {
+    struct trace_event *copy;
+    bool first = true;
+
+    copy = (struct trace_event *)malloc(sizeof(struct trace_event) *
+                                        TRACE_EVENTS);
+    if (!copy) {
+        perror("malloc(trace_dump)");
+        return false;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (struct trace_ring *ring =
+             __atomic_load_n(&trace->rings, __ATOMIC_ACQUIRE);
+         ring; ring = ring->next) {
+        uint64_t done = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+        uint64_t from = done > TRACE_EVENTS ? done - TRACE_EVENTS : 0;
+        uint64_t head;
+
+        for (uint64_t i = from; i < done; i++)
+            copy[i & RING_MASK] = ring->events[i & RING_MASK];
+
+        /* Slots claimed since the copy began may have been torn. */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        if (head > TRACE_EVENTS && head - TRACE_EVENTS > from)
+            from = head - TRACE_EVENTS;
+
+        for (uint64_t i = from; i < done; i++) {
+            write_event(f, &copy[i & RING_MASK], ring->tid, first);
+            first = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    free(copy);
+    return !ferror(f);
+}
@@ -0,0 +1,80 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+/* Event tracing into per-thread ring buffers.
+
+   Each thread that records into a trace gets a ring of its own,
+   created on its first event, so recording takes no lock and
+   shares no cache line with other threads: it is a clock read, a
+   few stores and one release store of the ring's head.  A ring
+   keeps the last TRACE_EVENTS events of its thread, overwriting
+   the oldest.
+
+   trace_dump() writes every ring out as Chrome trace JSON, which
+   chrome://tracing and ui.perfetto.dev both load: calls as
+   complete events, with their duration, and the rest as instant
+   events.  It may be called from any thread while others record;
+   events overwritten while they are being copied are left out
+   rather than written torn.
+
+   Recording is off until trace_enable().  While off, an event
+   site costs a single relaxed load.  Rings live until
+   trace_destroy(), which must not race with recording. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 16384 /* Per thread, a power of two. */
+#endif
+
+/* One event.  NAME and STATE must be string literals, or otherwise
+   outlive the trace. */
+struct trace_event {
+    uint64_t ts;       /* CLOCK_MONOTONIC ns. */
+    uint64_t dur;      /* ns, or TRACE_INSTANT. */
+    const char *name;
+    const char *state; /* Optional. */
+    const void *obj;   /* Optional, say the task. */
+    const void *fn;    /* Optional, the fn called. */
+};
+
+#define TRACE_INSTANT UINT64_MAX
+
+/* The events of one thread. */
+struct trace_ring {
+    struct trace_ring *next; /* In the trace's list of rings. */
+    uint32_t tid;            /* Of the thread, for the dump. */
+    uint64_t head;           /* Events begun, atomic. */
+    uint64_t done;           /* Events finished, atomic. */
+    struct trace_event events[TRACE_EVENTS];
+};
+
+/* Trace. */
+struct trace {
+    bool enabled;             /* Atomic. */
+    uint64_t id;              /* Tells the rings of this trace apart. */
+    struct trace_ring *rings; /* Lock-free list, newest first. */
+};
+
+void trace_init(struct trace *);
+void trace_destroy(struct trace *);
+void trace_enable(struct trace *, bool);
+bool trace_enabled(struct trace *);
+
+uint64_t trace_clock(void);
+void trace_complete(struct trace *,
+                    const char *name,
+                    uint64_t start,
+                    const void *obj,
+                    const void *fn);
+void trace_instant(struct trace *,
+                   const char *name,
+                   const char *state,
+                   const void *obj);
+
+bool trace_dump(struct trace *, FILE *);
+
+#endif /* trace.h */
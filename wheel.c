@@ -0,0 +1,143 @@
+#include "wheel.h"
+#include <assert.h>
+
+/* Moves every element of FROM to the back of TO. */
+static void move_all(struct list *to, struct list *from) {
+    list_splice(list_end(to), list_begin(from), list_end(from));
+}
+
+/* Returns the slot of LEVEL that tick T falls into. */
+static inline unsigned slot_index(uint64_t t, unsigned level) {
+    return (t >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+}
+
+/* Files ELEM, due at EXPIRES, into the lowest level of WHEEL
+   whose range covers it. */
+static void file_timer(struct timer_wheel *wheel, struct list_elem *elem,
+                       uint64_t expires) {
+    uint64_t delta = expires - wheel->now;
+    unsigned level;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < (uint64_t)1 << ((level + 1) * WHEEL_BITS))
+            break;
+
+    /* Too far out for the top level, park it in the slot just
+       before the current one so it gets re-filed when it comes
+       around. */
+    if (delta >= (uint64_t)1 << (WHEEL_LEVELS * WHEEL_BITS))
+        expires = wheel->now +
+                  ((uint64_t)1 << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+
+    list_push_back(&wheel->slots[level][slot_index(expires, level)], elem);
+}
+
+/* Re-files every timer in slot INDEX of LEVEL. Returns INDEX so
+   the caller knows whether the level wrapped around. */
+static unsigned cascade(struct timer_wheel *wheel, unsigned level,
+                        unsigned index) {
+    struct list timers;
+
+    list_init(&timers);
+    move_all(&timers, &wheel->slots[level][index]);
+    while (!list_empty(&timers)) {
+        struct list_elem *e = list_pop_front(&timers);
+        file_timer(wheel, e, wheel->expires(e, wheel->aux));
+    }
+    return index;
+}
+
+/* Initializes WHEEL as an empty wheel at tick NOW. EXPIRES gives
+   the expiry of each element inserted into it. */
+void wheel_init(struct timer_wheel *wheel, uint64_t now,
+                wheel_expires_func *expires, void *aux) {
+    assert(wheel != NULL);
+    assert(expires != NULL);
+
+    wheel->now = now;
+    wheel->count = 0;
+    wheel->expires = expires;
+    wheel->aux = aux;
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++)
+        for (unsigned s = 0; s < WHEEL_SLOTS; s++)
+            list_init(&wheel->slots[l][s]);
+}
+
+/* Inserts ELEM into WHEEL. An element that is already due will
+   be returned by the next wheel_advance() that moves time
+   forward. */
+void wheel_insert(struct timer_wheel *wheel, struct list_elem *elem) {
+    uint64_t expires = wheel->expires(elem, wheel->aux);
+
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    file_timer(wheel, elem, expires);
+    wheel->count++;
+}
+
+/* Removes ELEM, which must be in WHEEL, before it expires. */
+void wheel_remove(struct timer_wheel *wheel, struct list_elem *elem) {
+    assert(wheel->count > 0);
+    list_remove(elem);
+    wheel->count--;
+}
+
+/* Moves WHEEL forward to tick NOW, appending every timer that
+   expired on the way to EXPIRED. */
+void wheel_advance(struct timer_wheel *wheel, uint64_t now,
+                   struct list *expired) {
+    /* Nothing to expire on the way, just jump. */
+    if (wheel->count == 0 && now > wheel->now)
+        wheel->now = now;
+
+    while (wheel->now < now) {
+        unsigned index = slot_index(++wheel->now, 0);
+        struct list *slot = &wheel->slots[0][index];
+
+        if (index == 0)
+            for (unsigned l = 1; l < WHEEL_LEVELS; l++)
+                if (cascade(wheel, l, slot_index(wheel->now, l)) != 0)
+                    break;
+
+        wheel->count -= list_size(slot);
+        move_all(expired, slot);
+
+        if (wheel->count == 0)
+            wheel->now = now;
+    }
+}
+
+/* Removes every timer from WHEEL, whether due or not, appending
+   them to OUT. */
+void wheel_flush(struct timer_wheel *wheel, struct list *out) {
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++)
+        for (unsigned s = 0; s < WHEEL_SLOTS; s++)
+            move_all(out, &wheel->slots[l][s]);
+    wheel->count = 0;
+}
+
+/* Returns a tick at or before which the next timer in WHEEL
+   expires, or UINT64_MAX if WHEEL is empty.  The result is exact
+   for timers due within WHEEL_SLOTS ticks.  Further out it is the
+   tick at which the timer's slot cascades, which is early enough
+   to sleep until and then ask again. */
+uint64_t wheel_next_expiry(struct timer_wheel *wheel) {
+    uint64_t next = UINT64_MAX;
+
+    if (wheel->count == 0)
+        return next;
+
+    for (unsigned l = 0; l < WHEEL_LEVELS; l++) {
+        uint64_t block = wheel->now >> (l * WHEEL_BITS);
+        for (unsigned k = 1; k <= WHEEL_SLOTS; k++) {
+            uint64_t t = (block + k) << (l * WHEEL_BITS);
+            if (t >= next)
+                break;
+            if (!list_empty(&wheel->slots[l][slot_index(t, l)])) {
+                next = t;
+                break;
+            }
+        }
+    }
+    return next;
+}
@@ -0,0 +1,54 @@
+#ifndef __WHEEL_H
+#define __WHEEL_H
+
+/* Hierarchical timing wheel.
+
+   Like the list in list.h, the wheel does not allocate memory.
+   Each timer is a `struct list_elem' embedded in some larger
+   structure, and the expiry of an element is looked up through a
+   wheel_expires_func supplied at wheel_init().  An element is
+   either in the wheel or in some other list, never both, so the
+   same list_elem can be used for both.
+
+   Time is measured in abstract wheel ticks.  Level 0 has one slot
+   per tick, and each level above it has slots WHEEL_SLOTS times
+   as wide.  A timer is filed in the lowest level that can hold
+   it, and is moved ("cascaded") down a level whenever the level
+   below wraps around, so wheel_advance() only ever touches the
+   timers that are due plus the occasional cascade.
+
+   Timers further out than the top level can hold are filed in
+   the last slot of the top level and re-filed when it cascades. */
+
+#include "list.h"
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* Returns the expiry, in wheel ticks, of element E given
+   auxiliary data AUX. */
+typedef uint64_t wheel_expires_func(const struct list_elem *e, void *aux);
+
+/* Timing wheel. */
+struct timer_wheel {
+    uint64_t now; /* Last tick processed by wheel_advance(). */
+    size_t count; /* Number of timers in the wheel. */
+    wheel_expires_func *expires;
+    void *aux;
+    struct list slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void wheel_init(struct timer_wheel *, uint64_t now,
+                wheel_expires_func *, void *aux);
+
+void wheel_insert(struct timer_wheel *, struct list_elem *);
+void wheel_remove(struct timer_wheel *, struct list_elem *);
+
+void wheel_advance(struct timer_wheel *, uint64_t now, struct list *expired);
+void wheel_flush(struct timer_wheel *, struct list *out);
+
+uint64_t wheel_next_expiry(struct timer_wheel *);
+
+#endif /* wheel.h */